@@ -0,0 +1,840 @@
+#pragma once
+
+#include "commonFileReading.h"
+#include "fileListStoreAndLoadFromFile.h"
+#include "fileListDisplayCache.h"
+#include "fileSearching.h"
+#include "indexArena.h"
+#include "roaringBitmap.h"
+#include "sortIndexes.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <execution>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Headless benchmarks, run with "-benchmark [fileCount] [threadCount]".
+    Without fileCount they use the saved file lists of all volumes, otherwise a synthetic tree with given number of entries.
+    "-benchmarkScale [fileCount]" checks a single big list (200M entries by default, see runScaleBenchmark).
+*/
+
+// Names are shared between many files, similarly to real file systems. Every file gets its own name with distinctNameCount = fileCount
+static FileList createSyntheticFileList(int fileCount, uint32_t seed = 1, int distinctNameCount = 0) {
+    static const char* extensions[] = { ".dll", ".exe", ".txt", ".png", ".h", ".cpp", ".json", ".mui", ".manifest", "" };
+    std::mt19937 rng(seed);
+    FileList fileList;
+    fileList.files.owned().resize(std::max(fileCount, 1));
+
+    if (distinctNameCount <= 0)
+        distinctNameCount = std::max(fileCount / 4, 1);
+    std::vector<uint32_t> nameReferences(distinctNameCount);
+    appendName(fileList.nameTable.owned(), "C:");
+    std::uniform_int_distribution<int> letterDist('a', 'z');
+    std::uniform_int_distribution<int> lengthDist(3, 20);
+    std::string name;
+    for (auto& reference : nameReferences) {
+        int length = lengthDist(rng);
+        name.clear();
+        for (int i = 0; i < length; ++i)
+            name += char(i == 0 ? letterDist(rng) - 'a' + 'A' : letterDist(rng));
+        name += extensions[rng() % std::size(extensions)];
+        reference = appendName(fileList.nameTable.owned(), name);
+    }
+
+    std::vector<uint32_t> dirs = { 0 };
+    std::uniform_int_distribution<uint32_t> dateDist(217'000'000, 223'000'000);
+    std::lognormal_distribution<float> sizeDist(10, 3);
+    fileList.files[0] = FileInfo{ 0, 0, 1u << 31, dateDist(rng) };
+    for (int i = 1; i < fileCount; ++i) {
+        auto& file = fileList.files[i];
+        // prefer recently created directories so the tree gets some depth
+        auto parentPos = dirs.size() - 1 - std::min<size_t>(dirs.size() - 1, rng() % 64);
+        file.parentIndex = dirs[parentPos];
+        file.nameTableIndexAndInfo = nameReferences[distinctNameCount == fileCount ? i : rng() % distinctNameCount];
+        file.lastModificationDateInMinutes = dateDist(rng);
+        if (rng() % 10 == 0) {
+            file.nameTableIndexAndInfo |= 1u << 31;
+            dirs.push_back(i);
+        } else {
+            file.size = sizeDist(rng);
+        }
+    }
+
+    fileList.lowerNameTable = fileList.nameTable;
+    fastBigStringToLower(fileList.lowerNameTable.data(), fileList.lowerNameTable.size());
+    return fileList;
+}
+
+static void benchmarkDisplayCache(FileListSegments& segments) {
+    constexpr int VisibleRowCount = 40;
+    constexpr int FrameCount = 2'000;
+    constexpr int RowsScrolledPerFrame = 3;
+
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    FileListSearchResults results; // every file in id order
+    findFilesInSegments(results, segments, "", SearchSettings(), threadPool, cancelSearch);
+
+    std::shared_lock lg{ segments.mutex };
+    auto frameStart = [&](int frame) {
+        return std::min(frame * RowsScrolledPerFrame, std::max(results.count - VisibleRowCount, 0));
+    };
+
+    DisplayRow row;
+    auto timer = Timer();
+    for (int frame = 0; frame < FrameCount; ++frame) {
+        int start = frameStart(frame);
+        for (int i = start; i < std::min(start + VisibleRowCount, results.count); ++i)
+            fillDisplayRow(row, segments, results.id(segments, i), segments.generation, cachedLocalTimeOffsetInMinutes());
+    }
+    auto uncachedTime = timer.getTime();
+
+    FileListDisplayCache displayCache;
+    int rowsFormattedOnUiThread = 0;
+    timer.start();
+    for (int frame = 0; frame < FrameCount; ++frame) {
+        int start = frameStart(frame);
+        int end = std::min(start + VisibleRowCount, results.count);
+        displayCache.beginFrame();
+        for (int i = start; i < end; ++i)
+            displayCache.get(segments, results.id(segments, i));
+        rowsFormattedOnUiThread += displayCache.rowsFormattedLastFrame;
+        displayCache.prefetch(segments, results, end, end - start);
+    }
+    auto cachedTime = timer.getTime();
+
+    std::cout << "display rows, formatted every frame: " << uncachedTime / FrameCount * 1'000'000 << " us / frame\n";
+    std::cout << "display rows, cached with prefetch:  " << cachedTime / FrameCount * 1'000'000 << " us / frame ("
+        << rowsFormattedOnUiThread << " rows formatted on ui thread)\n";
+}
+
+// Comparison sorts used before radix sorting, kept as a baseline
+static std::vector<uint32_t> createComparisonSortIndex(size_t count, std::function<bool(uint32_t, uint32_t)> isGreater) {
+    std::vector<uint32_t> ids(count);
+    std::iota(ids.begin(), ids.end(), uint32_t(0));
+    std::sort(std::execution::par, ids.begin(), ids.end(), isGreater);
+    return ids;
+}
+
+static void benchmarkSortIndexes(FileList& fileList) {
+    auto& files = fileList.files;
+    auto& lowerNameTable = fileList.lowerNameTable;
+    auto report = [](const char* name, double before, double after, bool sameOrder) {
+        std::cout << name << " sort index: " << before * 1000 << " ms -> " << after * 1000 << " ms"
+            << (sameOrder ? "" : " (ORDER MISMATCH)") << "\n";
+    };
+    auto keysMatch = [](const std::vector<uint32_t>& a, const std::vector<uint32_t>& b, auto key) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [&](uint32_t x, uint32_t y) { return key(x) == key(y); });
+    };
+
+    auto timer = Timer();
+    auto sizeBefore = createComparisonSortIndex(files.size(), [&](uint32_t a, uint32_t b) { return files[a].size > files[b].size; });
+    auto before = timer.getTime();
+    timer.start();
+    auto sizeAfter = createSizeSortIndex(fileList);
+    report("size", before, timer.getTime(), keysMatch(sizeBefore, sizeAfter, [&](uint32_t i) { return files[i].size; }));
+
+    timer.start();
+    auto dateBefore = createComparisonSortIndex(files.size(), [&](uint32_t a, uint32_t b) { return files[a].lastModificationDateInMinutes > files[b].lastModificationDateInMinutes; });
+    before = timer.getTime();
+    timer.start();
+    auto dateAfter = createDateSortIndex(fileList);
+    report("date", before, timer.getTime(), keysMatch(dateBefore, dateAfter, [&](uint32_t i) { return files[i].lastModificationDateInMinutes; }));
+
+    auto nameOf = [&](uint32_t i) { return files[i].getName(lowerNameTable); };
+    timer.start();
+    auto nameBefore = createComparisonSortIndex(files.size(), [&](uint32_t a, uint32_t b) { return nameOf(a) > nameOf(b); });
+    before = timer.getTime();
+    timer.start();
+    std::vector<uint32_t> nameRanks;
+    auto nameAfter = createNameSortIndex(fileList, lowerNameTable, nameRanks);
+    report("name", before, timer.getTime(), keysMatch(nameBefore, nameAfter, [&](uint32_t i) { return std::string_view(nameOf(i)); }));
+}
+
+// Sorted search with and without sort indexes, for a query with few matches and one matching most files
+static void benchmarkSortedSearch(FileList& fileList) {
+    FileListExtension withIndexes, withoutIndexes;
+    withIndexes.sizeSortIndex = createSizeSortIndex(fileList);
+    withIndexes.nameSortIndex = createNameSortIndex(fileList, fileList.lowerNameTable, withIndexes.nameRanks.owned());
+
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    SegmentSearchResults results;
+    for (auto query : { "abc", "e" }) {
+        for (auto index : { SearchSettings::Index::Name, SearchSettings::Index::Size }) {
+            SearchSettings searchSettings;
+            searchSettings.index = index;
+            auto timer = Timer();
+            findFilesWithString(results, fileList, withIndexes, query, searchSettings, threadPool, cancelSearch);
+            auto indexedTime = timer.getTime();
+            timer.start();
+            findFilesWithString(results, fileList, withoutIndexes, query, searchSettings, threadPool, cancelSearch);
+            auto unindexedTime = timer.getTime();
+            std::cout << "search \"" << query << "\" by " << (index == SearchSettings::Index::Name ? "name" : "size") << " (" << results.count << " matches): "
+                << indexedTime * 1000 << " ms with indexes, " << unindexedTime * 1000 << " ms without\n";
+        }
+    }
+}
+
+// Scan of all files with FileInfo records and with FileColumns, for a query rejected by the directory bit, a short one
+// and a long one (most names are rejected by length). Bytes per file count what the view reads besides the names
+static void benchmarkFileColumnsScan(FileList& fileList) {
+    constexpr int RunCount = 5;
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    struct Query {
+        const char* text;
+        bool includeFiles;
+    };
+    for (auto query : { Query{ "", false }, Query{ "e", true }, Query{ "abcdefghijkl", true } }) {
+        SearchSettings searchSettings;
+        searchSettings.includeFiles = query.includeFiles;
+        double times[2];
+        int counts[2];
+        for (int useColumns = 0; useColumns < 2; ++useColumns) {
+            if (useColumns)
+                fileList.columns = createFileColumns(fileList);
+            std::vector<RoaringBitmap::Container> chunks;
+            auto timer = Timer();
+            for (int run = 0; run < RunCount; ++run)
+                markMatchingFiles(chunks, fileList, query.text, searchSettings, threadPool, cancelSearch);
+            times[useColumns] = timer.getTime() / RunCount;
+            counts[useColumns] = int(RoaringBitmap(std::move(chunks)).count());
+        }
+        fileList.columns = FileColumns();
+        // records are read whole, columns only as far as the query needs them
+        double columnBytesPerFile = *query.text ? sizeof(uint32_t) + sizeof(uint8_t) + 1 / 8.0 : 1 / 8.0;
+        std::cout << "scan \"" << query.text << "\"" << (query.includeFiles ? "" : " (directories)") << " (" << counts[0] << " matches): records "
+            << times[0] * 1000 << " ms (" << sizeof(FileInfo) << " bytes per file), columns " << times[1] * 1000 << " ms (" << columnBytesPerFile
+            << " bytes per file)" << (counts[0] == counts[1] ? "" : " (DIFFERENT MATCHES)") << "\n";
+    }
+}
+
+// Searches ordered by the size index jump around files and names, so they are the ones most affected by TLB misses.
+// Compares a copy of the list in IndexArena with the list where it is. Enables the arena for the rest of the process
+static void benchmarkIndexArena(FileList& fileList) {
+    constexpr int RunCount = 3;
+    auto& arena = IndexArena::instance();
+    arena.enable();
+    FileList arenaFileList = fileList;
+    FileListExtension fileListExt, arenaFileListExt;
+    fileListExt.sizeSortIndex = createSizeSortIndex(fileList);
+    arenaFileListExt.sizeSortIndex = fileListExt.sizeSortIndex;
+    moveToIndexArena(arenaFileList);
+    moveToIndexArena(arenaFileListExt);
+    std::cout << arena.report() << "\n";
+
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    SegmentSearchResults results;
+    SearchSettings searchSettings;
+    searchSettings.index = SearchSettings::Index::Size;
+    for (auto query : { "e", "abc" }) {
+        double times[2];
+        for (int inArena = 0; inArena < 2; ++inArena) {
+            auto timer = Timer();
+            for (int run = 0; run < RunCount; ++run) {
+                findFilesWithString(results, inArena ? arenaFileList : fileList, inArena ? arenaFileListExt : fileListExt, query, searchSettings, threadPool, cancelSearch);
+            }
+            times[inArena] = timer.getTime() / RunCount;
+        }
+        std::cout << "search \"" << query << "\" by size (" << results.count << " matches): " << times[0] * 1000 << " ms, "
+            << times[1] * 1000 << " ms in index arena\n";
+    }
+}
+
+// Time until the first results are published compared to the whole search, for a broad query
+static void benchmarkProgressiveSearch(FileList& fileList) {
+    FileListExtension fileListExt;
+    fileListExt.sizeSortIndex = createSizeSortIndex(fileList);
+
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    SegmentSearchResults results;
+    for (auto index : { SearchSettings::Index::Direct, SearchSettings::Index::Size }) {
+        SearchSettings searchSettings;
+        searchSettings.index = index;
+        double firstResultsTime = -1;
+        int firstResultsCount = 0;
+        auto timer = Timer();
+        findFilesWithString(results, fileList, fileListExt, "e", searchSettings, threadPool, cancelSearch, [&](const uint32_t*, int offset, int count) {
+            if (firstResultsTime < 0) {
+                firstResultsTime = timer.getTime();
+                firstResultsCount = offset + count;
+            }
+        });
+        auto totalTime = timer.getTime();
+        std::cout << "search \"e\" by " << (index == SearchSettings::Index::Direct ? "id" : "size") << ": first " << firstResultsCount << " results after "
+            << firstResultsTime * 1000 << " ms, all " << results.count << " after " << totalTime * 1000 << " ms\n";
+    }
+}
+
+/*
+    Memory of search results compared to the two id vectors as big as the list they replaced, set operations on the
+    matches of two queries compared to the same operations on sorted id vectors, and searches that start from
+    the matches of the previous query (narrowing it, widening it and only changing the order)
+*/
+static void benchmarkSearchResultSets(FileList& fileList) {
+    constexpr int RunCount = 20;
+    FileListExtension fileListExt;
+    fileListExt.sizeSortIndex = createSizeSortIndex(fileList);
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    auto fileCount = fileList.files.size();
+
+    SegmentSearchResults results;
+    for (auto query : { "e", "abc" }) {
+        for (auto index : { SearchSettings::Index::Direct, SearchSettings::Index::Size }) {
+            SearchSettings searchSettings;
+            searchSettings.index = index;
+            findFilesWithString(results, fileList, fileListExt, query, searchSettings, threadPool, cancelSearch);
+            std::cout << "results of \"" << query << "\" by " << (index == SearchSettings::Index::Direct ? "id" : "size") << " (" << results.count << " matches): "
+                << results.sizeInBytes() / double(fileCount) << " bytes per file, was " << 2 * sizeof(uint32_t) << "\n";
+        }
+    }
+
+    // the first jump to the last rows walks the whole index, later ones start from the closest checkpoint
+    constexpr int VisibleRowCount = 40;
+    SearchSettings bySize;
+    bySize.index = SearchSettings::Index::Size;
+    findFilesWithString(results, fileList, fileListExt, "e", bySize, threadPool, cancelSearch);
+    double jumpTimes[2];
+    size_t listedCount = 0;
+    for (auto& jumpTime : jumpTimes) {
+        auto timer = Timer();
+        results.materialize(results.count - VisibleRowCount, results.count, fileList, fileListExt);
+        jumpTime = timer.getTime();
+        listedCount = results.ids.size();
+        results.materialize(0, VisibleRowCount, fileList, fileListExt);
+    }
+    std::cout << "last rows of \"e\" by size: " << jumpTimes[0] * 1000 << " ms, " << jumpTimes[1] * 1000 << " ms from a checkpoint ("
+        << listedCount << " ids listed)\n";
+
+    auto matchesOf = [&](const char* query) {
+        std::vector<RoaringBitmap::Container> chunks;
+        markMatchingFiles(chunks, fileList, query, SearchSettings(), threadPool, cancelSearch);
+        return RoaringBitmap(std::move(chunks));
+    };
+    auto a = matchesOf("e");
+    auto b = matchesOf("a");
+    std::vector<uint32_t> idsA, idsB, out;
+    a.forEach([&](uint32_t id) { idsA.push_back(id); });
+    b.forEach([&](uint32_t id) { idsB.push_back(id); });
+    auto time = [&](auto operation) {
+        auto timer = Timer();
+        uint64_t count = 0;
+        for (int run = 0; run < RunCount; ++run)
+            count = operation();
+        return std::make_pair(timer.getTime() / RunCount, count);
+    };
+    struct Operation {
+        const char* name;
+        std::function<uint64_t()> bitmaps;
+        std::function<uint64_t()> vectors;
+    };
+    Operation operations[] = {
+        { "and", [&]() { return (a & b).count(); }, [&]() { out.clear(); std::set_intersection(idsA.begin(), idsA.end(), idsB.begin(), idsB.end(), std::back_inserter(out)); return uint64_t(out.size()); } },
+        { "or", [&]() { return (a | b).count(); }, [&]() { out.clear(); std::set_union(idsA.begin(), idsA.end(), idsB.begin(), idsB.end(), std::back_inserter(out)); return uint64_t(out.size()); } },
+        { "and not", [&]() { return (a - b).count(); }, [&]() { out.clear(); std::set_difference(idsA.begin(), idsA.end(), idsB.begin(), idsB.end(), std::back_inserter(out)); return uint64_t(out.size()); } },
+    };
+    std::cout << "matches of \"e\" and \"a\": " << a.count() << " and " << b.count() << " files in " << (a.sizeInBytes() + b.sizeInBytes()) / double(1 << 20)
+        << " MB, " << (idsA.size() + idsB.size()) * sizeof(uint32_t) / double(1 << 20) << " MB as id vectors\n";
+    for (auto& operation : operations) {
+        auto [bitmapTime, bitmapCount] = time(operation.bitmaps);
+        auto [vectorTime, vectorCount] = time(operation.vectors);
+        std::cout << "  " << operation.name << ": " << bitmapTime * 1000 << " ms with bitmaps, " << vectorTime * 1000 << " ms with id vectors"
+            << (bitmapCount == vectorCount ? "" : " (DIFFERENT COUNTS)") << "\n";
+    }
+
+    struct Step {
+        const char* query;
+        SearchSettings::Index index;
+    };
+    for (auto steps : { std::array<Step, 2>{ Step{ "e", SearchSettings::Index::Direct }, Step{ "ex", SearchSettings::Index::Direct } },
+        std::array<Step, 2>{ Step{ "ex", SearchSettings::Index::Direct }, Step{ "e", SearchSettings::Index::Direct } },
+        std::array<Step, 2>{ Step{ "e", SearchSettings::Index::Direct }, Step{ "e", SearchSettings::Index::Size } } }) {
+        double times[2];
+        int counts[2];
+        for (int usesCache = 0; usesCache < 2; ++usesCache) {
+            SegmentMatchCache cache;
+            SearchSettings searchSettings;
+            searchSettings.index = steps[0].index;
+            findFilesWithString(results, fileList, fileListExt, steps[0].query, searchSettings, threadPool, cancelSearch, {}, usesCache ? &cache : nullptr);
+            searchSettings.index = steps[1].index;
+            auto timer = Timer();
+            findFilesWithString(results, fileList, fileListExt, steps[1].query, searchSettings, threadPool, cancelSearch, {}, usesCache ? &cache : nullptr);
+            times[usesCache] = timer.getTime();
+            counts[usesCache] = results.count;
+        }
+        std::cout << "search \"" << steps[1].query << "\" by " << (steps[1].index == SearchSettings::Index::Direct ? "id" : "size") << " after \"" << steps[0].query
+            << "\" by " << (steps[0].index == SearchSettings::Index::Direct ? "id" : "size") << ": " << times[0] * 1000 << " ms, " << times[1] * 1000
+            << " ms from previous matches" << (counts[0] == counts[1] ? "" : " (DIFFERENT MATCHES)") << "\n";
+    }
+}
+
+// Time from a new request to the running search giving up
+static void benchmarkSearchCancellation(FileList& fileList) {
+    FileListExtension fileListExt;
+    SearchRequests searchRequests;
+    ThreadPool threadPool;
+    searchRequests.searchThreadPool = &threadPool;
+    SegmentSearchResults results;
+
+    auto search = std::async(std::launch::async, [&]() {
+        searchRequests.waitForRequest();
+        findFilesWithString(results, fileList, fileListExt, "e", SearchSettings(), threadPool, searchRequests.cancelSearch);
+        return std::chrono::steady_clock::now();
+    });
+    searchRequests.notify();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    auto cancelTime = std::chrono::steady_clock::now();
+    searchRequests.notify();
+    auto endTime = search.get();
+    std::cout << "search cancelled after " << std::chrono::duration<double, std::micro>(endTime - cancelTime).count() << " us\n";
+}
+
+// Search latency while indexes are rebuilt in the background, with the search running as interactive and as background work
+static void benchmarkSearchDuringRefresh(FileList& fileList) {
+    FileListExtension fileListExt;
+    auto medianSearchTime = [&](TaskPriority priority) {
+        std::vector<double> times;
+        std::thread([&]() {
+            TaskScheduler::setCurrentThreadTaskPriority(priority);
+            ThreadPool threadPool(priority);
+            std::atomic<bool> cancelSearch = false;
+            SegmentSearchResults results;
+            for (int i = 0; i < 9; ++i) {
+                auto timer = Timer();
+                findFilesWithString(results, fileList, fileListExt, "e", SearchSettings(), threadPool, cancelSearch);
+                times.push_back(timer.getTime());
+            }
+        }).join();
+        std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+        return times[times.size() / 2];
+    };
+    auto idleTime = medianSearchTime(TaskPriority::Interactive);
+
+    std::atomic<bool> stopRefreshing = false;
+    std::thread refreshThread([&]() {
+        while (!stopRefreshing) {
+            ThreadPool tp(TaskPriority::Background);
+            std::vector<uint32_t> nameRanks;
+            tp.addTask([&]() { createSizeSortIndex(fileList); });
+            tp.addTask([&]() { createNameSortIndex(fileList, fileList.lowerNameTable, nameRanks); });
+            tp.addTask([&]() { createPathSortIndex(fileList, fileList.lowerNameTable); });
+            tp.wait();
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    auto interactiveTime = medianSearchTime(TaskPriority::Interactive);
+    auto backgroundTime = medianSearchTime(TaskPriority::Background);
+    stopRefreshing = true;
+    refreshThread.join();
+    std::cout << "search \"e\": " << idleTime * 1000 << " ms idle, during refresh " << interactiveTime * 1000 << " ms as interactive, "
+        << backgroundTime * 1000 << " ms as background\n";
+}
+
+// Directory sizes from exact 64-bit file sizes, compared to the float ancestor walk used before
+static void benchmarkDirectorySizes(FileList& fileList) {
+    auto& files = fileList.files;
+    std::vector<uint64_t> sizes(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+        sizes[i] = files[i].isDir() ? 0 : uint64_t(files[i].size);
+
+    auto timer = Timer();
+    auto tree = createDirectoryChildren(files);
+    auto levels = createDirectoryLevels(tree);
+    sumSizesIntoDirectories(tree, levels, sizes);
+    auto levelTime = timer.getTime();
+
+    uint64_t ancestorSteps = 0;
+    for (size_t level = 0; level < levels.size(); ++level)
+        ancestorSteps += level * levels[level].size();
+    std::cout << "directory sizes (" << levels.size() << " levels): " << levelTime * 1000 << " ms level by level";
+    // the walk is O(files * depth), only run it when it finishes in reasonable time
+    if (ancestorSteps <= 200'000'000) {
+        std::vector<float> floatSizes(files.size());
+        timer.start();
+        for (uint32_t i = 0; i < files.size(); ++i) {
+            if (!files[i].isDir()) {
+                auto index = i;
+                float fileSize = floatSizes[index] = float(sizes[i]);
+                while (files[index].parentIndex != index) {
+                    floatSizes[files[index].parentIndex] += fileSize;
+                    index = files[index].parentIndex;
+                }
+            }
+        }
+        auto walkTime = timer.getTime();
+        double walkError = 0, roundedError = 0;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (sizes[i] == 0)
+                continue;
+            walkError = std::max(walkError, std::abs(floatSizes[i] - double(sizes[i])) / double(sizes[i]));
+            roundedError = std::max(roundedError, std::abs(double(float(sizes[i])) - double(sizes[i])) / double(sizes[i]));
+        }
+        std::cout << ", " << walkTime * 1000 << " ms with float ancestor walk; max relative error " << walkError << " summed in float, "
+            << roundedError << " rounded once";
+    }
+    std::cout << "; FileInfo stays " << sizeof(FileInfo) << " bytes, exact sizes add " << 2 * sizeof(uint64_t) << " bytes per file in side columns\n";
+}
+
+// Code point by code point conversion that was used for MFT names before utf16ToUtf8 (no surrogate pair handling)
+static int baselineUtf16ToUtf8(char* out, const uint16_t* in, int length) {
+    auto outBegin = out;
+    for (int i = 0; i < length; ++i) {
+        unsigned int c = in[i];
+        if (c < 0x80) {
+            *out++ = (char)c;
+        } else if (c < 0x800) {
+            out[0] = (char)(0xc0 + (c >> 6));
+            out[1] = (char)(0x80 + (c & 0x3f));
+            out += 2;
+        } else {
+            out[0] = (char)(0xe0 + (c >> 12));
+            out[1] = (char)(0x80 + ((c >> 6) & 0x3f));
+            out[2] = (char)(0x80 + ((c) & 0x3f));
+            out += 3;
+        }
+    }
+    return int(out - outBegin);
+}
+
+static void appendUtf8AsUtf16(std::vector<uint16_t>& out, std::string_view str) {
+    for (size_t i = 0; i < str.size();) {
+        uint32_t c = uint8_t(str[i]);
+        int extraBytes = c < 0x80 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+        c &= extraBytes == 0 ? 0x7f : 0x3f >> extraBytes;
+        for (int j = 1; j <= extraBytes && i + j < str.size(); ++j)
+            c = (c << 6) | (uint8_t(str[i + j]) & 0x3f);
+        i += extraBytes + 1;
+        if (c >= 0x10000) {
+            out.push_back(uint16_t(0xd800 + ((c - 0x10000) >> 10)));
+            out.push_back(uint16_t(0xdc00 + ((c - 0x10000) & 0x3ff)));
+        } else {
+            out.push_back(uint16_t(c));
+        }
+    }
+}
+
+// Transcoding file names as they come from the MFT (UTF-16), as is and with some non-ASCII names mixed in
+static void benchmarkUtf16ToUtf8(FileList& fileList) {
+    static const char* nonAsciiSuffixes[] = { " \xd0\xba\xd0\xbe\xd0\xbf\xd0\xb8\xd1\x8f", " \xe5\x89\xaf\xe6\x9c\xac", " \xc3\xa9t\xc3\xa9", " \xf0\x9f\x93\x81" };
+    for (int variant = 0; variant < 2; ++variant) {
+        std::vector<uint16_t> units;
+        std::vector<uint32_t> nameOffsets;
+        std::string utf8Names;
+        for (size_t i = 0; i < fileList.files.size(); ++i) {
+            std::string name(fileList.files[i].getName(fileList.nameTable));
+            if (variant == 1 && i % 8 == 0 && name.size() < 200)
+                name += nonAsciiSuffixes[(i / 8) % std::size(nonAsciiSuffixes)];
+            nameOffsets.push_back(uint32_t(units.size()));
+            appendUtf8AsUtf16(units, name);
+            utf8Names += name;
+        }
+        nameOffsets.push_back(uint32_t(units.size()));
+        auto nameCount = nameOffsets.size() - 1;
+
+        // NTFS names are at most 255 UTF-16 units
+        std::array<char, 255 * MaxUtf8BytesPerUtf16Unit> buffer;
+        auto transcodeAll = [&](auto transcode) {
+            uint64_t byteCount = 0;
+            for (size_t i = 0; i < nameCount; ++i)
+                byteCount += transcode(buffer.data(), units.data() + nameOffsets[i], int(nameOffsets[i + 1] - nameOffsets[i]));
+            return byteCount;
+        };
+        auto timer = Timer();
+        auto baselineBytes = transcodeAll(baselineUtf16ToUtf8);
+        auto baselineTime = timer.getTime();
+        timer.start();
+        auto bytes = transcodeAll(utf16ToUtf8);
+        auto time = timer.getTime();
+
+        // output must round trip (surrogate pairs included) and match the old conversion where it was correct
+        std::string output;
+        bool correct = true;
+        for (size_t i = 0; i < nameCount && correct; ++i) {
+            auto begin = units.data() + nameOffsets[i];
+            int length = int(nameOffsets[i + 1] - nameOffsets[i]);
+            auto hasSurrogates = std::any_of(begin, begin + length, [](uint16_t c) { return c - 0xd800u < 0x800; });
+            std::array<char, 255 * MaxUtf8BytesPerUtf16Unit> baselineBuffer;
+            int size = utf16ToUtf8(buffer.data(), begin, length);
+            int baselineSize = baselineUtf16ToUtf8(baselineBuffer.data(), begin, length);
+            if (!hasSurrogates)
+                correct = std::string_view(buffer.data(), size) == std::string_view(baselineBuffer.data(), baselineSize);
+            output.append(buffer.data(), size);
+        }
+        correct = correct && output == utf8Names;
+        uint16_t unpaired[] = { 'a', 0xd83d, 'b', 0xdc01 };
+        correct = correct && std::string_view(buffer.data(), utf16ToUtf8(buffer.data(), unpaired, 4)) == "a\xef\xbf\xbd" "b\xef\xbf\xbd";
+
+        std::cout << "utf-16 to utf-8 of " << nameCount << " names (" << (variant == 0 ? "as is" : "1/8 non-ASCII") << ", " << bytes << " bytes): "
+            << baselineTime * 1000 << " ms -> " << time * 1000 << " ms" << (correct ? "" : " (MISMATCH)")
+            << (baselineBytes == bytes ? "" : " (surrogate pairs now 4 bytes instead of 6)") << "\n";
+    }
+}
+
+// Interning all file names in parallel, compared to std::string keys in a locked std::unordered_map
+static void benchmarkNameInterning(FileList& fileList) {
+    auto& files = fileList.files;
+    auto nameOf = [&](size_t i) { return files[i].getName(fileList.nameTable); };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, uint32_t> baseline;
+    auto timer = Timer();
+    parallelFor(0, files.size(), [&](size_t i) {
+        std::string name(nameOf(i));
+        std::lock_guard l{ mutex };
+        baseline.emplace(std::move(name), uint32_t(baseline.size()));
+    });
+    auto baselineTime = timer.getTime();
+
+    ConcurrentStringInterner interner;
+    std::vector<uint32_t> nameIds(files.size());
+    timer.start();
+    parallelFor(0, files.size(), [&](size_t i) {
+        auto name = nameOf(i);
+        nameIds[i] = interner.intern(name.data(), int(name.size()));
+    });
+    auto internerTime = timer.getTime();
+
+    bool sameNames = interner.size() == int64_t(baseline.size());
+    for (size_t i = 0; i < files.size() && sameNames; ++i)
+        sameNames = nameOf(i) == interner.at(nameIds[i]);
+    std::cout << "interning " << files.size() << " names (" << interner.size() << " distinct, dedup ratio " << double(files.size()) / interner.size() << "): "
+        << baselineTime * 1000 << " ms -> " << internerTime * 1000 << " ms" << (sameNames ? "" : " (MISMATCH)") << "\n";
+}
+
+// Search over several volumes, merged into one sorted result, compared to a single list with the same number of files.
+// Merged order is checked against sorting all matches at once
+static void benchmarkSegmentedSearch(FileList& fileList) {
+    constexpr int SegmentCount = 4;
+    FileListSegments segments;
+    for (int i = 0; i < SegmentCount; ++i) {
+        auto segment = std::make_unique<FileListSegment>();
+        segment->fileList = createSyntheticFileList(int(fileList.files.size() / SegmentCount), i + 2);
+        segment->fileList.nameTable[NameLengthSize] = char('C' + i); // first name of the root
+        segment->fileList.lowerNameTable[NameLengthSize] = char('c' + i);
+        segment->volumePath = segment->fileList.files[0].getName(segment->fileList.nameTable);
+        auto& ext = segment->fileListExt;
+        ext.sizeSortIndex = createSizeSortIndex(segment->fileList);
+        ext.nameSortIndex = createNameSortIndex(segment->fileList, segment->fileList.lowerNameTable, ext.nameRanks.owned());
+        ext.pathSortIndex = createPathSortIndex(segment->fileList, segment->fileList.lowerNameTable);
+        ext.pathRanks = createPathRanks(ext.pathSortIndex);
+        segments.segments.push_back(std::move(segment));
+    }
+    segments.updateFirstIds();
+    FileListExtension singleExt;
+    singleExt.sizeSortIndex = createSizeSortIndex(fileList);
+    singleExt.nameSortIndex = createNameSortIndex(fileList, fileList.lowerNameTable, singleExt.nameRanks.owned());
+    singleExt.pathSortIndex = createPathSortIndex(fileList, fileList.lowerNameTable);
+    singleExt.pathRanks = createPathRanks(singleExt.pathSortIndex);
+
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    FileListSearchResults results;
+    SegmentSearchResults singleResults;
+    for (auto query : { "abc", "e" }) {
+        for (auto index : { SearchSettings::Index::Direct, SearchSettings::Index::Name, SearchSettings::Index::Size, SearchSettings::Index::Path }) {
+            SearchSettings searchSettings;
+            searchSettings.index = index;
+            auto timer = Timer();
+            findFilesInSegments(results, segments, query, searchSettings, threadPool, cancelSearch);
+            auto segmentedTime = timer.getTime();
+            timer.start();
+            findFilesWithString(singleResults, fileList, singleExt, query, searchSettings, threadPool, cancelSearch);
+            auto singleTime = timer.getTime();
+
+            // rows are merged as they are shown, here all of them
+            timer.start();
+            results.materialize(segments, 0, results.count);
+            auto mergeTime = timer.getTime();
+            std::vector<uint32_t> shown(results.count);
+            for (int i = 0; i < results.count; ++i)
+                shown[i] = results.id(segments, i);
+            auto expected = shown;
+            std::sort(expected.begin(), expected.end(), [&](uint32_t a, uint32_t b) {
+                if (index == SearchSettings::Index::Direct) // ascending ids, segment after segment
+                    return a < b;
+                int segmentA = segments.segmentOf(a), segmentB = segments.segmentOf(b);
+                uint32_t idA = a - segments.firstIds[segmentA], idB = b - segments.firstIds[segmentB];
+                auto& segment = *segments.segments[segmentA];
+                int cmp = segmentA == segmentB ? compareOnColumn(segment.fileList, segment.fileListExt, index, idA, idB)
+                    : compareAcrossSegments(segments, segmentA, idA, segmentB, idB, index);
+                return cmp != 0 ? cmp > 0 : a < b;
+            });
+            bool isSorted = expected == shown;
+            std::cout << "search \"" << query << "\" by " << int(index) << " in " << SegmentCount << " segments (" << results.count << " matches): "
+                << segmentedTime * 1000 << " ms (all rows merged in " << mergeTime * 1000 << " ms more), " << singleTime * 1000 << " ms in one list"
+                << (isSorted ? "" : " (WRONG ORDER)") << "\n";
+        }
+    }
+}
+
+// Cost of scheduling small tasks one by one, in bulk and with parallelFor
+static void benchmarkThreadPool() {
+    constexpr int TaskCount = 200'000;
+    std::atomic<int64_t> sum = 0;
+    ThreadPool threadPool;
+    auto timer = Timer();
+    for (int i = 0; i < TaskCount; ++i)
+        threadPool.addTask([&sum, i]() { sum.fetch_add(i, std::memory_order_relaxed); });
+    threadPool.wait();
+    auto singleTime = timer.getTime();
+    timer.start();
+    threadPool.addTasks(TaskCount, [&sum](int i) { sum.fetch_add(i, std::memory_order_relaxed); });
+    threadPool.wait();
+    auto bulkTime = timer.getTime();
+    timer.start();
+    parallelFor(0, TaskCount, [&sum](size_t i) { sum.fetch_add(i, std::memory_order_relaxed); });
+    auto parallelForTime = timer.getTime();
+    std::cout << TaskCount << " tasks on " << TaskScheduler::instance().threadCount() << " threads: " << singleTime * 1000 << " ms one by one, "
+        << bulkTime * 1000 << " ms in bulk, " << parallelForTime * 1000 << " ms with parallelFor\n";
+}
+
+// Saving and loading the list with its indexes in every compression mode. Blocks are compressed and decompressed in parallel,
+// so with compression both scale with the thread count given to -benchmark. Columnar files are compared by contents,
+// as their name tables are rebuilt and they don't keep indexes
+static void benchmarkFileListSaveLoad(FileList& fileList) {
+    constexpr const char* FileName = "fileList_saveLoadBenchmark";
+    FileListExtension fileListExt;
+    fileListExt.sizeSortIndex = createSizeSortIndex(fileList);
+    fileListExt.nameSortIndex = createNameSortIndex(fileList, fileList.lowerNameTable, fileListExt.nameRanks.owned());
+    fileListExt.dateSortIndex = createDateSortIndex(fileList);
+    fileListExt.pathSortIndex = createPathSortIndex(fileList, fileList.lowerNameTable);
+    fileListExt.pathRanks = createPathRanks(fileListExt.pathSortIndex);
+
+    auto isSame = [](const auto& a, const auto& b) { return a.size() == b.size() && !memcmp(a.data(), b.data(), a.size() * sizeof(a[0])); };
+    auto hasSameFiles = [&](const FileList& loaded) {
+        if (loaded.files.size() != fileList.files.size() || !isSame(loaded.sizes, fileList.sizes) || !isSame(loaded.allocatedSizes, fileList.allocatedSizes))
+            return false;
+        for (size_t i = 0; i < fileList.files.size(); ++i) {
+            auto& a = loaded.files[i];
+            auto& b = fileList.files[i];
+            if (a.parentIndex != b.parentIndex || a.size != b.size || a.lastModificationDateInMinutes != b.lastModificationDateInMinutes || a.isDir() != b.isDir()
+                || a.getName(loaded.nameTable) != b.getName(fileList.nameTable) || a.getName(loaded.lowerNameTable) != b.getName(fileList.lowerNameTable)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    std::pair<Compression, const char*> modes[] = {
+        { Compression::None, "uncompressed" }, { Compression::Lz4, "lz4" }, { Compression::Lz4Hc, "lz4hc" }, { Compression::Columnar, "columnar" }
+    };
+    for (auto [compression, name] : modes) {
+        auto timer = Timer();
+        saveFileList(FileName, fileList, fileListExt, compression);
+        auto saveTime = timer.getTime();
+        std::error_code error;
+        auto fileSize = std::filesystem::file_size(FileName, error);
+        FileListExtension loadedExt;
+        timer.start();
+        auto loaded = loadFileList(FileName, loadedExt);
+        auto loadTime = timer.getTime();
+        bool isCorrect = hasSameFiles(loaded);
+        if (compression != Compression::Columnar)
+            isCorrect = isCorrect && isSame(loadedExt.nameSortIndex, fileListExt.nameSortIndex) && isSame(loadedExt.pathRanks, fileListExt.pathRanks);
+        loaded = FileList();
+        loadedExt.clearIndexes();
+        std::remove(FileName);
+        std::cout << "file list " << name << ": " << fileSize / 1'000'000.0 << " MB (" << double(fileSize) / fileList.files.size() << " bytes per file), save "
+            << saveTime * 1000 << " ms, load " << loadTime * 1000 << " ms" << (isCorrect ? "" : " (DIFFERENT AFTER LOAD)") << "\n";
+    }
+}
+
+static void runBenchmarks(int fileCount) {
+    FileListSegments segments;
+    if (fileCount > 0) {
+        segments.segments.push_back(std::make_unique<FileListSegment>());
+        segments.segments[0]->fileList = createSyntheticFileList(fileCount);
+    } else {
+        segments.segments = loadFileListSegments();
+    }
+    segments.updateFirstIds();
+    if (segments.fileCount() == 0) {
+        std::cout << "no file list to benchmark\n";
+        return;
+    }
+    // single list benchmarks use the first volume
+    auto& fileList = segments.segments[0]->fileList;
+    std::cout << "benchmarking " << segments.fileCount() << " files in " << segments.segments.size() << " segments\n";
+
+    benchmarkThreadPool();
+    benchmarkUtf16ToUtf8(fileList);
+    benchmarkNameInterning(fileList);
+    benchmarkDirectorySizes(fileList);
+
+    benchmarkDisplayCache(segments);
+    benchmarkSortIndexes(fileList);
+    benchmarkSortedSearch(fileList);
+    benchmarkFileColumnsScan(fileList);
+    benchmarkIndexArena(fileList);
+    benchmarkProgressiveSearch(fileList);
+    benchmarkSearchResultSets(fileList);
+    benchmarkSearchCancellation(fileList);
+    benchmarkSearchDuringRefresh(fileList);
+    benchmarkSegmentedSearch(fileList);
+    benchmarkFileListSaveLoad(fileList);
+}
+
+/*
+    Index of a synthetic tree with a distinct name for every file, by default 200M entries, so the name table is over
+    2 GiB and names past it are reached only through aligned references. Checks that names beyond 2 GiB are found
+    by search and sorted, and that the list is the same after saving and loading it. Peak memory use is about 150 bytes per file
+*/
+static void runScaleBenchmark(int fileCount) {
+    auto timer = Timer();
+    auto fileList = createSyntheticFileList(fileCount, 1, fileCount);
+    std::cout << "created " << fileList.files.size() << " files with " << fileList.nameTable.size() / double(1 << 30) << " GiB of names in " << timer.getTime() << " s\n";
+
+    auto& lastFile = fileList.files.back();
+    std::string lastName(lastFile.getName(fileList.lowerNameTable));
+    auto lastNameOffset = uint64_t(lastFile.getName(fileList.lowerNameTable).data() - fileList.lowerNameTable.data());
+    FileListExtension fileListExt;
+    ThreadPool threadPool;
+    std::atomic<bool> cancelSearch = false;
+    SegmentSearchResults results;
+    SearchSettings searchSettings;
+    searchSettings.allowSubstrings = false;
+    timer.start();
+    findFilesWithString(results, fileList, fileListExt, lastName, searchSettings, threadPool, cancelSearch);
+    bool isLastFound = results.matches->contains(uint32_t(fileList.files.size() - 1));
+    std::cout << "search for the name at " << lastNameOffset / double(1 << 30) << " GiB: " << timer.getTime() * 1000 << " ms" << (isLastFound ? "" : " (NOT FOUND)") << "\n";
+
+    timer.start();
+    fileListExt.nameSortIndex = createNameSortIndex(fileList, fileList.lowerNameTable, fileListExt.nameRanks.owned());
+    bool isSorted = true;
+    for (size_t i = 1; i < fileListExt.nameSortIndex.size() && isSorted; ++i)
+        isSorted = fileList.files[fileListExt.nameSortIndex[i - 1]].getName(fileList.lowerNameTable) >= fileList.files[fileListExt.nameSortIndex[i]].getName(fileList.lowerNameTable);
+    std::cout << "name sort index: " << timer.getTime() << " s" << (isSorted ? "" : " (WRONG ORDER)") << "\n";
+    fileListExt.nameSortIndex.clear();
+    fileListExt.nameRanks.clear();
+
+    timer.start();
+    saveFileList("fileList_scaleBenchmark", fileList, fileListExt);
+    auto saveTime = timer.getTime();
+    auto files = std::move(fileList.files);
+    auto nameTable = std::move(fileList.nameTable);
+    FileListExtension loadedExt;
+    timer.start();
+    fileList = loadFileList("fileList_scaleBenchmark", loadedExt);
+    auto loadTime = timer.getTime();
+    bool isSame = fileList.files.size() == files.size() && !memcmp(fileList.files.data(), files.data(), files.size() * sizeof(FileInfo))
+        && fileList.nameTable.size() == nameTable.size() && !memcmp(fileList.nameTable.data(), nameTable.data(), nameTable.size());
+    fileList = FileList();
+    std::remove("fileList_scaleBenchmark");
+    std::cout << "save: " << saveTime << " s, load: " << loadTime << " s" << (isSame ? "" : " (DIFFERENT AFTER LOAD)") << "\n";
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+#include "threadPool.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <numeric>
+#include <span>
+#include <string_view>
+#include <vector>
+
+/*
+    Compact encodings of single columns, used by the archival file list format (see Compression::Columnar).
+    Every encoder appends to a byte buffer and every decoder reads from [pos, end), advances pos and returns false
+    instead of reading out of bounds when data is corrupted. Decoders pass values to store(i, value)
+*/
+
+template<typename T> static void appendValue(std::vector<char>& out, T value) {
+    out.insert(out.end(), (const char*)&value, (const char*)&value + sizeof(value));
+}
+
+template<typename T> static bool readValue(const char*& pos, const char* end, T& value) {
+    if (uint64_t(end - pos) < sizeof(value))
+        return false;
+    memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+static void appendVarint(std::vector<char>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(char(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+static bool readVarint(const char*& pos, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        auto byte = uint8_t(*pos++);
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t zigzagEncode(int64_t value) {
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static int64_t zigzagDecode(uint64_t value) {
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+// Packed bit streams are followed by PackedBitsPadding zero bytes, so values are always read and written with two 64-bit loads
+constexpr inline uint64_t PackedBitsPadding = 16;
+
+static uint64_t readPackedBits(const char* data, uint64_t bitPosition, uint32_t width) {
+    uint64_t low, high;
+    memcpy(&low, data + bitPosition / 8, sizeof(low));
+    memcpy(&high, data + bitPosition / 8 + sizeof(low), sizeof(high));
+    auto shift = bitPosition % 8;
+    auto value = shift ? (low >> shift) | (high << (64 - shift)) : low;
+    return width == 64 ? value : value & ((uint64_t(1) << width) - 1);
+}
+
+// Buffer must be zeroed where the value goes
+static void writePackedBits(char* data, uint64_t bitPosition, uint64_t value, uint32_t width) {
+    uint64_t low, high;
+    memcpy(&low, data + bitPosition / 8, sizeof(low));
+    memcpy(&high, data + bitPosition / 8 + sizeof(low), sizeof(high));
+    auto shift = bitPosition % 8;
+    low |= value << shift;
+    if (shift && width + shift > 64)
+        high |= value >> (64 - shift);
+    memcpy(data + bitPosition / 8, &low, sizeof(low));
+    memcpy(data + bitPosition / 8 + sizeof(low), &high, sizeof(high));
+}
+
+/*
+    Frame of reference: values are split into blocks of BitPackedBlockSize. For every block its minimum (uint64) and
+    bit width (uint8) of the largest difference from it are stored up front, followed by all blocks of differences
+    packed with their width. Block offsets follow from the widths, so blocks are decoded in parallel, and widths up to
+    25 bits are unpacked 8 values at a time with AVX2
+*/
+constexpr inline size_t BitPackedBlockSize = 128;
+
+template<typename ValueOf> static void appendFrameOfReference(std::vector<char>& out, size_t count, ValueOf valueOf) {
+    auto blockCount = (count + BitPackedBlockSize - 1) / BitPackedBlockSize;
+    std::vector<uint64_t> minimums(blockCount);
+    std::vector<uint8_t> widths(blockCount);
+    for (size_t block = 0; block < blockCount; ++block) {
+        auto begin = block * BitPackedBlockSize;
+        auto end = std::min(count, begin + BitPackedBlockSize);
+        uint64_t minimum = valueOf(begin), maximum = minimum;
+        for (auto i = begin + 1; i < end; ++i) {
+            minimum = std::min<uint64_t>(minimum, valueOf(i));
+            maximum = std::max<uint64_t>(maximum, valueOf(i));
+        }
+        minimums[block] = minimum;
+        widths[block] = uint8_t(std::bit_width(maximum - minimum));
+    }
+    for (size_t block = 0; block < blockCount; ++block) {
+        appendValue(out, minimums[block]);
+        appendValue(out, widths[block]);
+    }
+    auto dataBegin = out.size();
+    uint64_t dataSize = 0;
+    for (auto width : widths)
+        dataSize += width * BitPackedBlockSize / 8;
+    out.resize(dataBegin + dataSize + PackedBitsPadding, '\0');
+    uint64_t bitPosition = 0;
+    for (size_t block = 0; block < blockCount; ++block) {
+        auto begin = block * BitPackedBlockSize;
+        auto end = std::min(count, begin + BitPackedBlockSize);
+        for (auto i = begin; i < end; ++i)
+            writePackedBits(out.data() + dataBegin, bitPosition + (i - begin) * widths[block], valueOf(i) - minimums[block], widths[block]);
+        bitPosition += widths[block] * BitPackedBlockSize;
+    }
+}
+
+static void unpackBlock(const char* data, uint32_t width, uint64_t minimum, uint64_t* out) {
+    if (width == 0) {
+        std::fill(out, out + BitPackedBlockSize, minimum);
+#if defined(__AVX2__)
+    } else if (width <= 25) {
+        // every value and its shift fit in 32 bits read from its first byte
+        auto lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        auto mask = _mm256_set1_epi32(int((1u << width) - 1));
+        auto minimum4 = _mm256_set1_epi64x(int64_t(minimum));
+        for (uint32_t i = 0; i < BitPackedBlockSize; i += 8) {
+            auto bitPositions = _mm256_mullo_epi32(_mm256_add_epi32(lanes, _mm256_set1_epi32(int(i))), _mm256_set1_epi32(int(width)));
+            auto words = _mm256_i32gather_epi32((const int*)data, _mm256_srli_epi32(bitPositions, 3), 1);
+            auto values = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_and_si256(bitPositions, _mm256_set1_epi32(7))), mask);
+            _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(values)), minimum4));
+            _mm256_storeu_si256((__m256i*)(out + i + 4), _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_extracti128_si256(values, 1)), minimum4));
+        }
+#endif
+    } else {
+        for (uint32_t i = 0; i < BitPackedBlockSize; ++i)
+            out[i] = minimum + readPackedBits(data, uint64_t(i) * width, width);
+    }
+}
+
+template<typename Store> static bool decodeFrameOfReference(const char*& pos, const char* end, size_t count, Store store) {
+    auto blockCount = (count + BitPackedBlockSize - 1) / BitPackedBlockSize;
+    constexpr size_t BlockHeaderSize = sizeof(uint64_t) + sizeof(uint8_t);
+    if (uint64_t(end - pos) < blockCount * BlockHeaderSize)
+        return false;
+    auto headers = pos;
+    pos += blockCount * BlockHeaderSize;
+    std::vector<uint64_t> blockOffsets(blockCount + 1, 0);
+    for (size_t block = 0; block < blockCount; ++block) {
+        auto width = uint8_t(headers[block * BlockHeaderSize + sizeof(uint64_t)]);
+        if (width > 64)
+            return false;
+        blockOffsets[block + 1] = blockOffsets[block] + width * BitPackedBlockSize / 8;
+    }
+    if (uint64_t(end - pos) < blockOffsets.back() + PackedBitsPadding)
+        return false;
+    auto data = pos;
+    pos += blockOffsets.back() + PackedBitsPadding;
+    parallelFor(0, blockCount, [&](size_t block) {
+        uint64_t minimum;
+        memcpy(&minimum, headers + block * BlockHeaderSize, sizeof(minimum));
+        auto width = uint8_t(headers[block * BlockHeaderSize + sizeof(uint64_t)]);
+        uint64_t values[BitPackedBlockSize];
+        unpackBlock(data + blockOffsets[block], width, minimum, values);
+        auto begin = block * BitPackedBlockSize;
+        auto blockEnd = std::min(count, begin + BitPackedBlockSize);
+        for (auto i = begin; i < blockEnd; ++i)
+            store(i, values[i - begin]);
+    }, 64);
+    return true;
+}
+
+/*
+    Bucketed values: every value is stored as its bit width (the bucket, frame of reference coded) and the bits below
+    its highest set bit. Suits values spread over many orders of magnitude, like file sizes. Trailing zero bits common
+    to all values (cluster size of allocated sizes) are stored once
+*/
+// Number of bits stored below the highest set bit of a bucketed value
+static uint32_t bucketedBitCount(uint64_t value) {
+    return value ? uint32_t(std::bit_width(value)) - 1 : 0;
+}
+
+template<typename ValueOf> static void appendBucketed(std::vector<char>& out, size_t count, ValueOf valueOf) {
+    uint64_t allBits = 0;
+    for (size_t i = 0; i < count; ++i)
+        allBits |= valueOf(i);
+    auto shift = uint8_t(allBits ? std::countr_zero(allBits) : 0);
+    auto shiftedValueOf = [&](size_t i) { return uint64_t(valueOf(i)) >> shift; };
+    appendValue(out, shift);
+    appendFrameOfReference(out, count, [&](size_t i) { return uint64_t(std::bit_width(shiftedValueOf(i))); });
+    uint64_t bitCount = 0;
+    for (size_t i = 0; i < count; ++i)
+        bitCount += bucketedBitCount(shiftedValueOf(i));
+    appendValue(out, bitCount);
+    auto dataBegin = out.size();
+    out.resize(dataBegin + (bitCount + 7) / 8 + PackedBitsPadding, '\0');
+    uint64_t bitPosition = 0;
+    for (size_t i = 0; i < count; ++i) {
+        auto value = shiftedValueOf(i);
+        auto width = bucketedBitCount(value);
+        writePackedBits(out.data() + dataBegin, bitPosition, value & ~(uint64_t(1) << width), width);
+        bitPosition += width;
+    }
+}
+
+template<typename Store> static bool decodeBucketed(const char*& pos, const char* end, size_t count, Store store) {
+    uint8_t shift;
+    std::vector<uint8_t> buckets(count);
+    bool isValid = readValue(pos, end, shift) && shift < 64;
+    isValid = isValid && decodeFrameOfReference(pos, end, count, [&](size_t i, uint64_t bucket) {
+        buckets[i] = uint8_t(std::min<uint64_t>(bucket, 255));
+    });
+    uint64_t bitCount;
+    if (!isValid || !readValue(pos, end, bitCount) || uint64_t(end - pos) < (bitCount + 7) / 8 + PackedBitsPadding)
+        return false;
+    // bit offset of every block of values, so blocks are decoded in parallel
+    auto blockCount = (count + BitPackedBlockSize - 1) / BitPackedBlockSize;
+    std::vector<uint64_t> blockOffsets(blockCount + 1, 0);
+    for (size_t i = 0; i < count; ++i) {
+        if (buckets[i] > 64 - shift)
+            return false;
+        blockOffsets[i / BitPackedBlockSize + 1] += buckets[i] ? buckets[i] - 1 : 0;
+    }
+    std::inclusive_scan(blockOffsets.begin(), blockOffsets.end(), blockOffsets.begin());
+    if (blockOffsets.back() != bitCount)
+        return false;
+    auto data = pos;
+    pos += (bitCount + 7) / 8 + PackedBitsPadding;
+    parallelFor(0, blockCount, [&](size_t block) {
+        auto bitPosition = blockOffsets[block];
+        auto blockEnd = std::min(count, (block + 1) * BitPackedBlockSize);
+        for (auto i = block * BitPackedBlockSize; i < blockEnd; ++i) {
+            auto width = buckets[i] ? uint32_t(buckets[i]) - 1 : 0;
+            auto value = buckets[i] == 0 ? 0 : (uint64_t(1) << width) | readPackedBits(data, bitPosition, width);
+            store(i, value << shift);
+            bitPosition += width;
+        }
+    }, 64);
+    return true;
+}
+
+// Signed differences between consecutive values as varints. Suits values that mostly repeat or change a little, like parents of siblings
+template<typename ValueOf> static void appendDeltaVarints(std::vector<char>& out, size_t count, ValueOf valueOf) {
+    int64_t previous = 0;
+    for (size_t i = 0; i < count; ++i) {
+        auto value = int64_t(valueOf(i));
+        appendVarint(out, zigzagEncode(value - previous));
+        previous = value;
+    }
+}
+
+template<typename Store> static bool decodeDeltaVarints(const char*& pos, const char* end, size_t count, Store store) {
+    int64_t previous = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t delta;
+        if (!readVarint(pos, end, delta))
+            return false;
+        previous += zigzagDecode(delta);
+        store(i, uint64_t(previous));
+    }
+    return true;
+}
+
+// Sorted strings, each stored as length of the prefix shared with the previous one, length of the rest and the rest
+static void appendFrontCoded(std::vector<char>& out, std::span<const std::string_view> sortedStrings) {
+    appendValue(out, uint64_t(sortedStrings.size()));
+    std::string_view previous;
+    for (auto string : sortedStrings) {
+        size_t sharedLength = std::mismatch(previous.begin(), previous.end(), string.begin(), string.end()).first - previous.begin();
+        appendVarint(out, sharedLength);
+        appendVarint(out, string.size() - sharedLength);
+        out.insert(out.end(), string.begin() + sharedLength, string.end());
+        previous = string;
+    }
+}
+
+// Calls store(i, std::string_view) for every string, the view is valid only during the call
+template<typename Store> static bool decodeFrontCoded(const char*& pos, const char* end, Store store) {
+    uint64_t count;
+    if (!readValue(pos, end, count))
+        return false;
+    std::string string;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t sharedLength, restLength;
+        if (!readVarint(pos, end, sharedLength) || !readVarint(pos, end, restLength) || sharedLength > string.size() || restLength > uint64_t(end - pos))
+            return false;
+        string.resize(sharedLength);
+        string.append(pos, restLength);
+        pos += restLength;
+        store(i, std::string_view(string));
+    }
+    return true;
+}
@@ -1,9 +1,17 @@
 #pragma once
 
+#include "mappedFile.h"
 #include "utility.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <mutex>
 #include <shared_mutex>
@@ -14,11 +22,15 @@ constexpr inline uint32_t Date100nsTo1MinPrecisionFactor = 600'000'000;
 struct FileInfo {
     uint32_t parentIndex;
     float size = 0;
-    uint32_t nameTableIndexAndInfo; // First bit is used to signify if the file is directory or not. 0 means its file, 1 means its directory
+    uint32_t nameTableIndexAndInfo; // First bit is used to signify if the file is directory or not. 0 means its file, 1 means its directory. Others are the name reference (see nameAt)
     uint32_t lastModificationDateInMinutes;
     
-    const char* getName(const std::string& fileNameTable) const {
-        return &fileNameTable[nameTableIndexAndInfo & 0x7fffffff];
+    uint32_t nameReference() const {
+        return nameTableIndexAndInfo & MaxNameReference;
+    }
+    // Data of the view is null terminated
+    std::string_view getName(std::span<const char> fileNameTable) const {
+        return nameViewAt(fileNameTable, nameReference());
     }
     bool isDir() const {
         return nameTableIndexAndInfo >> 31;
@@ -26,42 +38,201 @@ struct FileInfo {
 };
 #pragma pack(pop)
 
+/*
+    Optional structure of arrays copy of FileInfo fields (see createFileColumns). Matching a file by name reads its
+    4 byte name reference, 1 byte name length and 1 bit instead of the whole 16 byte record, and names shorter
+    than the searched string are rejected without reading them
+*/
+struct FileColumns {
+    static constexpr uint32_t MaxNameLength = 255; // longer names have this length
+
+    std::vector<uint32_t> nameReferences;
+    std::vector<uint64_t> directoryBits; // bit i % 64 of word i / 64 is set for directories
+    std::vector<uint8_t> nameLengths;
+    std::vector<uint32_t> parentIndexes;
+    std::vector<float> sizes;
+    std::vector<uint32_t> lastModificationDatesInMinutes;
+};
+
+// All arrays are either owned or used in place from a mapped file list (see loadFileList)
 struct FileList {
-    std::vector<FileInfo> files;
-    std::string nameTable;
-    std::string lowerNameTable;
+    MappedArray<std::vector<FileInfo>> files;
+    MappedArray<std::string> nameTable;
+    MappedArray<std::string> lowerNameTable;
+    // Exact sizes in bytes (FileInfo::size is their float approximation, to keep the record at 16 bytes).
+    // Empty when not known, for example in files saved by older versions
+    MappedArray<std::vector<uint64_t>> sizes;
+    MappedArray<std::vector<uint64_t>> allocatedSizes;
+    FileColumns columns; // empty unless created for the whole list
 };
 
+/*
+    Thin views with the same interface over files of a list, either reading FileInfo records or FileColumns.
+    Loops that touch every file take the view as a template parameter (see withFilesView), so neither one costs a branch per access
+*/
+struct FileRecordsView {
+    const FileInfo* files;
+
+    uint32_t nameReference(uint32_t i) const {
+        return files[i].nameReference();
+    }
+    bool isDir(uint32_t i) const {
+        return files[i].isDir();
+    }
+    uint32_t parentIndex(uint32_t i) const {
+        return files[i].parentIndex;
+    }
+    float size(uint32_t i) const {
+        return files[i].size;
+    }
+    uint32_t lastModificationDateInMinutes(uint32_t i) const {
+        return files[i].lastModificationDateInMinutes;
+    }
+    // Records don't know name lengths, so no name is known to be shorter
+    bool isNameShorterThan(uint32_t i, size_t length) const {
+        return false;
+    }
+};
+
+struct FileColumnsView {
+    const FileColumns* columns;
+
+    uint32_t nameReference(uint32_t i) const {
+        return columns->nameReferences[i];
+    }
+    bool isDir(uint32_t i) const {
+        return (columns->directoryBits[i / 64] >> (i % 64)) & 1;
+    }
+    uint32_t parentIndex(uint32_t i) const {
+        return columns->parentIndexes[i];
+    }
+    float size(uint32_t i) const {
+        return columns->sizes[i];
+    }
+    uint32_t lastModificationDateInMinutes(uint32_t i) const {
+        return columns->lastModificationDatesInMinutes[i];
+    }
+    bool isNameShorterThan(uint32_t i, size_t length) const {
+        return columns->nameLengths[i] < std::min<size_t>(length, FileColumns::MaxNameLength);
+    }
+};
+
+static bool hasFileColumns(const FileList& fileList) {
+    return !fileList.files.empty() && fileList.columns.nameReferences.size() == fileList.files.size();
+}
+
+// Calls function with the view that reads the least memory: columns when they are created, otherwise records
+template<typename F> static auto withFilesView(const FileList& fileList, F function) {
+    if (hasFileColumns(fileList))
+        return function(FileColumnsView{ &fileList.columns });
+    return function(FileRecordsView{ fileList.files.data() });
+}
+
+static FileColumns createFileColumns(const FileList& fileList) {
+    auto& files = fileList.files;
+    auto fileCount = files.size();
+    FileColumns columns;
+    columns.nameReferences.resize(fileCount);
+    columns.directoryBits.resize((fileCount + 63) / 64);
+    columns.nameLengths.resize(fileCount);
+    columns.parentIndexes.resize(fileCount);
+    columns.sizes.resize(fileCount);
+    columns.lastModificationDatesInMinutes.resize(fileCount);
+    // one directory bits word per iteration, so no two threads write the same word
+    parallelFor(0, columns.directoryBits.size(), [&](size_t word) {
+        uint64_t bits = 0;
+        for (size_t i = word * 64; i < std::min(fileCount, word * 64 + 64); ++i) {
+            auto& file = files[i];
+            columns.nameReferences[i] = file.nameReference();
+            bits |= uint64_t(file.isDir()) << (i % 64);
+            columns.nameLengths[i] = uint8_t(std::min<size_t>(file.getName(fileList.nameTable).size(), FileColumns::MaxNameLength));
+            columns.parentIndexes[i] = file.parentIndex;
+            columns.sizes[i] = file.size;
+            columns.lastModificationDatesInMinutes[i] = file.lastModificationDateInMinutes;
+        }
+        columns.directoryBits[word] = bits;
+    }, 64);
+    return columns;
+}
+
 struct FileListExtension {
-    std::vector<uint32_t> sizeSortIndex;
-    std::vector<uint32_t> nameSortIndex;
-    std::vector<uint32_t> dateSortIndex;
+    MappedArray<std::vector<uint32_t>> sizeSortIndex;
+    MappedArray<std::vector<uint32_t>> nameSortIndex;
+    MappedArray<std::vector<uint32_t>> dateSortIndex;
+    MappedArray<std::vector<uint32_t>> pathSortIndex;
+    MappedArray<std::vector<uint32_t>> extensionSortIndex;
+    MappedArray<std::vector<uint32_t>> nameRanks;
+    MappedArray<std::vector<uint32_t>> pathRanks;
+    MappedArray<std::vector<uint32_t>> extensionRanks;
     std::shared_mutex globalMutex;
-    std::shared_mutex searchResultsMutex;
     std::shared_mutex indexesMutex;
+    uint64_t indexesGeneration = 0; // incremented each time indexes are replaced (see SegmentSearchResults::materialize)
     std::mutex fileListFileMutex;
+    bool isInOlderFormat = false; // set by loadFileList, such lists are saved again in the current format
+
+    void clearIndexes() {
+        for (auto index : { &sizeSortIndex, &nameSortIndex, &dateSortIndex, &pathSortIndex, &extensionSortIndex, &nameRanks, &pathRanks, &extensionRanks })
+            index->clear();
+    }
+    bool hasAllIndexes(size_t fileCount) const {
+        for (auto index : { &sizeSortIndex, &nameSortIndex, &dateSortIndex, &pathSortIndex, &extensionSortIndex, &nameRanks, &pathRanks, &extensionRanks }) {
+            if (index->size() != fileCount)
+                return false;
+        }
+        return true;
+    }
 };
 
-struct ThreadSafeNameTable {
-    ThreadSafeVec<char> data;
-    std::atomic<int> lastWritePosition = 0;
-    std::atomic<int> size = 0;
+// File list of one volume (or volume image) with its own sort indexes
+struct FileListSegment {
+    uint64_t serialNumber = 0; // BootSector::serialNumber, identifies the volume between runs (0 for lists saved by older versions)
+    std::string volumePath; // "C:" or path of an image file, also the name of the root
+    FileList fileList;
+    FileListExtension fileListExt;
+    std::future<void> refreshIndexesTask;
+    std::future<void> saveTask;
+    std::atomic<bool> hasFailedToSave = false; // cleared once the error is shown
+};
 
-    int addString(const char* str, int length) {
-        int position = lastWritePosition.fetch_add(length + 1);
-        atomicMax<int>(size, position + length + 1);
-
-        auto [blockId, posInBlock] = data.getBlockIdAndPosInBlock(position);
-        if (blockId < data.blockCount && posInBlock + length + 1 < data.blocks[blockId]->size()) {
-            memcpy(&(*data.blocks[blockId])[posInBlock], str, length);
-            (*data.blocks[blockId])[posInBlock + length] = '\0';
-        } else {
-            for (int i = 0; i < length; ++i) {
-                data[position + i] = str[i];
-            }
-            data[position + length] = '\0';
+/*
+    All indexed volumes. Every segment is searched and refreshed on its own, results refer to files with global ids:
+    id of the file in its segment plus the first id of the segment.
+    Replacing contents of a segment needs unique locks on the segment's globalMutex and on mutex (in this order),
+    reading them needs a shared lock on either one. Searches hold mutex, creating indexes of a segment holds only its globalMutex
+*/
+struct FileListSegments {
+    std::vector<std::unique_ptr<FileListSegment>> segments;
+    std::vector<uint32_t> firstIds = { 0 }; // first global id of every segment, total file count at the end
+    uint64_t generation = 0; // incremented each time any segment is replaced, added or removed
+    bool createsFileColumns = false; // lists get FileColumns before they are added, set once on start
+    std::shared_mutex mutex;
+    std::shared_mutex searchResultsMutex;
+
+    uint32_t fileCount() const {
+        return firstIds.back();
+    }
+    int segmentOf(uint32_t id) const {
+        return int(std::upper_bound(firstIds.begin(), firstIds.end(), id) - firstIds.begin()) - 1;
+    }
+    FileList& fileListOf(uint32_t id) {
+        return segments[segmentOf(id)]->fileList;
+    }
+    FileInfo& file(uint32_t id) {
+        auto segment = segmentOf(id);
+        return segments[segment]->fileList.files[id - firstIds[segment]];
+    }
+    void updateFirstIds() {
+        firstIds.resize(segments.size() + 1);
+        for (size_t i = 0; i < segments.size(); ++i)
+            firstIds[i + 1] = firstIds[i] + uint32_t(segments[i]->fileList.files.size());
+    }
+    // Segment of the volume, the one loaded from a file saved before volumes were told apart is matched by path
+    FileListSegment* find(uint64_t serialNumber, const std::string& volumePath) {
+        for (auto& segment : segments) {
+            if (segment->serialNumber == serialNumber || (segment->serialNumber == 0 && segment->volumePath == volumePath))
+                return segment.get();
         }
-        return position;
+        return nullptr;
     }
 };
 
@@ -76,10 +247,81 @@ struct ThreadSafeFileList {
 };
 
 struct ThreadSafeSerializableFileList {
-    ThreadSafeNameTable fileNameTable;
+    ConcurrentStringInterner fileNameTable;
     ThreadSafeFileList files;
 };
 
+// Same result as std::filesystem::path(name).extension(), without constructing the path
+static std::string_view fileNameExtension(std::string_view name) {
+    if (name == "." || name == "..")
+        return {};
+    auto pos = name.find_last_of('.');
+    if (pos == std::string_view::npos || pos == 0)
+        return {};
+    return name.substr(pos);
+}
+
+// Children of every directory in one array (CSR layout), children of dir are [childrenBegin[dir], childrenBegin[dir + 1])
+struct DirectoryChildren {
+    std::vector<uint32_t> childrenBegin;
+    std::vector<uint32_t> children;
+};
+
+static DirectoryChildren createDirectoryChildren(std::span<const FileInfo> files) {
+    auto fileCount = uint32_t(files.size());
+    DirectoryChildren result;
+    auto& childrenBegin = result.childrenBegin;
+    childrenBegin.assign(fileCount + 1, 0);
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        if (files[i].parentIndex != i)
+            childrenBegin[files[i].parentIndex + 1] += 1;
+    }
+    std::inclusive_scan(childrenBegin.begin(), childrenBegin.end(), childrenBegin.begin());
+    result.children.resize(childrenBegin.back());
+    std::vector<uint32_t> writePos(childrenBegin.begin(), childrenBegin.end() - 1);
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        if (files[i].parentIndex != i)
+            result.children[writePos[files[i].parentIndex]++] = i;
+    }
+    return result;
+}
+
+// Files grouped by depth, starting with the root. Files not reachable from the root (broken parent links) are left out
+static std::vector<std::vector<uint32_t>> createDirectoryLevels(const DirectoryChildren& tree) {
+    std::vector<std::vector<uint32_t>> levels;
+    if (tree.childrenBegin.size() > 1)
+        levels.push_back({ 0 });
+    while (!levels.empty()) {
+        auto& level = levels.back();
+        std::vector<uint32_t> nextLevelOffsets(level.size() + 1, 0);
+        for (size_t i = 0; i < level.size(); ++i)
+            nextLevelOffsets[i + 1] = nextLevelOffsets[i] + tree.childrenBegin[level[i] + 1] - tree.childrenBegin[level[i]];
+        if (nextLevelOffsets.back() == 0)
+            break;
+        std::vector<uint32_t> nextLevel(nextLevelOffsets.back());
+        parallelFor(0, level.size(), [&](size_t i) {
+            auto dir = level[i];
+            std::copy(tree.children.begin() + tree.childrenBegin[dir], tree.children.begin() + tree.childrenBegin[dir + 1], nextLevel.begin() + nextLevelOffsets[i]);
+        }, 256);
+        levels.push_back(std::move(nextLevel));
+    }
+    return levels;
+}
+
+// Adds sizes of all files into their ancestor directories. Goes level by level from the deepest one and every directory
+// pulls the totals of its children, so there are no atomics and the sums don't depend on thread count
+static void sumSizesIntoDirectories(const DirectoryChildren& tree, const std::vector<std::vector<uint32_t>>& levels, std::span<uint64_t> sizes) {
+    for (auto level = levels.rbegin() + 1; level < levels.rend(); ++level) {
+        parallelFor(0, level->size(), [&](size_t i) {
+            auto dir = (*level)[i];
+            uint64_t sum = sizes[dir];
+            for (auto c = tree.childrenBegin[dir]; c < tree.childrenBegin[dir + 1]; ++c)
+                sum += sizes[tree.children[c]];
+            sizes[dir] = sum;
+        }, 256);
+    }
+}
+
 static std::string fullFilePath(FileInfo& file, FileList& fileList) {
     std::string result(file.getName(fileList.nameTable));
     if (file.nameTableIndexAndInfo == fileList.files[0].nameTableIndexAndInfo) // is root
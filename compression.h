@@ -5,17 +5,138 @@
 #include "lz4hc.h"
 #include "lz4frame.h"
 
-#include <tuple>
+#include "threadPool.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
-static std::pair<std::vector<char>, int32_t> compress(char* data, int32_t size) {
-    int maxDstSize = LZ4_compressBound(size);
-    std::vector<char> compressedDataBuffer(maxDstSize);
-    int compressedSize = LZ4_compress_fast(data, compressedDataBuffer.data(), size, int(compressedDataBuffer.size()), 1);
-    return { compressedDataBuffer, compressedSize };
+enum class Compression : uint32_t {
+    None = 0,
+    Lz4 = 1,
+    Lz4Hc = 2, // smaller output, several times slower to compress, as fast to decompress
+    Columnar = 3 // archival: every column in its own compact encoding (see encodeFileListColumns), without indexes
+};
+
+// Names used by the -compression option, in Compression order
+constexpr inline const char* CompressionNames[] = { "none", "lz4", "lz4hc", "columnar" };
+
+/*
+    Compressed block stream: every CompressedBlockSize bytes of input (the last block can be shorter) are compressed
+    on their own and stored as uint32 compressed size, uint64 checksum64 of the compressed bytes and the LZ4 data.
+    Blocks are independent, so they are compressed and decompressed in parallel
+*/
+constexpr inline uint64_t CompressedBlockSize = uint64_t(1) << 22;
+constexpr inline size_t CompressedBlockHeaderSize = sizeof(uint32_t) + sizeof(uint64_t);
+
+/*
+    Compresses data as a block stream and passes it to write(const char* data, size_t size) in order. Blocks are
+    compressed a batch at a time, so memory use stays at a few blocks per thread however big the data is
+*/
+template<typename Write> void compressBlocksParallel(const char* data, uint64_t size, Compression compression, Write write) {
+    auto blockCount = (size + CompressedBlockSize - 1) / CompressedBlockSize;
+    auto batchSize = uint64_t(TaskScheduler::instance().threadCount()) * 2;
+    auto maxCompressedSize = size_t(LZ4_compressBound(int(CompressedBlockSize)));
+    std::vector<std::vector<char>> compressedBlocks(std::min(batchSize, blockCount));
+    for (uint64_t batchBegin = 0; batchBegin < blockCount; batchBegin += batchSize) {
+        auto batchEnd = std::min(blockCount, batchBegin + batchSize);
+        parallelFor(batchBegin, batchEnd, [&](size_t block) {
+            auto offset = block * CompressedBlockSize;
+            auto blockSize = int(std::min(CompressedBlockSize, size - offset));
+            auto& compressed = compressedBlocks[block - batchBegin];
+            compressed.resize(CompressedBlockHeaderSize + maxCompressedSize);
+            auto out = compressed.data() + CompressedBlockHeaderSize;
+            int compressedSize;
+            if (compression == Compression::Lz4Hc)
+                compressedSize = LZ4_compress_HC(data + offset, out, blockSize, int(maxCompressedSize), LZ4HC_CLEVEL_DEFAULT);
+            else
+                compressedSize = LZ4_compress_default(data + offset, out, blockSize, int(maxCompressedSize));
+            auto compressedSize32 = uint32_t(compressedSize);
+            auto checksum = checksum64(out, compressedSize);
+            memcpy(compressed.data(), &compressedSize32, sizeof(compressedSize32));
+            memcpy(compressed.data() + sizeof(compressedSize32), &checksum, sizeof(checksum));
+            compressed.resize(CompressedBlockHeaderSize + compressedSize);
+        }, 1);
+        for (auto block = batchBegin; block < batchEnd; ++block)
+            write(compressedBlocks[block - batchBegin].data(), compressedBlocks[block - batchBegin].size());
+    }
+}
+
+struct CompressedBlock {
+    const char* data;
+    uint32_t compressedSize;
+    uint64_t checksum;
+    char* out;
+    int size;
+};
+
+/*
+    Finds blocks of a stream that decompresses into exactly size bytes at out, reading at most available bytes.
+    Appends them to blocks and returns size of the stream, or 0 if the stream is corrupted
+*/
+static uint64_t findCompressedBlocks(const char* data, uint64_t available, char* out, uint64_t size, std::vector<CompressedBlock>& blocks) {
+    uint64_t pos = 0;
+    for (uint64_t offset = 0; offset < size; offset += CompressedBlockSize) {
+        CompressedBlock block;
+        block.size = int(std::min(CompressedBlockSize, size - offset));
+        if (available - pos < CompressedBlockHeaderSize)
+            return 0;
+        memcpy(&block.compressedSize, data + pos, sizeof(block.compressedSize));
+        memcpy(&block.checksum, data + pos + sizeof(block.compressedSize), sizeof(block.checksum));
+        pos += CompressedBlockHeaderSize;
+        if (available - pos < block.compressedSize || block.compressedSize > uint32_t(LZ4_compressBound(block.size)))
+            return 0;
+        block.data = data + pos;
+        block.out = out + offset;
+        blocks.push_back(block);
+        pos += block.compressedSize;
+    }
+    return pos;
 }
-static std::vector<char> decompress(char* data, int32_t originalSize) {
-    std::vector<char> dst(originalSize);
-    LZ4_decompress_fast(data, dst.data(), originalSize);
-    return dst;
+
+// Decompresses blocks in parallel with the bounds checking decoder. Returns false if any block is corrupted
+static bool decompressBlocksParallel(const std::vector<CompressedBlock>& blocks) {
+    std::atomic<bool> isCorrupted = false;
+    parallelFor(0, blocks.size(), [&](size_t i) {
+        auto& block = blocks[i];
+        if (isCorrupted.load(std::memory_order_relaxed))
+            return;
+        if (checksum64(block.data, block.compressedSize) != block.checksum
+            || LZ4_decompress_safe(block.data, block.out, int(block.compressedSize), block.size) != block.size) {
+            isCorrupted = true;
+        }
+    }, 1);
+    return !isCorrupted;
+}
+
+// Version 1 file lists stored single LZ4 blocks. Returns empty vector if data is corrupted
+static std::vector<char> decompressVersion1Block(const std::vector<char>& compressedData, int32_t originalSize) {
+    std::vector<char> result(std::max(originalSize, 0));
+    if (LZ4_decompress_safe(compressedData.data(), result.data(), int(compressedData.size()), originalSize) != originalSize)
+        result.clear();
+    return result;
+}
+
+// Blocks of the version 2 file list format: uint32 compressed size followed by LZ4 data of up to 64 MiB of input, without checksums
+constexpr inline uint64_t Version2CompressionBlockSize = uint64_t(1) << 26;
+
+// Decompresses version 2 blocks into out, which has room for exactly size bytes. Returns false if data is corrupted
+static bool decompressVersion2Blocks(const char* data, uint64_t compressedSize, char* out, uint64_t size) {
+    uint64_t pos = 0;
+    for (uint64_t offset = 0; offset < size; offset += Version2CompressionBlockSize) {
+        auto blockSize = int(std::min(Version2CompressionBlockSize, size - offset));
+        uint32_t blockCompressedSize;
+        if (compressedSize - pos < sizeof(blockCompressedSize))
+            return false;
+        memcpy(&blockCompressedSize, data + pos, sizeof(blockCompressedSize));
+        pos += sizeof(blockCompressedSize);
+        if (compressedSize - pos < blockCompressedSize || blockCompressedSize > uint32_t(LZ4_compressBound(blockSize)))
+            return false;
+        if (LZ4_decompress_safe(data + pos, out + offset, int(blockCompressedSize), blockSize) != blockSize)
+            return false;
+        pos += blockCompressedSize;
+    }
+    return pos == compressedSize;
 }
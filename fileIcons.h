@@ -5,6 +5,7 @@
 #include "imgui_directx11.h"
 
 #include <string>
+#include <string_view>
 #include <optional>
 #include <filesystem>
 #include <thread>
@@ -42,10 +43,7 @@ static std::optional<MyImGui::Image> hiconToImage(HICON hicon) {
     return MyImGui::createTextureFromRGBA(bmData.Scan0, 32, 32);
 }
 
-static MyImGui::Image getIcon(const FileInfo& fileInfo, FileList& fileList, const std::string& fullPath) {
-    //std::filesystem::path path(fileInfo.name);
-    std::filesystem::path path(fileInfo.getName(fileList.nameTable));
-    auto ext = std::string((char*)path.extension().u8string().c_str());
+static MyImGui::Image getIcon(const FileInfo& fileInfo, std::string_view ext, const std::string& fullPath) {
     static std::optional<MyImGui::Image> defaultFileImg;
     static std::optional<MyImGui::Image> defaultExeImg;
     static int defaultFileIicon = -1;
@@ -93,11 +91,11 @@ static MyImGui::Image getIcon(const FileInfo& fileInfo, FileList& fileList, cons
                 }).detach();
                 return *img;
         } else {
-            auto& img = imgMap[ext];
+            auto& img = imgMap[std::string(ext)];
             if (img)
                 return *img;
             img = defaultFileImg;
-            std::thread([&, ext = ext]() {
+            std::thread([&, ext = std::string(ext)]() {
                 SHFILEINFOA sfi;
                 auto hImageList = SHGetFileInfoA((char*)ext.c_str(), 0, &sfi, sizeof(sfi), SHGFI_ICON | SHGFI_USEFILEATTRIBUTES);
                 if (hImageList && sfi.iIcon != defaultFileIicon) {
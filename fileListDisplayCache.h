@@ -0,0 +1,188 @@
+#pragma once
+
+#include "commonFileReading.h"
+#include "fileSearching.h"
+#include "utility.h"
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <ctime>
+#include <future>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Number of days between 1601-01-01 (FILETIME epoch) and 1970-01-01
+constexpr inline int64_t DaysFrom1601To1970 = 134774;
+
+// Offset of local time from UTC in minutes. It's computed once, which matches what FileTimeToLocalFileTime does
+// (it always uses the current bias, not the one that was in effect at the converted date)
+static int32_t cachedLocalTimeOffsetInMinutes() {
+    static const int32_t offset = [] {
+        auto now = std::time(nullptr);
+        std::tm utc = *std::gmtime(&now);
+        utc.tm_isdst = -1;
+        auto utcAsLocal = std::mktime(&utc);
+        return int32_t(std::difftime(now, utcAsLocal) / 60);
+    }();
+    return offset;
+}
+
+static char* writeTwoDigits(char* out, int value) {
+    out[0] = char('0' + value / 10);
+    out[1] = char('0' + value % 10);
+    return out + 2;
+}
+
+// Writes date in "dd.mm.yyyy hh:mm" format. Returns pointer past the last written char
+static char* formatDate(char* out, char* outEnd, uint32_t lastModificationDateInMinutes, int32_t localTimeOffsetInMinutes) {
+    int64_t minutes = int64_t(lastModificationDateInMinutes) + localTimeOffsetInMinutes;
+    int64_t days = minutes >= 0 ? minutes / 1440 : (minutes - 1439) / 1440;
+    int minuteOfDay = int(minutes - days * 1440);
+
+    // civil from days (Howard Hinnant's algorithm)
+    int64_t z = days - DaysFrom1601To1970 + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    int day = int(doy - (153 * mp + 2) / 5 + 1);
+    int month = int(mp < 10 ? mp + 3 : mp - 9);
+    int64_t year = yoe + era * 400 + (month <= 2);
+
+    out = writeTwoDigits(out, day);
+    *out++ = '.';
+    out = writeTwoDigits(out, month);
+    *out++ = '.';
+    out = std::to_chars(out, outEnd, year).ptr;
+    *out++ = ' ';
+    out = writeTwoDigits(out, minuteOfDay / 60);
+    *out++ = ':';
+    return writeTwoDigits(out, minuteOfDay % 60);
+}
+
+// Writes size as "x.y GB", "x.y MB" or "x.y KB". Returns pointer past the last written char
+static char* formatSize(char* out, char* outEnd, double size) {
+    const char* unit;
+    if (size >= 1'000'000'000) {
+        size /= 1'000'000'000;
+        unit = " GB";
+    } else if (size >= 1'000'000) {
+        size /= 1'000'000;
+        unit = " MB";
+    } else {
+        size /= 1'000;
+        unit = " KB";
+    }
+    out = std::to_chars(out, outEnd - 3, size, std::chars_format::fixed, 1).ptr;
+    for (int i = 0; i < 3; ++i)
+        *out++ = unit[i];
+    return out;
+}
+
+struct DisplayRow {
+    uint32_t fileId = std::numeric_limits<uint32_t>::max();
+    uint64_t generation = 0;
+    std::string fullPath;
+    std::string_view name; // points into FileList::nameTable of the segment, valid for the matching generation
+    std::string_view extension;
+    std::array<char, 24> size;
+    std::array<char, 24> date;
+
+    bool matches(uint32_t id, uint64_t gen) const {
+        return fileId == id && generation == gen;
+    }
+};
+
+static void fillDisplayRow(DisplayRow& row, FileListSegments& segments, uint32_t fileId, uint64_t generation, int32_t localTimeOffsetInMinutes) {
+    auto& fileList = segments.fileListOf(fileId);
+    auto& file = segments.file(fileId);
+    row.fileId = fileId;
+    row.generation = generation;
+    row.fullPath = fullFilePath(file, fileList);
+    row.name = file.getName(fileList.nameTable);
+    row.extension = file.isDir() ? std::string_view() : fileNameExtension(row.name);
+    *formatSize(row.size.data(), row.size.data() + row.size.size() - 1, file.size) = '\0';
+    *formatDate(row.date.data(), row.date.data() + row.date.size() - 1, file.lastModificationDateInMinutes, localTimeOffsetInMinutes) = '\0';
+}
+
+/*
+    Formatted strings for rows visible in the results table. Rows are kept in direct-mapped slots keyed by
+    (global file id, segments generation), so a refreshed segment invalidates everything without explicit clearing.
+    After each frame the rows just below the visible window are formatted on a background thread.
+*/
+class FileListDisplayCache {
+    static constexpr uint32_t SlotCount = 1 << 12;
+
+    std::vector<DisplayRow> slots;
+    std::future<std::vector<DisplayRow>> prefetchTask;
+    int32_t localTimeOffsetInMinutes;
+
+    void storeRow(DisplayRow&& row) {
+        slots[row.fileId & (SlotCount - 1)] = std::move(row);
+    }
+    void collectPrefetchedRows() {
+        if (prefetchTask.valid() && prefetchTask.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            for (auto& row : prefetchTask.get())
+                storeRow(std::move(row));
+        }
+    }
+
+public:
+    int rowsFormattedLastFrame = 0;
+
+    FileListDisplayCache() : slots(SlotCount), localTimeOffsetInMinutes(cachedLocalTimeOffsetInMinutes()) {}
+    FileListDisplayCache(const FileListDisplayCache&) = delete;
+    FileListDisplayCache& operator=(const FileListDisplayCache&) = delete;
+    ~FileListDisplayCache() {
+        if (prefetchTask.valid())
+            prefetchTask.wait();
+    }
+
+    // Call once per frame before get(). Moves rows formatted in the background into the cache
+    void beginFrame() {
+        rowsFormattedLastFrame = 0;
+        collectPrefetchedRows();
+    }
+
+    // Caller must hold shared lock on FileListSegments::mutex
+    const DisplayRow& get(FileListSegments& segments, uint32_t fileId) {
+        auto& slot = slots[fileId & (SlotCount - 1)];
+        if (!slot.matches(fileId, segments.generation)) {
+            fillDisplayRow(slot, segments, fileId, segments.generation, localTimeOffsetInMinutes);
+            rowsFormattedLastFrame += 1;
+        }
+        return slot;
+    }
+
+    // Formats rows [from, from + count) of results in the background, once they are listed (see SearchResultsLister).
+    // Caller must hold shared lock on FileListSegments::mutex
+    void prefetch(FileListSegments& segments, const FileListSearchResults& results, int from, int count) {
+        auto end = std::min(from + count, results.count);
+        if (end <= from || isRunning(prefetchTask) || !results.isMaterialized(from, end))
+            return;
+        collectPrefetchedRows();
+        std::vector<uint32_t> ids;
+        for (int i = from; i < end; ++i) {
+            auto fileId = results.id(segments, i);
+            auto& slot = slots[fileId & (SlotCount - 1)];
+            if (!slot.matches(fileId, segments.generation))
+                ids.push_back(fileId);
+        }
+        if (ids.empty())
+            return;
+        prefetchTask = std::async(std::launch::async, [&segments, ids = std::move(ids), generation = segments.generation, offset = localTimeOffsetInMinutes]() {
+            std::vector<DisplayRow> rows;
+            std::shared_lock lg{ segments.mutex };
+            if (segments.generation != generation)
+                return rows;
+            rows.resize(ids.size());
+            for (int i = 0; i < ids.size(); ++i)
+                fillDisplayRow(rows[i], segments, ids[i], generation, offset);
+            return rows;
+        });
+    }
+};
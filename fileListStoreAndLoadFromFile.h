@@ -1,11 +1,18 @@
 #pragma once
 
+#include "columnEncoding.h"
 #include "compression.h"
 #include "commonFileReading.h"
 #include "utility.h"
 
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <cstdint>
+#include <memory>
+#include <string>
 #include <numeric>
 #include <algorithm>
 #include <vector>
@@ -13,62 +20,721 @@
 #include <shared_mutex>
 #include <execution>
 
-static void saveFileList(const std::string& fileName, const FileList& fileList, std::mutex& mutex) {
-    int32_t fileCount = int32_t(fileList.files.size());
-    int32_t nameTableSize = int32_t(fileList.nameTable.size());
-    int32_t size = fileCount * sizeof(fileList.files[0]) + nameTableSize;
-    int32_t filesDataOffset = 0;
-    int32_t fileNameTableOffset = filesDataOffset + fileCount * sizeof(fileList.files[0]);
+/*
+    File list format (version 3) is used in place from a mapped file (see MappedFile), so loading it only maps it and
+    verifies checksums. Header: int32 FileListFormatMarker, uint32 version, uint64 file count, uint32 section count,
+    uint32 Compression, then uint64 offset, size in bytes and checksum64 of every section (in FileListSection order)
+    and checksum64 of everything before it. Sections start at multiples of FileListSectionAlignment, so they can be
+    used as arrays, empty optional sections have size 0. Uncompressed files are a few times bigger than the compressed
+    version 2 format (still read, see loadFileListVersion2), but the pages are shared between all processes that have
+    the list mapped. Files saved with compression have each section stored as a block stream (see compressBlocksParallel),
+    sizes and checksums in the header are still those of the uncompressed sections. Archival files (Compression::Columnar)
+    have FileListColumn sections instead, also stored as block streams. Version 4 stores names with their lengths
+    and a padded table tail (see appendName), version 3 name tables are rebuilt that way when they're loaded.
+    Version 1 files start with int32 size of the compressed data instead of the marker (see loadFileListVersion1)
+*/
+constexpr inline int32_t FileListFormatMarker = -1;
+constexpr inline uint32_t FileListFormatVersion = 4;
+constexpr inline uint64_t FileListSectionAlignment = 4096;
 
-    std::vector<char> data(size);
-    std::copy((char*)fileList.files.data(), (char*)(fileList.files.data() + fileCount), data.data() + filesDataOffset);
-    std::copy(fileList.nameTable.data(), fileList.nameTable.data() + nameTableSize, data.data() + fileNameTableOffset);
+enum class FileListSection {
+    Files,
+    NameTable,
+    LowerNameTable,
+    Sizes,
+    AllocatedSizes,
+    SizeSortIndex,
+    NameSortIndex,
+    DateSortIndex,
+    PathSortIndex,
+    ExtensionSortIndex,
+    NameRanks,
+    PathRanks,
+    ExtensionRanks,
+    Count
+};
 
-    auto [compressedData, compressedSize] = compress(data.data(), size);
+struct FileListSectionEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
 
-    std::lock_guard l{ mutex };
-    std::ofstream fileOut(fileName, std::ios::binary);
-    fileOut.write((char*)&size, sizeof(size));
-    fileOut.write((char*)&compressedSize, sizeof(compressedSize));
-    fileOut.write((char*)&fileCount, sizeof(fileCount));
-    fileOut.write((char*)&nameTableSize, sizeof(nameTableSize));
-    fileOut.write((char*)&filesDataOffset, sizeof(filesDataOffset));
-    fileOut.write((char*)&fileNameTableOffset, sizeof(fileNameTableOffset));
-    fileOut.write(compressedData.data(), compressedSize);
+struct FileListHeader {
+    int32_t marker;
+    uint32_t version;
+    uint64_t fileCount;
+    uint32_t sectionCount;
+    Compression compression;
+    FileListSectionEntry sections[int(FileListSection::Count)];
+    uint64_t checksum;
+};
+static_assert(sizeof(FileListHeader) <= FileListSectionAlignment);
+
+// Arrays of the file list and its indexes in FileListSection order
+static std::vector<std::pair<const char*, uint64_t>> fileListSectionData(const FileList& fileList, const FileListExtension& fileListExt) {
+    auto fileCount = fileList.files.size();
+    auto array = [](const auto& values, size_t expectedSize) {
+        bool isPresent = values.size() == expectedSize;
+        return std::pair((const char*)values.data(), isPresent ? values.size() * sizeof(values[0]) : 0);
+    };
+    return {
+        array(fileList.files, fileCount),
+        array(fileList.nameTable, fileList.nameTable.size()),
+        array(fileList.lowerNameTable, fileList.nameTable.size()),
+        array(fileList.sizes, fileCount),
+        array(fileList.allocatedSizes, fileCount),
+        array(fileListExt.sizeSortIndex, fileCount),
+        array(fileListExt.nameSortIndex, fileCount),
+        array(fileListExt.dateSortIndex, fileCount),
+        array(fileListExt.pathSortIndex, fileCount),
+        array(fileListExt.extensionSortIndex, fileCount),
+        array(fileListExt.nameRanks, fileCount),
+        array(fileListExt.pathRanks, fileCount),
+        array(fileListExt.extensionRanks, fileCount),
+    };
 }
 
-static FileList loadFileList(const std::string& fileName, std::mutex& mutex) {
+/*
+    Sections of archival files. They keep only what the rest is created from, every column in the encoding that suits it,
+    so they are several times smaller than compressed files, but indexes are created again after loading them
+*/
+enum class FileListColumn {
+    Names, // distinct names sorted and front coded
+    NameIds, // position of the name of every file in Names, frame of reference coded
+    Parents, // delta varints, siblings are mostly next to each other
+    Directories, // one bit per file, frame of reference coded
+    Dates, // frame of reference coded
+    FloatSizes, // bits of FileInfo::size, frame of reference coded. Empty when it's the float of exact size
+    Sizes, // bucketed, empty when not known
+    AllocatedSizes, // bucketed, empty when not known
+    Count
+};
+
+static std::vector<std::vector<char>> encodeFileListColumns(const FileList& fileList) {
+    auto& files = fileList.files;
+    auto fileCount = files.size();
+    auto nameOf = [&](uint32_t reference) { return nameViewAt(fileList.nameTable, reference); };
+
+    // the same name can be stored more than once, so ids are given to distinct names, not references
+    std::vector<uint32_t> references(fileCount);
+    parallelFor(0, fileCount, [&](size_t i) { references[i] = files[i].nameReference(); });
+    parallelSort(references.begin(), references.end(), std::less<>());
+    references.erase(std::unique(references.begin(), references.end()), references.end());
+    parallelSort(references.begin(), references.end(), [&](uint32_t a, uint32_t b) { return nameOf(a) < nameOf(b); });
+    std::vector<std::string_view> sortedNames;
+    std::vector<uint32_t> nameIdOfReference(fileList.nameTable.size() / NameAlignment);
+    for (auto reference : references) {
+        if (sortedNames.empty() || sortedNames.back() != nameOf(reference))
+            sortedNames.push_back(nameOf(reference));
+        nameIdOfReference[reference] = uint32_t(sortedNames.size() - 1);
+    }
+
+    bool hasSizes = fileList.sizes.size() == fileCount;
+    bool hasAllocatedSizes = fileList.allocatedSizes.size() == fileCount;
+    std::atomic<bool> areFloatSizesOfSizes = hasSizes;
+    if (hasSizes) {
+        parallelFor(0, fileCount, [&](size_t i) {
+            if (files[i].size != float(fileList.sizes[i]))
+                areFloatSizesOfSizes = false;
+        });
+    }
+    std::vector<std::vector<char>> columns(int(FileListColumn::Count));
+    parallelFor(0, columns.size(), [&](size_t column) {
+        auto& out = columns[column];
+        switch (FileListColumn(column)) {
+        case FileListColumn::Names:
+            appendFrontCoded(out, sortedNames);
+            break;
+        case FileListColumn::NameIds:
+            appendFrameOfReference(out, fileCount, [&](size_t i) { return nameIdOfReference[files[i].nameReference()]; });
+            break;
+        case FileListColumn::Parents:
+            appendDeltaVarints(out, fileCount, [&](size_t i) { return files[i].parentIndex; });
+            break;
+        case FileListColumn::Directories:
+            appendFrameOfReference(out, fileCount, [&](size_t i) { return files[i].isDir(); });
+            break;
+        case FileListColumn::Dates:
+            appendFrameOfReference(out, fileCount, [&](size_t i) { return files[i].lastModificationDateInMinutes; });
+            break;
+        case FileListColumn::FloatSizes:
+            if (!areFloatSizesOfSizes)
+                appendFrameOfReference(out, fileCount, [&](size_t i) { return std::bit_cast<uint32_t>(files[i].size); });
+            break;
+        case FileListColumn::Sizes:
+            if (hasSizes)
+                appendBucketed(out, fileCount, [&](size_t i) { return fileList.sizes[i]; });
+            break;
+        case FileListColumn::AllocatedSizes:
+            if (hasAllocatedSizes)
+                appendBucketed(out, fileCount, [&](size_t i) { return fileList.allocatedSizes[i]; });
+            break;
+        default:
+            break;
+        }
+    }, 1);
+    return columns;
+}
+
+// Returns empty list if columns are corrupted
+static FileList decodeFileListColumns(const std::vector<std::vector<char>>& columns, uint64_t fileCount) {
     FileList fileList;
-    int32_t originalSize, compressedSize, fileCount, nameTableSize, filesDataOffset, fileNameTableOffset;
-    std::vector<char> compressedData;
-    
+    auto& files = fileList.files.owned();
+    auto& nameTable = fileList.nameTable.owned();
+    files.resize(fileCount);
+    std::vector<uint32_t> nameReferences;
+    std::vector<uint32_t> nameIds(fileCount);
+    std::vector<uint8_t> isDirectory(fileCount);
+    bool hasFloatSizes = !columns[int(FileListColumn::FloatSizes)].empty();
+    if (!columns[int(FileListColumn::Sizes)].empty())
+        fileList.sizes.owned().resize(fileCount);
+    else if (!hasFloatSizes)
+        return FileList();
+    if (!columns[int(FileListColumn::AllocatedSizes)].empty())
+        fileList.allocatedSizes.owned().resize(fileCount);
+
+    std::atomic<bool> isCorrupted = false;
+    parallelFor(0, columns.size(), [&](size_t column) {
+        auto pos = columns[column].data();
+        auto end = pos + columns[column].size();
+        if (pos == end)
+            return;
+        bool isDecoded = false;
+        switch (FileListColumn(column)) {
+        case FileListColumn::Names:
+            isDecoded = decodeFrontCoded(pos, end, [&](size_t, std::string_view name) { nameReferences.push_back(appendName(nameTable, name)); });
+            break;
+        case FileListColumn::NameIds:
+            isDecoded = decodeFrameOfReference(pos, end, fileCount, [&](size_t i, uint64_t id) { nameIds[i] = uint32_t(std::min<uint64_t>(id, MaxNameReference)); });
+            break;
+        case FileListColumn::Parents:
+            isDecoded = decodeDeltaVarints(pos, end, fileCount, [&](size_t i, uint64_t parent) { files[i].parentIndex = uint32_t(parent); });
+            break;
+        case FileListColumn::Directories:
+            isDecoded = decodeFrameOfReference(pos, end, fileCount, [&](size_t i, uint64_t bit) { isDirectory[i] = bit != 0; });
+            break;
+        case FileListColumn::Dates:
+            isDecoded = decodeFrameOfReference(pos, end, fileCount, [&](size_t i, uint64_t date) { files[i].lastModificationDateInMinutes = uint32_t(date); });
+            break;
+        case FileListColumn::FloatSizes:
+            isDecoded = decodeFrameOfReference(pos, end, fileCount, [&](size_t i, uint64_t bits) { files[i].size = std::bit_cast<float>(uint32_t(bits)); });
+            break;
+        case FileListColumn::Sizes:
+            isDecoded = decodeBucketed(pos, end, fileCount, [&](size_t i, uint64_t size) { fileList.sizes[i] = size; });
+            break;
+        case FileListColumn::AllocatedSizes:
+            isDecoded = decodeBucketed(pos, end, fileCount, [&](size_t i, uint64_t size) { fileList.allocatedSizes[i] = size; });
+            break;
+        default:
+            break;
+        }
+        if (!isDecoded || pos != end)
+            isCorrupted = true;
+    }, 1);
+    if (isCorrupted || nameTable.empty() || nameTable.size() / NameAlignment > MaxNameReference)
+        return FileList();
+
+    parallelFor(0, fileCount, [&](size_t i) {
+        if (nameIds[i] >= nameReferences.size() || files[i].parentIndex >= fileCount) {
+            isCorrupted = true;
+            return;
+        }
+        files[i].nameTableIndexAndInfo = nameReferences[nameIds[i]] | (uint32_t(isDirectory[i]) << 31);
+        if (!hasFloatSizes)
+            files[i].size = float(fileList.sizes[i]);
+    });
+    if (isCorrupted)
+        return FileList();
+    fileList.lowerNameTable = fileList.nameTable;
+    fastBigStringToLower(fileList.lowerNameTable.data(), fileList.lowerNameTable.size());
+    return fileList;
+}
+
+/*
+    Saves the list with all its indexes that are complete. Writes a temporary file and moves it over the old one,
+    so a process that has the old file mapped keeps using it. Returns false if the list couldn't be saved, the old file
+    then stays as it was. Compressed sections are streamed to the file as their blocks get compressed
+*/
+static bool saveFileList(const std::string& fileName, const FileList& fileList, FileListExtension& fileListExt, Compression compression = Compression::None) {
+    std::vector<std::vector<char>> columns;
+    std::vector<std::pair<const char*, uint64_t>> sections;
+    if (compression == Compression::Columnar) {
+        columns = encodeFileListColumns(fileList);
+        for (auto& column : columns)
+            sections.emplace_back(column.data(), column.size());
+    } else {
+        sections = fileListSectionData(fileList, fileListExt);
+    }
+    FileListHeader header = {};
+    header.marker = FileListFormatMarker;
+    header.version = FileListFormatVersion;
+    header.fileCount = fileList.files.size();
+    header.sectionCount = uint32_t(sections.size());
+    header.compression = compression;
+    parallelFor(0, sections.size(), [&](size_t i) {
+        header.sections[i].checksum = checksum64(sections[i].first, sections[i].second);
+    }, 1);
+
+    std::lock_guard l{ fileListExt.fileListFileMutex };
+    auto temporaryFileName = fileName + ".tmp";
     {
-        std::lock_guard l{ mutex };
-        std::ifstream fileIn(fileName, std::ios::binary);
-        if (!fileIn)
-            return fileList;
+        std::ofstream fileOut(temporaryFileName, std::ios::binary);
+        std::vector<char> padding(FileListSectionAlignment, '\0');
+        uint64_t position = FileListSectionAlignment;
+        fileOut.write(padding.data(), FileListSectionAlignment); // header is written last, once offsets are known
+        for (size_t i = 0; i < sections.size(); ++i) {
+            auto [data, size] = sections[i];
+            header.sections[i].offset = position;
+            header.sections[i].size = size;
+            if (compression == Compression::None) {
+                fileOut.write(data, size);
+                position += size;
+            } else {
+                // columns are already compact, names still shrink a lot with LZ4HC
+                auto blockCompression = compression == Compression::Columnar ? Compression::Lz4Hc : compression;
+                compressBlocksParallel(data, size, blockCompression, [&](const char* block, size_t blockSize) {
+                    fileOut.write(block, blockSize);
+                    position += blockSize;
+                });
+            }
+            auto paddingSize = (FileListSectionAlignment - position % FileListSectionAlignment) % FileListSectionAlignment;
+            fileOut.write(padding.data(), paddingSize);
+            position += paddingSize;
+        }
+        header.checksum = checksum64(&header, offsetof(FileListHeader, checksum));
+        fileOut.seekp(0);
+        fileOut.write((char*)&header, sizeof(header));
+        if (!fileOut) {
+            fileOut.close();
+            std::remove(temporaryFileName.c_str());
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporaryFileName, fileName, error);
+    if (error) {
+        // Windows doesn't replace a file while it's mapped (also by this process, when the list was loaded from it), but lets it be renamed.
+        // The old file is moved aside and removed once it isn't mapped anymore, by this save or a later one
+        auto oldFileName = fileName + ".old";
+        std::filesystem::remove(oldFileName, error);
+        std::filesystem::rename(fileName, oldFileName, error);
+        bool isMovedAside = !error;
+        if (isMovedAside)
+            std::filesystem::rename(temporaryFileName, fileName, error);
+        if (!isMovedAside || error) {
+            if (isMovedAside)
+                std::filesystem::rename(oldFileName, fileName, error);
+            std::remove(temporaryFileName.c_str());
+            return false;
+        }
+        std::filesystem::remove(oldFileName, error);
+    }
+    return true;
+}
 
-        fileIn.read((char*)&originalSize, sizeof(originalSize));
-        fileIn.read((char*)&compressedSize, sizeof(compressedSize));
-        fileIn.read((char*)&fileCount, sizeof(fileCount));
-        fileIn.read((char*)&nameTableSize, sizeof(nameTableSize));
-        fileIn.read((char*)&filesDataOffset, sizeof(filesDataOffset));
-        fileIn.read((char*)&fileNameTableOffset, sizeof(fileNameTableOffset));
+/*
+    Older versions stored bare null terminated names, at byte offsets (version 1, oldReferenceShift 0) or at multiples
+    of NameAlignment (versions 2 and 3), so the name table is rebuilt in the current layout. Returns false if the table is corrupted
+*/
+static bool rebuildOldNameTable(FileList& fileList, int oldReferenceShift) {
+    auto& files = fileList.files;
+    auto& oldNameTable = fileList.nameTable;
+    if (oldNameTable.empty() || oldNameTable.back() != '\0')
+        return false;
+    std::vector<uint64_t> offsets(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+        offsets[i] = uint64_t(files[i].nameReference()) << oldReferenceShift;
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    if (offsets.back() >= oldNameTable.size())
+        return false;
 
-        compressedData.resize(compressedSize);
-        fileIn.read(compressedData.data(), compressedSize);
+    std::string nameTable;
+    nameTable.reserve(oldNameTable.size() + offsets.size() * (NameLengthSize + NameAlignment) + NameTableTailPadding);
+    std::vector<uint32_t> references(offsets.size());
+    for (size_t i = 0; i < offsets.size(); ++i)
+        references[i] = appendName(nameTable, &oldNameTable[offsets[i]]);
+    if (nameTable.size() / NameAlignment > MaxNameReference)
+        return false;
+    parallelFor(0, files.size(), [&](size_t i) {
+        auto pos = std::lower_bound(offsets.begin(), offsets.end(), uint64_t(files[i].nameReference()) << oldReferenceShift) - offsets.begin();
+        files[i].nameTableIndexAndInfo = (files[i].nameTableIndexAndInfo & ~MaxNameReference) | references[pos];
+    });
+    fileList.nameTable = std::move(nameTable);
+    return true;
+}
+
+// Bytes after the read position. Sizes read from older files are checked against it before anything is allocated
+static uint64_t remainingSize(std::ifstream& fileIn) {
+    auto position = fileIn.tellg();
+    fileIn.seekg(0, std::ios::end);
+    auto end = fileIn.tellg();
+    fileIn.seekg(position);
+    return position < 0 || end < position ? 0 : uint64_t(end - position);
+}
+
+// LZ4 can't expand data more than 255 times
+static bool isPossibleCompressedSize(uint64_t compressedSize, uint64_t originalSize) {
+    return originalSize / 255 <= compressedSize;
+}
+
+// Indexes and parents loaded from a file are used as file ids without further checks
+static bool areAllBelow(std::span<const uint32_t> values, uint64_t limit) {
+    std::atomic<bool> isAnyAbove = false;
+    parallelFor(0, values.size(), [&](size_t i) {
+        if (values[i] >= limit)
+            isAnyAbove = true;
+    });
+    return !isAnyAbove;
+}
+
+// Reads the rest of a version 1 file, after its first field
+static FileList loadFileListVersion1(std::ifstream& fileIn, int32_t originalSize, std::vector<uint32_t>& pathSortIndex) {
+    FileList fileList;
+    int32_t compressedSize, fileCount, nameTableSize, filesDataOffset, fileNameTableOffset;
+    int32_t pathSortIndexCount = 0, compressedPathSortIndexSize = 0;
+    int32_t exactSizesCount = 0, compressedExactSizesSize = 0;
+    std::vector<char> compressedData;
+    std::vector<char> compressedPathSortIndex;
+    std::vector<char> compressedExactSizes;
+
+    fileIn.read((char*)&compressedSize, sizeof(compressedSize));
+    fileIn.read((char*)&fileCount, sizeof(fileCount));
+    fileIn.read((char*)&nameTableSize, sizeof(nameTableSize));
+    fileIn.read((char*)&filesDataOffset, sizeof(filesDataOffset));
+    fileIn.read((char*)&fileNameTableOffset, sizeof(fileNameTableOffset));
+    if (!fileIn || originalSize < 0 || compressedSize < 0 || uint64_t(compressedSize) > remainingSize(fileIn) || !isPossibleCompressedSize(compressedSize, originalSize))
+        return fileList;
+
+    compressedData.resize(compressedSize);
+    fileIn.read(compressedData.data(), compressedSize);
+
+    if (fileIn.read((char*)&pathSortIndexCount, sizeof(pathSortIndexCount)) && fileIn.read((char*)&compressedPathSortIndexSize, sizeof(compressedPathSortIndexSize))
+        && compressedPathSortIndexSize >= 0 && uint64_t(compressedPathSortIndexSize) <= remainingSize(fileIn)) {
+        compressedPathSortIndex.resize(compressedPathSortIndexSize);
+        if (!fileIn.read(compressedPathSortIndex.data(), compressedPathSortIndexSize))
+            pathSortIndexCount = 0;
+    } else {
+        pathSortIndexCount = 0;
+    }
+    if (fileIn.read((char*)&exactSizesCount, sizeof(exactSizesCount)) && fileIn.read((char*)&compressedExactSizesSize, sizeof(compressedExactSizesSize))
+        && compressedExactSizesSize >= 0 && uint64_t(compressedExactSizesSize) <= remainingSize(fileIn)) {
+        compressedExactSizes.resize(compressedExactSizesSize);
+        if (!fileIn.read(compressedExactSizes.data(), compressedExactSizesSize))
+            exactSizesCount = 0;
+    } else {
+        exactSizesCount = 0;
     }
 
-    auto data = decompress(compressedData.data(), originalSize);
+    auto data = decompressVersion1Block(compressedData, originalSize);
+    auto sizeOfFileData = uint64_t(fileCount) * sizeof(FileInfo);
+    if (data.empty() || fileCount <= 0 || nameTableSize <= 0 || filesDataOffset < 0 || fileNameTableOffset < 0
+        || filesDataOffset + sizeOfFileData > data.size() || uint64_t(fileNameTableOffset) + nameTableSize > data.size()) {
+        return fileList;
+    }
 
-    auto sizeOfFileData = fileCount * sizeof(fileList.files[0]);
-    fileList.files.resize(fileCount);
-    fileList.nameTable.resize(nameTableSize);
+    fileList.files.owned().resize(fileCount);
+    fileList.nameTable.owned().resize(nameTableSize);
     std::copy(data.data() + filesDataOffset, data.data() + filesDataOffset + sizeOfFileData, (char*)fileList.files.data());
     std::copy(data.data() + fileNameTableOffset, data.data() + fileNameTableOffset + nameTableSize, fileList.nameTable.data());
+    if (!rebuildOldNameTable(fileList, 0))
+        return FileList();
 
-    fileList.lowerNameTable = fileList.nameTable;
-    fastBigStringToLower(fileList.lowerNameTable.data(), int(fileList.lowerNameTable.size()));
+    pathSortIndex.clear();
+    if (pathSortIndexCount == fileCount && pathSortIndexCount > 0) {
+        auto pathSortIndexData = decompressVersion1Block(compressedPathSortIndex, pathSortIndexCount * sizeof(uint32_t));
+        pathSortIndex.resize(pathSortIndexData.size() / sizeof(uint32_t));
+        std::copy(pathSortIndexData.begin(), pathSortIndexData.end(), (char*)pathSortIndex.data());
+        if (!areAllBelow(pathSortIndex, fileCount))
+            pathSortIndex.clear(); // it's created again
+    }
+
+    if (exactSizesCount == fileCount && exactSizesCount > 0) {
+        auto exactSizesData = decompressVersion1Block(compressedExactSizes, exactSizesCount * 2 * sizeof(uint64_t));
+        if (!exactSizesData.empty()) {
+            fileList.sizes.owned().resize(exactSizesCount);
+            fileList.allocatedSizes.owned().resize(exactSizesCount);
+            std::copy(exactSizesData.begin(), exactSizesData.begin() + exactSizesCount * sizeof(uint64_t), (char*)fileList.sizes.data());
+            std::copy(exactSizesData.begin() + exactSizesCount * sizeof(uint64_t), exactSizesData.end(), (char*)fileList.allocatedSizes.data());
+        }
+    }
+    return fileList;
+}
 
+struct CompressedSection {
+    uint64_t size = 0;
+    std::vector<char> compressedData;
+
+    bool decompressTo(char* out, uint64_t expectedSize) const {
+        return size == expectedSize && decompressVersion2Blocks(compressedData.data(), compressedData.size(), out, size);
+    }
+};
+
+static bool readSection(std::ifstream& fileIn, CompressedSection& section) {
+    uint64_t compressedSize = 0;
+    if (!fileIn.read((char*)&section.size, sizeof(section.size)) || !fileIn.read((char*)&compressedSize, sizeof(compressedSize)))
+        return false;
+    if (compressedSize > remainingSize(fileIn) || !isPossibleCompressedSize(compressedSize, section.size))
+        return false;
+    section.compressedData.resize(compressedSize);
+    return bool(fileIn.read(section.compressedData.data(), compressedSize));
+}
+
+/*
+    Reads the rest of a version 2 file, after its version. Version 2 had uint64 file count and sections of files, name table,
+    path sort index and exact sizes (sizes followed by allocated sizes), each being uint64 original size, uint64 compressed
+    size and output of compressBlocks
+*/
+static FileList loadFileListVersion2(std::ifstream& fileIn, std::vector<uint32_t>& pathSortIndex) {
+    FileList fileList;
+    uint64_t fileCount = 0;
+    CompressedSection filesSection, nameTableSection, pathSortIndexSection, exactSizesSection;
+    if (!fileIn.read((char*)&fileCount, sizeof(fileCount)))
+        return fileList;
+    if (fileCount > std::numeric_limits<uint32_t>::max() || !readSection(fileIn, filesSection) || !readSection(fileIn, nameTableSection)
+        || !readSection(fileIn, pathSortIndexSection) || !readSection(fileIn, exactSizesSection)) {
+        return fileList;
+    }
+    if (filesSection.size != fileCount * sizeof(FileInfo))
+        return fileList;
+
+    auto& files = fileList.files.owned();
+    auto& nameTable = fileList.nameTable.owned();
+    files.resize(fileCount);
+    nameTable.resize(nameTableSection.size);
+    if (!filesSection.decompressTo((char*)files.data(), fileCount * sizeof(FileInfo)) || !nameTableSection.decompressTo(nameTable.data(), nameTableSection.size)
+        || !rebuildOldNameTable(fileList, NameAlignmentShift)) {
+        return FileList();
+    }
+    if (pathSortIndexSection.size > 0) {
+        pathSortIndex.resize(fileCount);
+        if (!pathSortIndexSection.decompressTo((char*)pathSortIndex.data(), fileCount * sizeof(uint32_t)) || !areAllBelow(pathSortIndex, fileCount))
+            pathSortIndex.clear();
+    }
+    if (exactSizesSection.size > 0) {
+        std::vector<uint64_t> exactSizes(2 * fileCount);
+        if (exactSizesSection.decompressTo((char*)exactSizes.data(), exactSizes.size() * sizeof(uint64_t))) {
+            fileList.sizes = std::vector<uint64_t>(exactSizes.begin(), exactSizes.begin() + fileCount);
+            fileList.allocatedSizes = std::vector<uint64_t>(exactSizes.begin() + fileCount, exactSizes.end());
+        }
+    }
     return fileList;
 }
+
+// Decompresses and decodes columns of an archival file. Returns empty list if the file is corrupted
+static FileList loadColumnarFileList(const MappedFile& mapping, const FileListHeader& header) {
+    if (header.sectionCount != uint32_t(FileListColumn::Count) || header.fileCount == 0 || header.fileCount > std::numeric_limits<uint32_t>::max())
+        return FileList();
+    std::vector<std::vector<char>> columns(header.sectionCount);
+    std::vector<CompressedBlock> blocks;
+    for (uint32_t i = 0; i < header.sectionCount; ++i) {
+        auto& entry = header.sections[i];
+        // LZ4 can't expand data more than 255 times
+        if (entry.offset % FileListSectionAlignment != 0 || entry.offset > mapping.size() || entry.size / 255 > mapping.size())
+            return FileList();
+        columns[i].resize(entry.size);
+        if (entry.size > 0 && !findCompressedBlocks(mapping.data() + entry.offset, mapping.size() - entry.offset, columns[i].data(), entry.size, blocks))
+            return FileList();
+    }
+    if (!decompressBlocksParallel(blocks))
+        return FileList();
+    std::atomic<bool> hasWrongChecksum = false;
+    parallelFor(0, columns.size(), [&](size_t i) {
+        if (checksum64(columns[i].data(), columns[i].size()) != header.sections[i].checksum)
+            hasWrongChecksum = true;
+    }, 1);
+    if (hasWrongChecksum)
+        return FileList();
+    return decodeFileListColumns(columns, header.fileCount);
+}
+
+/*
+    Maps a file in the current format. Uncompressed arrays are used in place, compressed ones are decompressed
+    in parallel straight from the mapped file. Returns empty list if the file is corrupted
+*/
+static FileList loadMappedFileList(const std::string& fileName, FileListExtension& fileListExt) {
+    auto mapping = MappedFile::open(fileName);
+    if (!mapping || mapping->size() < sizeof(FileListHeader))
+        return FileList();
+    FileListHeader header;
+    memcpy(&header, mapping->data(), sizeof(header));
+    if (header.checksum != checksum64(&header, offsetof(FileListHeader, checksum)) || uint32_t(header.compression) > uint32_t(Compression::Columnar))
+        return FileList();
+    if (header.compression == Compression::Columnar)
+        return loadColumnarFileList(*mapping, header);
+    if (header.sectionCount != uint32_t(FileListSection::Count))
+        return FileList();
+
+    bool isCompressed = header.compression != Compression::None;
+    auto fileCount = header.fileCount;
+    auto nameTableSize = header.sections[int(FileListSection::NameTable)].size;
+    auto minNameTableSize = header.version == FileListFormatVersion ? NameTableTailPadding : 1;
+    if (fileCount == 0 || fileCount > std::numeric_limits<uint32_t>::max() || nameTableSize < minNameTableSize || nameTableSize % NameAlignment != 0)
+        return FileList();
+    for (int i = 0; i < int(FileListSection::Count); ++i) {
+        auto& section = header.sections[i];
+        auto expectedSize = i == int(FileListSection::Files) ? fileCount * sizeof(FileInfo)
+            : i == int(FileListSection::NameTable) || i == int(FileListSection::LowerNameTable) ? nameTableSize
+            : i == int(FileListSection::Sizes) || i == int(FileListSection::AllocatedSizes) ? fileCount * sizeof(uint64_t)
+            : fileCount * sizeof(uint32_t);
+        bool isOptional = i >= int(FileListSection::Sizes);
+        auto storedSize = isCompressed ? 0 : section.size; // compressed streams are checked while their blocks are found
+        if ((section.size != expectedSize && !(isOptional && section.size == 0)) || section.offset % FileListSectionAlignment != 0
+            || storedSize > mapping->size() || section.offset > mapping->size() - storedSize) {
+            return FileList();
+        }
+    }
+
+    FileList fileList;
+    std::vector<CompressedBlock> blocks;
+    bool isCorrupted = false;
+    auto useSection = [&](FileListSection section, auto& array) {
+        auto& entry = header.sections[int(section)];
+        using Array = std::remove_reference_t<decltype(array)>;
+        auto count = entry.size / sizeof(typename Array::value_type);
+        if (entry.size == 0) {
+            return;
+        } else if (!isCompressed) {
+            array = Array(mapping, entry.offset, count);
+        } else {
+            auto& elements = array.owned();
+            elements.resize(count);
+            if (!findCompressedBlocks(mapping->data() + entry.offset, mapping->size() - entry.offset, (char*)elements.data(), entry.size, blocks))
+                isCorrupted = true;
+        }
+    };
+    useSection(FileListSection::Files, fileList.files);
+    useSection(FileListSection::NameTable, fileList.nameTable);
+    useSection(FileListSection::LowerNameTable, fileList.lowerNameTable);
+    useSection(FileListSection::Sizes, fileList.sizes);
+    useSection(FileListSection::AllocatedSizes, fileList.allocatedSizes);
+    useSection(FileListSection::SizeSortIndex, fileListExt.sizeSortIndex);
+    useSection(FileListSection::NameSortIndex, fileListExt.nameSortIndex);
+    useSection(FileListSection::DateSortIndex, fileListExt.dateSortIndex);
+    useSection(FileListSection::PathSortIndex, fileListExt.pathSortIndex);
+    useSection(FileListSection::ExtensionSortIndex, fileListExt.extensionSortIndex);
+    useSection(FileListSection::NameRanks, fileListExt.nameRanks);
+    useSection(FileListSection::PathRanks, fileListExt.pathRanks);
+    useSection(FileListSection::ExtensionRanks, fileListExt.extensionRanks);
+    if (isCompressed && !isCorrupted)
+        isCorrupted = !decompressBlocksParallel(blocks);
+
+    if (!isCorrupted) {
+        auto sections = fileListSectionData(fileList, fileListExt);
+        std::atomic<bool> hasWrongChecksum = false;
+        parallelFor(0, sections.size(), [&](size_t i) {
+            if (checksum64(sections[i].first, sections[i].second) != header.sections[i].checksum)
+                hasWrongChecksum = true;
+        }, 1);
+        // names must be null terminated inside the tables
+        isCorrupted = hasWrongChecksum || fileList.nameTable.back() != '\0' || fileList.lowerNameTable.back() != '\0';
+    }
+    if (!isCorrupted && header.version != FileListFormatVersion) {
+        // indexes are by file id, so they stay valid
+        isCorrupted = !rebuildOldNameTable(fileList, NameAlignmentShift);
+        fileList.lowerNameTable = fileList.nameTable;
+        fastBigStringToLower(fileList.lowerNameTable.data(), fileList.lowerNameTable.size());
+    }
+    if (!isCorrupted) {
+        // checksums only catch damaged files, values are used as file ids and name offsets without further checks
+        auto isNameInside = [&](std::span<const char> nameTable, uint32_t reference) {
+            auto offset = uint64_t(reference) << NameAlignmentShift;
+            if (offset + NameLengthSize + NameTableTailPadding > nameTable.size())
+                return false;
+            auto length = nameViewAt(nameTable, reference).size();
+            return offset + storedNameSize(length) + NameTableTailPadding <= nameTable.size() && nameTable[offset + NameLengthSize + length] == '\0';
+        };
+        std::atomic<bool> isOutOfRange = false;
+        parallelFor(0, fileCount, [&](size_t i) {
+            auto& file = fileList.files[i];
+            if (file.parentIndex >= fileCount || !isNameInside(fileList.nameTable, file.nameReference()) || !isNameInside(fileList.lowerNameTable, file.nameReference()))
+                isOutOfRange = true;
+        });
+        for (auto index : { &fileListExt.sizeSortIndex, &fileListExt.nameSortIndex, &fileListExt.dateSortIndex, &fileListExt.pathSortIndex,
+            &fileListExt.extensionSortIndex, &fileListExt.nameRanks, &fileListExt.pathRanks, &fileListExt.extensionRanks }) {
+            if (!areAllBelow(std::span(index->data(), index->size()), fileCount))
+                isOutOfRange = true;
+        }
+        isCorrupted = isOutOfRange;
+    }
+    if (isCorrupted) {
+        fileListExt.clearIndexes();
+        return FileList();
+    }
+    return fileList;
+}
+
+/*
+    Returns empty list when the file doesn't exist or is corrupted. Lists saved in the current format come with
+    all their indexes, older formats are read into memory and come with path sort index at most
+*/
+static FileList loadFileList(const std::string& fileName, FileListExtension& fileListExt) {
+    FileList fileList;
+    {
+        std::lock_guard l{ fileListExt.fileListFileMutex };
+        std::ifstream fileIn(fileName, std::ios::binary);
+        int32_t marker = 0;
+        uint32_t version = 0;
+        if (!fileIn.read((char*)&marker, sizeof(marker)))
+            return fileList;
+        if (marker != FileListFormatMarker) {
+            fileList = loadFileListVersion1(fileIn, marker, fileListExt.pathSortIndex.owned());
+        } else if (fileIn.read((char*)&version, sizeof(version)) && version == 2) {
+            fileList = loadFileListVersion2(fileIn, fileListExt.pathSortIndex.owned());
+        } else if (fileIn && (version == 3 || version == FileListFormatVersion)) {
+            fileIn.close();
+            fileListExt.isInOlderFormat = version != FileListFormatVersion;
+            return loadMappedFileList(fileName, fileListExt);
+        }
+    }
+    fileListExt.isInOlderFormat = true;
+    if (fileList.files.empty())
+        return FileList();
+    fileList.lowerNameTable = fileList.nameTable;
+    fastBigStringToLower(fileList.lowerNameTable.data(), fileList.lowerNameTable.size());
+    return fileList;
+}
+
+// Every segment is saved to its own file named by the volume serial number. Versions that indexed only C: saved it to "fileList"
+constexpr inline const char* LegacyFileListFileName = "fileList";
+constexpr inline const char* SegmentFileNamePrefix = "fileList_";
+
+static std::string segmentFileName(uint64_t serialNumber) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s%016llx", SegmentFileNamePrefix, (unsigned long long)serialNumber);
+    return name;
+}
+
+// Loads all saved segments in parallel, ordered by volume path. Falls back to the legacy file when there are none
+static std::vector<std::unique_ptr<FileListSegment>> loadFileListSegments() {
+    std::vector<std::pair<std::string, uint64_t>> files;
+    std::error_code error;
+    for (auto& entry : std::filesystem::directory_iterator(".", error)) {
+        auto name = entry.path().filename().string();
+        if (name.rfind(SegmentFileNamePrefix, 0) != 0)
+            continue;
+        auto serialBegin = name.data() + strlen(SegmentFileNamePrefix);
+        uint64_t serialNumber = 0;
+        auto [end, ec] = std::from_chars(serialBegin, name.data() + name.size(), serialNumber, 16);
+        if (ec == std::errc() && end == name.data() + name.size() && serialNumber != 0)
+            files.emplace_back(name, serialNumber);
+    }
+    if (files.empty())
+        files.emplace_back(LegacyFileListFileName, 0);
+
+    std::vector<std::unique_ptr<FileListSegment>> segments(files.size());
+    ThreadPool threadPool;
+    threadPool.addTasks(int(files.size()), [&](int i) {
+        auto segment = std::make_unique<FileListSegment>();
+        segment->serialNumber = files[i].second;
+        segment->fileList = loadFileList(files[i].first, segment->fileListExt);
+        if (!segment->fileList.files.empty())
+            segment->volumePath = segment->fileList.files[0].getName(segment->fileList.nameTable);
+        segments[i] = std::move(segment);
+    });
+    threadPool.wait();
+    std::erase_if(segments, [](auto& segment) { return segment->fileList.files.empty(); });
+    std::sort(segments.begin(), segments.end(), [](auto& a, auto& b) { return a->volumePath < b->volumePath; });
+    return segments;
+}
@@ -51,7 +51,7 @@ static float iterateDirWithFindFirstFile(const std::string& dirPath, ThreadSafeS
         auto file = fileList.files.addFile(index);
 
         std::string fileName(ffd.cFileName);
-        file->nameTableIndexAndInfo = fileList.fileNameTable.addString(fileName.data(), int(fileName.size()));
+        file->nameTableIndexAndInfo = fileList.fileNameTable.intern(fileName.data(), int(fileName.size()));
         file->parentIndex = parentId;
         file->lastModificationDateInMinutes = ((uint64_t(ffd.ftLastWriteTime.dwHighDateTime) << 32) + ffd.ftLastWriteTime.dwLowDateTime) / Date100nsTo1MinPrecisionFactor;
         auto fullFileName = dirPath + "\\" + fileName; // TODO: can make it faster with static buffer instead of creating new string every time
@@ -88,7 +88,7 @@ static FileList getVolumeFileListWithFindFirstFile(std::atomic<double>& progress
 
     std::atomic<int> id = 0;
     auto firstFile = serFileList.files.addFile(0);
-    serFileList.fileNameTable.addString("C:", 2);
+    serFileList.fileNameTable.intern("C:", 2);
     firstFile->parentIndex = 0;
     firstFile->nameTableIndexAndInfo = (1 << 31u);
     id++;
@@ -100,21 +100,16 @@ static FileList getVolumeFileListWithFindFirstFile(std::atomic<double>& progress
     threadPool.wait();
 
     FileList fileList;
+    auto& files = fileList.files.owned();
     for (auto& block : serFileList.files.data.blocks) {
         if (block.get() == serFileList.files.data.blocks.back().get()) {
-            fileList.files.insert(fileList.files.end(), block->begin(), block->begin() + (serFileList.files.size - fileList.files.size()) + 1);
+            files.insert(files.end(), block->begin(), block->begin() + (serFileList.files.size - files.size()) + 1);
         } else {
-            fileList.files.insert(fileList.files.end(), block->begin(), block->end());
+            files.insert(files.end(), block->begin(), block->end());
         }
     }
 
-    for (auto& block : serFileList.fileNameTable.data.blocks) {
-        if (block.get() == serFileList.fileNameTable.data.blocks.back().get()) {
-            fileList.nameTable.append(block->begin(), block->begin() + (serFileList.fileNameTable.size - fileList.nameTable.size()) + 1);
-        } else {
-            fileList.nameTable.append(block->begin(), block->end());
-        }
-    }
+    serFileList.fileNameTable.copyTo(fileList.nameTable.owned());
 
     std::map<uint32_t, float> parentToSize;
     for (auto idx : addToParentSizeIds) {
@@ -133,7 +128,7 @@ static FileList getVolumeFileListWithFindFirstFile(std::atomic<double>& progress
     }
 
     fileList.lowerNameTable = fileList.nameTable;
-    fastBigStringToLower(fileList.lowerNameTable.data(), int(fileList.lowerNameTable.size()));
+    fastBigStringToLower(fileList.lowerNameTable.data(), fileList.lowerNameTable.size());
 
     return fileList;
 }
@@ -7,20 +7,34 @@
 
 #include <atomic>
 #include <array>
+#include <filesystem>
+#include <string>
+#include <string_view>
 #include <memory>
 #include <iostream>
 
-constexpr uint32_t FileRecordSizeInBytes = 1024;
+// Fixups protect the last 2 bytes of every 512 byte stride of a record, no matter the sector size
+constexpr uint32_t UpdateSequenceStrideInBytes = 512;
+
+// Size of one $MFT record. clustersPerFileRecord is a signed byte, negative values mean 2^-value bytes
+static uint32_t fileRecordSizeInBytes(const BootSector& bootSector) {
+    auto clustersPerFileRecord = int8_t(bootSector.clustersPerFileRecord & 0xff);
+    if (clustersPerFileRecord < 0)
+        return 1u << -clustersPerFileRecord;
+    return uint32_t(clustersPerFileRecord) * bootSector.bytesPerSector * bootSector.sectorsPerCluster;
+}
 
 struct ProgressInfo {
     std::atomic<double>& progress;
+    double progressShare; // part of progress this volume is responsible for, when many are parsed at the same time
     uint64_t recordCount;
     std::atomic<int64_t> recordsProcessed = 0;
+    std::atomic<int64_t> namesVisited = 0;
 
-    ProgressInfo(std::atomic<double>& progress) : progress(progress), recordCount(1) {}
+    ProgressInfo(std::atomic<double>& progress, double progressShare = 1) : progress(progress), progressShare(progressShare), recordCount(1) {}
     void addRecordsProcessed(int64_t count) {
         recordsProcessed += count;
-        progress = double(recordsProcessed) / recordCount;
+        progress.fetch_add(progressShare * count / recordCount);
         static int64_t prevWrittenSize = 0;
         if (recordsProcessed - prevWrittenSize >= 100'000) {
             prevWrittenSize = recordsProcessed;
@@ -28,6 +42,16 @@ struct ProgressInfo {
     }
 };
 
+// "C:" is opened as a volume, any other path as an image file with raw contents of a volume
+static bool isVolumeName(const std::string& volumePath) {
+    return volumePath.size() == 2 && volumePath[1] == ':';
+}
+
+static std::wstring volumeDevicePath(const std::string& volumePath) {
+    auto path = std::filesystem::path(std::u8string(volumePath.begin(), volumePath.end())).wstring();
+    return isVolumeName(volumePath) ? L"\\\\.\\" + path : path;
+}
+
 static void readVolume(void* buffer, uint64_t from, uint32_t count, HANDLE volume) {
     OVERLAPPED overlapped;
     overlapped.Offset = from & 0xffffffff;
@@ -39,7 +63,7 @@ static void readVolume(void* buffer, uint64_t from, uint32_t count, HANDLE volum
     CloseHandle(overlapped.hEvent);
 }
 
-static void readMftFileRecord(uint8_t*& buffer, uint32_t recordNumber, HANDLE volume) {
+static void readMftFileRecord(uint8_t*& buffer, uint32_t recordNumber, uint32_t recordSizeInBytes, HANDLE volume) {
     /*
         Curious note:
         When I just use ReadFile to read first record with location I get from BootSector 
@@ -58,60 +82,89 @@ static void readMftFileRecord(uint8_t*& buffer, uint32_t recordNumber, HANDLE vo
     DWORD bytesAccessed;
     NTFS_FILE_RECORD_INPUT_BUFFER inputBuffer;
     inputBuffer.FileReferenceNumber.QuadPart = recordNumber;
-    DeviceIoControl(volume, FSCTL_GET_NTFS_FILE_RECORD, &inputBuffer, sizeof(NTFS_FILE_RECORD_INPUT_BUFFER), buffer, sizeof(NTFS_FILE_RECORD_OUTPUT_BUFFER) + FileRecordSizeInBytes - 1, &bytesAccessed, &overlapped);
+    DeviceIoControl(volume, FSCTL_GET_NTFS_FILE_RECORD, &inputBuffer, sizeof(NTFS_FILE_RECORD_INPUT_BUFFER), buffer, sizeof(NTFS_FILE_RECORD_OUTPUT_BUFFER) + recordSizeInBytes - 1, &bytesAccessed, &overlapped);
     GetOverlappedResult(volume, &overlapped, &bytesAccessed, true);
     CloseHandle(overlapped.hEvent);
     auto outputBuffer = (NTFS_FILE_RECORD_OUTPUT_BUFFER*)buffer;
     buffer = outputBuffer->FileRecordBuffer;
 }
 
-static bool resolveFixup(FileRecordHeader& header) {
-    uint16_t* usa = reinterpret_cast<uint16_t*>(&reinterpret_cast<char*>(&header)[header.updateSequenceOffset]);
+static bool resolveFixupSectors(uint8_t* record, const uint16_t* usa, int sectorCount) {
     bool allUpdateSequenceNumbersMatched = true;
-    int loopCount = std::min<int>(header.updateSequenceSize, 3);
-    for (uint16_t i = 1; i < loopCount; i++) {
-        auto offset = i * 512 - sizeof(uint16_t);
-        uint16_t& check = *(uint16_t*)((char*)&header + offset);
+    for (int i = 1; i <= sectorCount; i++) {
+        uint16_t& check = *(uint16_t*)(record + i * UpdateSequenceStrideInBytes - sizeof(uint16_t));
         allUpdateSequenceNumbersMatched &= check == usa[0];
         check = usa[i];
     }
     return allUpdateSequenceNumbersMatched;
 }
 
+// 4 KiB records: sector ends are checked with one gather, AVX2 has no scatter so they are written back lane by lane
+static bool resolveFixup8Sectors(uint8_t* record, const uint16_t* usa) {
+#if defined(__AVX2__)
+    auto strides = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    auto offsets = _mm256_add_epi32(_mm256_slli_epi32(strides, 9), _mm256_set1_epi32(UpdateSequenceStrideInBytes - sizeof(uint32_t)));
+    auto sectorEnds = _mm256_i32gather_epi32((const int*)record, offsets, 1);
+    auto checks = _mm256_srli_epi32(sectorEnds, 16);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(checks, _mm256_set1_epi32(usa[0]))) != -1)
+        return false;
+    auto replacements = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(usa + 1)));
+    auto fixed = _mm256_blend_epi16(sectorEnds, _mm256_slli_epi32(replacements, 16), 0b10101010);
+    alignas(32) uint32_t fixedEnds[8];
+    _mm256_store_si256((__m256i*)fixedEnds, fixed);
+    for (int i = 0; i < 8; ++i)
+        memcpy(record + i * UpdateSequenceStrideInBytes + UpdateSequenceStrideInBytes - sizeof(uint32_t), &fixedEnds[i], sizeof(uint32_t));
+    return true;
+#else
+    return resolveFixupSectors(record, usa, 8);
+#endif
+}
+
+static bool resolveFixup(FileRecordHeader& header, uint32_t recordSizeInBytes) {
+    auto record = (uint8_t*)&header;
+    auto usa = (const uint16_t*)(record + header.updateSequenceOffset);
+    int sectorCount = header.updateSequenceSize - 1;
+    if (sectorCount < 1 || sectorCount > int(recordSizeInBytes / UpdateSequenceStrideInBytes) || header.updateSequenceOffset + 2u * header.updateSequenceSize > recordSizeInBytes)
+        return false;
+    switch (sectorCount) {
+    case 2: return resolveFixupSectors(record, usa, 2); // 1 KiB records, unrolled once inlined
+    case 8: return resolveFixup8Sectors(record, usa); // 4 KiB records
+    default: return resolveFixupSectors(record, usa, sectorCount);
+    }
+}
+
 struct DataRun {
     struct Entry {
-        uint32_t lcn;
-        uint32_t clusterCount;
+        uint64_t lcn;
+        uint64_t clusterCount;
     };
     constexpr static Entry NullEntry = Entry{ 0,0 };
 
     RunHeader* curPtr;
     void* endPtr;
     Entry remainingEntry = NullEntry;
-    uint32_t baseLcn = 0;
+    uint64_t baseLcn = 0;
 
     DataRun(NonResidentAttributeHeader* attribute) {
         curPtr = (RunHeader*)((uint8_t*)attribute + attribute->dataRunsOffset);
         endPtr = (uint8_t*)attribute + attribute->length;
     }
-    Entry getNextEntry(uint32_t clusterCountLimitPerEntry) {
+    Entry getNextEntry(uint64_t clusterCountLimitPerEntry) {
         while (remainingEntry.clusterCount == 0) {
-            if (curPtr >= endPtr || !curPtr->lengthFieldBytes)
+            if (curPtr >= endPtr || !curPtr->lengthFieldBytes || curPtr->lengthFieldBytes > 8 || curPtr->offsetFieldBytes > 8)
                 return NullEntry;
 
-            uint32_t length = 0;
-            int32_t offset = 0;
+            uint64_t length = 0;
+            uint64_t offset = 0;
 
             for (int i = 0; i < curPtr->lengthFieldBytes; i++) {
-                length |= uint32_t(((uint8_t*)curPtr)[1 + i]) << (i * 8);
+                length |= uint64_t(((uint8_t*)curPtr)[1 + i]) << (i * 8);
             }
             for (int i = 0; i < curPtr->offsetFieldBytes; i++) {
-                offset |= uint32_t(((uint8_t*)curPtr)[1 + curPtr->lengthFieldBytes + i]) << (i * 8);
+                offset |= uint64_t(((uint8_t*)curPtr)[1 + curPtr->lengthFieldBytes + i]) << (i * 8);
             }
-            if (offset & (uint32_t(1) << (curPtr->offsetFieldBytes * 8 - 1))) { // negative offset
-                for (int i = curPtr->offsetFieldBytes; i < 4; i++) {
-                    offset |= uint32_t(0xFF) << (i * 8);
-                }
+            if (curPtr->offsetFieldBytes > 0 && curPtr->offsetFieldBytes < 8 && (offset >> (curPtr->offsetFieldBytes * 8 - 1)) & 1) { // negative offset
+                offset |= ~uint64_t(0) << (curPtr->offsetFieldBytes * 8);
             }
             baseLcn += offset;
             remainingEntry.lcn = baseLcn;
@@ -120,7 +173,7 @@ struct DataRun {
             }
             curPtr = (RunHeader*)((uint8_t*)curPtr + 1 + curPtr->lengthFieldBytes + curPtr->offsetFieldBytes);
         }
-        auto returnedClusterCount = std::min<uint32_t>(remainingEntry.clusterCount, clusterCountLimitPerEntry);
+        auto returnedClusterCount = std::min<uint64_t>(remainingEntry.clusterCount, clusterCountLimitPerEntry);
         auto entry = remainingEntry;
         remainingEntry.lcn += returnedClusterCount;
         remainingEntry.clusterCount -= returnedClusterCount;
@@ -170,43 +223,277 @@ struct ThreadSafeFreeList {
     }
 };
 
-struct FileNameToIndex {
-    std::string fileName;
-    uint32_t index;
+struct MftParsingStats {
+    uint64_t serialNumber = 0;
+    uint64_t recordCount = 0;
+    uint64_t nameCount = 0;
+    uint64_t distinctNameCount = 0;
 
-    bool operator==(const FileNameToIndex& other) const {
-        return fileName == other.fileName;
+    double nameDedupRatio() const {
+        return distinctNameCount ? double(nameCount) / distinctNameCount : 1;
     }
 };
-namespace std {
-    template <> struct hash<FileNameToIndex> {
-        std::size_t operator()(const FileNameToIndex& v) const {
-            return hash<std::string>()(v.fileName);
+
+struct RecordSizes {
+    uint32_t recordNumber;
+    uint64_t size; // logical size of all data streams
+    uint64_t allocatedSize; // clusters allocated on disk (resident data takes none)
+};
+
+static std::vector<uint64_t> readMftBitmap(NonResidentAttributeHeader* bitmapAttribute, uint32_t clusterSizeInBytes, uint64_t clusterCountLimit, ThreadSafeFreeList& freeList, HANDLE volume) {
+    auto byteCount = bitmapAttribute->attributeSize;
+    std::vector<uint64_t> bitmap((byteCount + 7) / 8);
+    auto buffer = (uint8_t*)freeList.allocate();
+    uint64_t position = 0;
+    auto dataRun = DataRun(bitmapAttribute);
+    for (auto dataRunEntry = dataRun.getNextEntry(clusterCountLimit); dataRunEntry.clusterCount > 0 && position < byteCount; dataRunEntry = dataRun.getNextEntry(clusterCountLimit)) {
+        uint64_t runByteCount = uint64_t(dataRunEntry.clusterCount) * clusterSizeInBytes;
+        readVolume(buffer, dataRunEntry.lcn * clusterSizeInBytes, uint32_t(runByteCount), volume);
+        auto count = std::min(runByteCount, byteCount - position);
+        memcpy((uint8_t*)bitmap.data() + position, buffer, count);
+        position += count;
+    }
+    freeList.deallocate(buffer);
+    return bitmap;
+}
+
+// Number of records in use among [begin, end)
+static int countRecordsInUse(const std::vector<uint64_t>& bitmap, uint64_t begin, uint64_t end) {
+    end = std::min<uint64_t>(end, bitmap.size() * 64);
+    int count = 0;
+    while (begin < end) {
+        auto bitCount = std::min<uint64_t>(64 - begin % 64, end - begin);
+        auto word = bitmap[begin / 64] >> (begin % 64);
+        count += std::popcount(bitCount == 64 ? word : word & ((uint64_t(1) << bitCount) - 1));
+        begin += bitCount;
+    }
+    return count;
+}
+
+// Attributes a record visitor can ask for. Decoders of attributes that weren't asked for are not instantiated
+enum MftAttributes : uint32_t {
+    MftStandardInformation = 1 << 0, // dates
+    MftFileName = 1 << 1, // names (already in UTF-8) and parent records, DOS names are skipped
+    MftData = 1 << 2, // logical and allocated sizes of data streams
+};
+
+struct MftDataSizes {
+    uint64_t size; // logical size, only the first extent of a stream has it
+    uint64_t allocatedSize; // clusters taken on disk, resident data takes none
+};
+
+/*
+    Walks records of one piece of $MFT data and calls the visitor for every record in use:
+        static constexpr uint32_t attributes; // MftAttributes the visitor needs
+        void beginRecord(const FileRecordHeader& record);
+        void standardInformation(const FileRecordHeader& record, const StandardInformationAttribute& attribute); // if MftStandardInformation
+        void fileName(const FileRecordHeader& record, const FileNameAttributeHeader& attribute, std::string_view name); // if MftFileName
+        void data(const FileRecordHeader& record, const MftDataSizes& sizes); // if MftData, for every $DATA attribute
+        void endRecord(const FileRecordHeader& record);
+    Extension records are visited too (baseFileRecordSegment != 0), they carry attributes that didn't fit in the base record.
+    Returns number of visited names
+*/
+template <typename Visitor> static int visitMftRecords(uint8_t* fileRecordBuffer, int recordCount, uint32_t recordSizeInBytes, uint32_t clusterSizeInBytes, Visitor& visitor) {
+    int nameCount = 0;
+    for (int i = 0; i < recordCount; ++i) {
+        if (i % 1024 == 1023)
+            TaskScheduler::yieldToInteractive();
+        FileRecordHeader* fileRecord = (FileRecordHeader*)(&fileRecordBuffer[size_t(recordSizeInBytes) * i]);
+
+        if (!fileRecord->inUse || fileRecord->magic != 'ELIF')
+            continue;
+        if (!resolveFixup(*fileRecord, recordSizeInBytes))
+            continue;
+
+        visitor.beginRecord(*fileRecord);
+        AttributeHeader* attribute = (AttributeHeader*)((uint8_t*)fileRecord + fileRecord->firstAttributeOffset);
+        while (attribute->attributeType != 0xFFFFFFFF && (uint8_t*)attribute - (uint8_t*)fileRecord < recordSizeInBytes) {
+            if constexpr (bool(Visitor::attributes & MftStandardInformation)) {
+                if (attribute->attributeType == 0x10) // $STANDARD_INFORMATION
+                    visitor.standardInformation(*fileRecord, *(StandardInformationAttribute*)attribute);
+            }
+            if constexpr (bool(Visitor::attributes & MftData)) {
+                if (attribute->attributeType == 0x80) { // $DATA
+                    MftDataSizes sizes = { 0, 0 };
+                    if (attribute->nonResident) {
+                        // sizes are stored in the first extent only, runs are in every extent
+                        auto nonResidentAttribute = (NonResidentAttributeHeader*)attribute;
+                        if (nonResidentAttribute->firstCluster == 0)
+                            sizes.size = nonResidentAttribute->attributeSize;
+                        if (nonResidentAttribute->flags & 0x8001) { // sparse or compressed, only non-sparse runs take space
+                            auto dataRun = DataRun(nonResidentAttribute);
+                            for (auto dataRunEntry = dataRun.getNextEntry(std::numeric_limits<uint64_t>::max()); dataRunEntry.clusterCount > 0; dataRunEntry = dataRun.getNextEntry(std::numeric_limits<uint64_t>::max())) {
+                                sizes.allocatedSize += uint64_t(dataRunEntry.clusterCount) * clusterSizeInBytes;
+                            }
+                        } else if (nonResidentAttribute->firstCluster == 0) {
+                            sizes.allocatedSize = nonResidentAttribute->allocatedLength;
+                        }
+                    } else {
+                        sizes.size = ((ResidentAttributeHeader*)attribute)->attributeLength;
+                    }
+                    visitor.data(*fileRecord, sizes);
+                }
+            }
+            if constexpr (bool(Visitor::attributes & MftFileName)) {
+                if (attribute->attributeType == 0x30) { // $FILE_NAME
+                    FileNameAttributeHeader* fileNameAttribute = (FileNameAttributeHeader*)attribute;
+                    if (fileNameAttribute->namespaceType != 2 && !fileNameAttribute->nonResident) {
+                        std::array<char, 255 * MaxUtf8BytesPerUtf16Unit> fileNameBuf; // fileNameLength is 8 bit
+                        int size = utf16ToUtf8(fileNameBuf.data(), (const uint16_t*)fileNameAttribute->fileName, fileNameAttribute->fileNameLength);
+                        visitor.fileName(*fileRecord, *fileNameAttribute, std::string_view(fileNameBuf.data(), size));
+                        nameCount += 1;
+                    }
+                }
+            }
+            attribute = (AttributeHeader*)((uint8_t*)attribute + attribute->length);
         }
-    };
+        visitor.endRecord(*fileRecord);
+    }
+    return nameCount;
+}
+
+// Consecutive records read and visited together
+struct MftChunkRange {
+    uint64_t firstRecordNumber;
+    int recordCount;
+    int recordsInUse;
+};
+
+// Files parsed from one piece of $MFT data. Pieces cover consecutive records, so concatenating them in order gives files
+// sorted by record number no matter which thread parsed which piece
+struct MftChunk {
+    uint64_t firstRecordNumber = 0;
+    int recordCount = 0;
+    uint32_t firstFileId = 0;
+    std::vector<FileInfo> files; // parentIndex holds parent record number until ids are assigned
+    std::vector<uint32_t> recordNumbers; // record of each file
+    std::vector<RecordSizes> otherRecordSizes; // sizes of records outside of the chunk (found in extension records)
+};
+
+struct MftParseResult;
+
+// Collects files of one chunk for createFileListFromMftChunks
+struct MftFileListVisitor {
+    static constexpr uint32_t attributes = MftStandardInformation | MftFileName | MftData;
+
+    MftChunk& chunk;
+    MftParseResult& result;
+    size_t firstFile = 0;
+    uint32_t modificationDateInMinutes = 0;
+    MftDataSizes sizes = { 0, 0 };
+
+    void beginRecord(const FileRecordHeader&) {
+        firstFile = chunk.files.size();
+        modificationDateInMinutes = 0;
+        sizes = { 0, 0 };
+    }
+    void standardInformation(const FileRecordHeader&, const StandardInformationAttribute& attribute) {
+        modificationDateInMinutes = uint32_t(attribute.fileAlteredTime / Date100nsTo1MinPrecisionFactor);
+    }
+    void data(const FileRecordHeader&, const MftDataSizes& dataSizes) {
+        sizes.size += dataSizes.size;
+        sizes.allocatedSize += dataSizes.allocatedSize;
+    }
+    void fileName(const FileRecordHeader& record, const FileNameAttributeHeader& attribute, std::string_view name);
+    void endRecord(const FileRecordHeader& record);
+};
+
+struct MftParseResult {
+    std::vector<MftChunk> chunks;
+    std::string rootName = "C:";
+    FileInfo rootFile;
+    std::vector<uint64_t> recordSizes;
+    std::vector<uint64_t> recordAllocatedSizes;
+    ConcurrentStringInterner nameTable;
+
+    void prepare(uint64_t recordCount, const std::vector<MftChunkRange>& ranges) {
+        nameTable.intern("", 0);
+        recordSizes.resize(recordCount);
+        recordAllocatedSizes.resize(recordCount);
+        chunks.resize(ranges.size());
+        int recordsInUse = 0;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            chunks[i].firstRecordNumber = ranges[i].firstRecordNumber;
+            chunks[i].recordCount = ranges[i].recordCount;
+            recordsInUse += ranges[i].recordsInUse;
+        }
+        nameTable.reserve(recordsInUse / 2);
+    }
+    MftFileListVisitor chunkVisitor(size_t chunkIndex, const MftChunkRange& range) {
+        auto& chunk = chunks[chunkIndex];
+        chunk.files.reserve(range.recordsInUse);
+        chunk.recordNumbers.reserve(range.recordsInUse);
+        return MftFileListVisitor{ chunk, *this };
+    }
+};
+
+inline void MftFileListVisitor::fileName(const FileRecordHeader& record, const FileNameAttributeHeader& attribute, std::string_view name) {
+    FileInfo file;
+    file.nameTableIndexAndInfo = (uint32_t(bool(record.isDirectory)) << 31u);
+    file.size = 0;
+    file.parentIndex = uint32_t(attribute.parentRecordNumber);
+    file.lastModificationDateInMinutes = 0;
+    if (record.recordNumber == 5) { // root dir always gets id 0
+        file.nameTableIndexAndInfo |= result.nameTable.intern(result.rootName.data(), int(result.rootName.size()));
+        result.rootFile = file;
+    } else {
+        file.nameTableIndexAndInfo |= result.nameTable.intern(name.data(), int(name.size()));
+        chunk.files.push_back(file);
+        chunk.recordNumbers.push_back(record.recordNumber);
+    }
 }
 
-static void readMft(ThreadSafeSerializableFileList& fileList, ThreadSafeVec<int>& dirRecordNumberToUniqueFileId, ThreadSafeVec<int>& uniqueFileIndToRecordNumber, ThreadSafeVec<float>& recordNumberToSize, ProgressInfo& progressInfo) {
-    fileList.fileNameTable.addString("\0", 1);
-    std::atomic<int> uniqueFileId = 1; // each file, directory and hard link gets unique id; root gets 0
+inline void MftFileListVisitor::endRecord(const FileRecordHeader& record) {
+    for (auto j = firstFile; j < chunk.files.size(); ++j) {
+        chunk.files[j].lastModificationDateInMinutes = modificationDateInMinutes;
+    }
+    if (record.recordNumber == 5)
+        result.rootFile.lastModificationDateInMinutes = modificationDateInMinutes;
+    auto baseNumber = uint32_t(record.baseFileRecordSegment);
+    auto recordNumber = baseNumber ? baseNumber : record.recordNumber;
+    if (recordNumber - chunk.firstRecordNumber < uint64_t(chunk.recordCount) && recordNumber < result.recordSizes.size()) {
+        // no other chunk writes sizes of records from this chunk
+        result.recordSizes[recordNumber] += sizes.size;
+        result.recordAllocatedSizes[recordNumber] += sizes.allocatedSize;
+    } else {
+        chunk.otherRecordSizes.push_back({ recordNumber, sizes.size, sizes.allocatedSize });
+    }
+}
 
-    auto volume = CreateFileW(L"\\\\.\\C:", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+/*
+    Reads $MFT of a volume (or image) in pieces on the background pool and visits their records. Consumer provides:
+        void prepare(uint64_t recordCount, const std::vector<MftChunkRange>& ranges); // called once before any chunk is visited
+        Visitor chunkVisitor(size_t chunkIndex, const MftChunkRange& range); // called on the thread that visits the chunk
+    Volumes parsed at the same time share the background pool, so together they don't use more threads or have
+    more reads in flight than a single one. Returns serial number of the volume, 0 if it isn't NTFS or can't be read
+*/
+template <typename Consumer> static uint64_t readMft(const std::string& volumePath, Consumer& consumer, ProgressInfo& progressInfo) {
+    auto devicePath = volumeDevicePath(volumePath);
+    auto volume = CreateFileW(devicePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
     
-    BootSector bootSector;
+    BootSector bootSector = {};
     readVolume(&bootSector, 0, sizeof(BootSector), volume);
     CloseHandle(volume);
+    if (memcmp(bootSector.name, "NTFS    ", sizeof(bootSector.name)))
+        return 0;
 
-    volume = CreateFileW(L"\\\\.\\C:", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    volume = CreateFileW(devicePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
 
     uint32_t clusterSizeInBytes = bootSector.bytesPerSector * bootSector.sectorsPerCluster;
-    uint32_t fileRecordsPerCluster = clusterSizeInBytes / FileRecordSizeInBytes;
+    uint32_t recordSizeInBytes = fileRecordSizeInBytes(bootSector);
 
-    int fileRecordLimit = 1 << 10;
-    int clusterCountLimit = fileRecordLimit / fileRecordsPerCluster;
-    ThreadSafeFreeList freeList(clusterCountLimit * clusterSizeInBytes, clusterSizeInBytes);
+    // records can be bigger than clusters (4 KiB records with 512 B clusters), both are powers of 2 so chunks still hold whole records
+    uint64_t fileRecordLimit = 1 << 10;
+    uint64_t clusterCountLimit = std::max<uint64_t>(fileRecordLimit * recordSizeInBytes / clusterSizeInBytes, 1);
+    ThreadSafeFreeList freeList(int(clusterCountLimit * clusterSizeInBytes), clusterSizeInBytes);
 
     auto mftFilePtr = (uint8_t*)freeList.allocate();
-    readMftFileRecord(mftFilePtr, 0, volume);
+    if (isVolumeName(volumePath)) {
+        readMftFileRecord(mftFilePtr, 0, recordSizeInBytes, volume);
+    } else { // FSCTL_GET_NTFS_FILE_RECORD works only on mounted volumes
+        readVolume(mftFilePtr, bootSector.mftStart * clusterSizeInBytes, std::max(recordSizeInBytes, clusterSizeInBytes), volume);
+        resolveFixup(*(FileRecordHeader*)mftFilePtr, recordSizeInBytes);
+    }
 
     FileRecordHeader* fileRecord = (FileRecordHeader*)mftFilePtr;
     AttributeHeader* attribute = (AttributeHeader*)(mftFilePtr + fileRecord->firstAttributeOffset);
@@ -226,150 +513,149 @@ static void readMft(ThreadSafeSerializableFileList& fileList, ThreadSafeVec<int>
 
     uint64_t recordCount = bitmapAttribute->attributeSize * 8;
     progressInfo.recordCount = recordCount;
-    FastThreadSafeishHashSet<FileNameToIndex> fileNameToPos(std::log2(recordCount));
-    ThreadPool threadPool;
+
+    // $BITMAP has a bit for every record in use, so every chunk can reserve exactly as much as it needs
+    auto bitmap = readMftBitmap(bitmapAttribute, clusterSizeInBytes, clusterCountLimit, freeList, volume);
+
+    std::vector<DataRun::Entry> dataRunEntries;
     auto dataRun = DataRun(dataAttribute);
-    for (auto dataRunEntry = dataRun.getNextEntry(clusterCountLimit); dataRunEntry.clusterCount > 0; dataRunEntry = dataRun.getNextEntry(clusterCountLimit)) {
-        threadPool.addTask([dataRunEntry, clusterSizeInBytes, fileRecordsPerCluster, volume, &fileNameToPos, &freeList, &dirRecordNumberToUniqueFileId, &uniqueFileIndToRecordNumber, &recordNumberToSize, &fileList, &uniqueFileId, &progressInfo]() {
-            auto fileRecordBuffer = (uint8_t*)freeList.allocate();
-            readVolume(fileRecordBuffer, uint64_t(dataRunEntry.lcn) * clusterSizeInBytes, dataRunEntry.clusterCount * clusterSizeInBytes, volume);
-
-            int filesToLoad = dataRunEntry.clusterCount * fileRecordsPerCluster;
-            for (int i = 0; i < filesToLoad; ++i) {
-                FileRecordHeader* fileRecord = (FileRecordHeader*)(&fileRecordBuffer[FileRecordSizeInBytes * i]);
-
-                if (!fileRecord->inUse || fileRecord->magic != 'ELIF')
-                    continue;
-                if (!resolveFixup(*fileRecord))
-                    continue;
-
-                std::array<char, 256 * 2> fileNameBuf;
-                float fileSize = 0;
-                FastSmallVector<FileInfo*> files;
-                uint32_t modificationDateInMinutes = 0;
-                AttributeHeader* attribute = (AttributeHeader*)((uint8_t*)fileRecord + fileRecord->firstAttributeOffset);
-                while (attribute->attributeType != 0xFFFFFFFF && (uint8_t*)attribute - (uint8_t*)fileRecord < FileRecordSizeInBytes) {
-                    if (attribute->attributeType == 0x10) { // $STANDARD_INFORMATION (used for modify date)
-                        auto standardInfo = (StandardInformationAttribute*)attribute;
-                        modificationDateInMinutes = uint32_t(standardInfo->fileAlteredTime / Date100nsTo1MinPrecisionFactor);
-                    }
-                    if (attribute->attributeType == 0x80) { // $DATA (used for file size)
-                        if (attribute->nonResident) {
-                            auto nonResidentAttribute = (NonResidentAttributeHeader*)attribute;
-                            if (nonResidentAttribute->flags & 0x8000) { // sprase file
-                                auto dataRun = DataRun(nonResidentAttribute);
-                                for (auto dataRunEntry = dataRun.getNextEntry(std::numeric_limits<uint32_t>::max()); dataRunEntry.clusterCount > 0; dataRunEntry = dataRun.getNextEntry(std::numeric_limits<uint32_t>::max())) {
-                                    fileSize += dataRunEntry.clusterCount * clusterSizeInBytes;
-                                }
-                            } else if (nonResidentAttribute->firstCluster == 0) {
-                                fileSize += nonResidentAttribute->validDataLength;
-                            }
-                        } else {
-                            fileSize += attribute->length - sizeof(ResidentAttributeHeader) - attribute->nameLength;
-                        }
-                    }
-                    if (attribute->attributeType == 0x30) { // $FILE_NAME (used for file name and parent index)
-                        FileNameAttributeHeader* fileNameAttribute = (FileNameAttributeHeader*)attribute;
-                        if (fileNameAttribute->namespaceType != 2 && !fileNameAttribute->nonResident) {
-                            FileInfo* file;
-                            if (fileRecord->recordNumber == 5) { // root dir
-                                dirRecordNumberToUniqueFileId[fileRecord->recordNumber] = 0;
-                                uniqueFileIndToRecordNumber[0] = fileRecord->recordNumber;
-                                file = fileList.files.addFile(0);
-                            } else {
-                                auto id = uniqueFileId++;
-                                dirRecordNumberToUniqueFileId[fileRecord->recordNumber] = id;
-                                uniqueFileIndToRecordNumber[id] = fileRecord->recordNumber;
-                                file = fileList.files.addFile(id);
-                            }
-                            file->nameTableIndexAndInfo = (uint32_t(bool(fileRecord->isDirectory)) << 31u);
-                            file->size = 0;
-                            file->parentIndex = fileNameAttribute->parentRecordNumber;
-                            int size = wideStringToUtf8(fileNameBuf.data(), int(fileNameBuf.size()), fileNameAttribute->fileName, fileNameAttribute->fileName + fileNameAttribute->fileNameLength);
-                            if (fileNameBuf[0] == '.' && fileNameBuf[1] == '\0') {
-                                fileNameBuf[0] = 'C';
-                                fileNameBuf[1] = ':';
-                                fileNameBuf[2] = '\0';
-                                file->nameTableIndexAndInfo |= fileList.fileNameTable.addString(fileNameBuf.data(), 2);
-                            } else {
-                                FileNameToIndex fileNameToIndex = { std::string(fileNameBuf.data(), size), 0 };
-                                if (auto ptr = fileNameToPos.find(fileNameToIndex); !ptr) {
-                                    fileNameToIndex.index = fileList.fileNameTable.addString(fileNameBuf.data(), size);
-                                    file->nameTableIndexAndInfo |= fileNameToIndex.index;
-                                    fileNameToPos.emplace(std::move(fileNameToIndex));
-                                } else {
-                                    file->nameTableIndexAndInfo |= ptr->index;
-                                }
-                            }
-                            files.push_back(file);
-                        }
-                    }
-                    attribute = (AttributeHeader*)((uint8_t*)attribute + attribute->length);
-                }
-                for (auto& file : files) {
-                    file->lastModificationDateInMinutes = modificationDateInMinutes;
-                }
-                auto baseNumber = uint32_t(fileRecord->baseFileRecordSegment);
-                if (baseNumber) {
-                    recordNumberToSize[baseNumber] += fileSize;
-                } else {
-                    recordNumberToSize[fileRecord->recordNumber] += fileSize;
-                }
-            }
-            progressInfo.addRecordsProcessed(filesToLoad);
-            freeList.deallocate(fileRecordBuffer);
-        });
+    for (auto dataRunEntry = dataRun.getNextEntry(clusterCountLimit); dataRunEntry.clusterCount > 0; dataRunEntry = dataRun.getNextEntry(clusterCountLimit))
+        dataRunEntries.push_back(dataRunEntry);
+    std::vector<MftChunkRange> ranges(dataRunEntries.size());
+    uint64_t firstRecordNumber = 0;
+    for (size_t i = 0; i < dataRunEntries.size(); ++i) {
+        ranges[i].firstRecordNumber = firstRecordNumber;
+        ranges[i].recordCount = int(dataRunEntries[i].clusterCount * clusterSizeInBytes / recordSizeInBytes);
+        ranges[i].recordsInUse = countRecordsInUse(bitmap, firstRecordNumber, firstRecordNumber + ranges[i].recordCount);
+        firstRecordNumber += ranges[i].recordCount;
     }
+    consumer.prepare(recordCount, ranges);
+
+    ThreadPool threadPool(TaskPriority::Background);
+    threadPool.addTasks(int(dataRunEntries.size()), [&](int i) {
+        auto visitor = consumer.chunkVisitor(i, ranges[i]);
+        auto fileRecordBuffer = (uint8_t*)freeList.allocate();
+        readVolume(fileRecordBuffer, dataRunEntries[i].lcn * clusterSizeInBytes, uint32_t(dataRunEntries[i].clusterCount * clusterSizeInBytes), volume);
+        progressInfo.namesVisited += visitMftRecords(fileRecordBuffer, ranges[i].recordCount, recordSizeInBytes, clusterSizeInBytes, visitor);
+        progressInfo.addRecordsProcessed(ranges[i].recordCount);
+        freeList.deallocate(fileRecordBuffer);
+    });
     threadPool.wait();
     CloseHandle(volume);
+    return bootSector.serialNumber;
 }
 
-static FileList getVolumeFileListWithMftParsing(std::atomic<double>& progress, uint64_t& outProcessedRecordCount) {
-    ThreadSafeSerializableFileList serFileList;
-    ThreadSafeVec<int> dirRecordNumberToUniqueFileId;
-    ThreadSafeVec<int> uniqueFileIndToRecordNumber;
-    ThreadSafeVec<float> recordNumberToSize;
-    ProgressInfo progressInfo(progress);
-    readMft(serFileList, dirRecordNumberToUniqueFileId, uniqueFileIndToRecordNumber, recordNumberToSize, progressInfo);
-    outProcessedRecordCount = progressInfo.recordCount;
-
-    FileList fileList;
-    for (auto& block : serFileList.files.data.blocks) {
-        if (block.get() == serFileList.files.data.blocks.back().get()) {
-            fileList.files.insert(fileList.files.end(), block->begin(), block->begin() + (serFileList.files.size - fileList.files.size()) + 1);
-        } else {
-            fileList.files.insert(fileList.files.end(), block->begin(), block->end());
+static FileList createFileListFromMftChunks(MftParseResult& result) {
+    for (auto& chunk : result.chunks) {
+        for (auto& sizes : chunk.otherRecordSizes) {
+            if (sizes.recordNumber < result.recordSizes.size()) {
+                result.recordSizes[sizes.recordNumber] += sizes.size;
+                result.recordAllocatedSizes[sizes.recordNumber] += sizes.allocatedSize;
+            }
         }
     }
 
-    for (auto& block : serFileList.fileNameTable.data.blocks) {
-        if (block.get() == serFileList.fileNameTable.data.blocks.back().get()) {
-            fileList.nameTable.append(block->begin(), block->begin() + (serFileList.fileNameTable.size - fileList.nameTable.size()) + 1);
-        } else {
-            fileList.nameTable.append(block->begin(), block->end());
-        }
+    // ids are assigned in record order (root first), so the file order is the same on every run
+    uint32_t fileCount = 1;
+    for (auto& chunk : result.chunks) {
+        chunk.firstFileId = fileCount;
+        fileCount += uint32_t(chunk.files.size());
     }
+    FileList fileList;
+    fileList.files.owned().resize(fileCount);
+    fileList.files[0] = result.rootFile;
+    std::vector<uint32_t> recordNumberToId(result.recordSizes.size(), 0);
+    std::vector<uint32_t> idToRecordNumber(fileCount, 5);
+    parallelFor(0, result.chunks.size(), [&](size_t c) {
+        auto& chunk = result.chunks[c];
+        std::copy(chunk.files.begin(), chunk.files.end(), fileList.files.begin() + chunk.firstFileId);
+        std::copy(chunk.recordNumbers.begin(), chunk.recordNumbers.end(), idToRecordNumber.begin() + chunk.firstFileId);
+        // the first name of a record represents it as a parent (directories have only one)
+        for (auto i = chunk.recordNumbers.size(); i > 0; --i) {
+            if (chunk.recordNumbers[i - 1] < recordNumberToId.size())
+                recordNumberToId[chunk.recordNumbers[i - 1]] = chunk.firstFileId + uint32_t(i - 1);
+        }
+        chunk = MftChunk();
+    }, 1);
 
-    // update parent index to correct value and fill the size
-    for (auto& file : fileList.files) {
-        file.parentIndex = dirRecordNumberToUniqueFileId[file.parentIndex];
-    }
+    result.nameTable.copyTo(fileList.nameTable.owned());
+
+    // update parent index to correct value
+    parallelFor(0, fileList.files.size(), [&](size_t i) {
+        auto& file = fileList.files[i];
+        file.parentIndex = file.parentIndex < recordNumberToId.size() ? recordNumberToId[file.parentIndex] : 0;
+    });
     
     // fill sizes of files and compute sizes of directories
-    for (int i = 0; i < fileList.files.size(); ++i) {
-        if (!(fileList.files[i].nameTableIndexAndInfo >> 31)) {
-            int index = i;
-            float fileSize = fileList.files[index].size = recordNumberToSize[uniqueFileIndToRecordNumber[index]];
-            while (fileList.files[index].parentIndex != index) {
-                fileList.files[fileList.files[index].parentIndex].size += fileSize;
-                index = fileList.files[index].parentIndex;
-            }
-        }
-    }
+    fileList.sizes.owned().resize(fileCount);
+    fileList.allocatedSizes.owned().resize(fileCount);
+    parallelFor(0, fileCount, [&](size_t i) {
+        bool isFile = !fileList.files[i].isDir();
+        fileList.sizes[i] = isFile ? result.recordSizes[idToRecordNumber[i]] : 0;
+        fileList.allocatedSizes[i] = isFile ? result.recordAllocatedSizes[idToRecordNumber[i]] : 0;
+    });
+    auto tree = createDirectoryChildren(fileList.files);
+    auto levels = createDirectoryLevels(tree);
+    sumSizesIntoDirectories(tree, levels, fileList.sizes);
+    sumSizesIntoDirectories(tree, levels, fileList.allocatedSizes);
+    parallelFor(0, fileCount, [&](size_t i) {
+        fileList.files[i].size = float(fileList.sizes[i]);
+    });
 
     fileList.lowerNameTable = fileList.nameTable;
-    fastBigStringToLower(fileList.lowerNameTable.data(), int(fileList.lowerNameTable.size()));
+    fastBigStringToLower(fileList.lowerNameTable.data(), fileList.lowerNameTable.size());
 
     return fileList;
 }
 
+// Root of the list is named volumePath. Returns empty list when the volume couldn't be parsed
+static FileList getVolumeFileListWithMftParsing(const std::string& volumePath, std::atomic<double>& progress, MftParsingStats& outStats, double progressShare = 1) {
+    MftParseResult result;
+    result.rootName = volumePath;
+    ProgressInfo progressInfo(progress, progressShare);
+    outStats.serialNumber = readMft(volumePath, result, progressInfo);
+    if (outStats.serialNumber == 0)
+        return FileList();
+    outStats.recordCount = progressInfo.recordCount;
+    outStats.nameCount = progressInfo.namesVisited;
+    outStats.distinctNameCount = result.nameTable.size();
+    return createFileListFromMftChunks(result);
+}
+
+// Counts names and distinct names without building a file list (only $FILE_NAME is decoded)
+struct MftNameStatsConsumer {
+    struct Visitor {
+        static constexpr uint32_t attributes = MftFileName;
+
+        ConcurrentStringInterner& names;
+
+        void beginRecord(const FileRecordHeader&) {}
+        void fileName(const FileRecordHeader&, const FileNameAttributeHeader&, std::string_view name) {
+            names.intern(name.data(), int(name.size()));
+        }
+        void endRecord(const FileRecordHeader&) {}
+    };
+
+    ConcurrentStringInterner names;
+
+    void prepare(uint64_t, const std::vector<MftChunkRange>& ranges) {
+        int recordsInUse = 0;
+        for (auto& range : ranges)
+            recordsInUse += range.recordsInUse;
+        names.reserve(recordsInUse / 2);
+    }
+    Visitor chunkVisitor(size_t, const MftChunkRange&) {
+        return Visitor{ names };
+    }
+};
+
+static MftParsingStats getVolumeNameStatsWithMftParsing(const std::string& volumePath, std::atomic<double>& progress) {
+    MftNameStatsConsumer consumer;
+    ProgressInfo progressInfo(progress);
+    MftParsingStats stats;
+    stats.serialNumber = readMft(volumePath, consumer, progressInfo);
+    stats.recordCount = progressInfo.recordCount;
+    stats.nameCount = progressInfo.namesVisited;
+    stats.distinctNameCount = consumer.names.size();
+    return stats;
+}
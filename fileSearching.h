@@ -1,35 +1,53 @@
 #pragma once
 
 #include "commonFileReading.h"
+#include "roaringBitmap.h"
+#include "sortIndexes.h"
 #include "utility.h"
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 #include <memory>
+#include <span>
 #include <future>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string_view>
 #include <iostream>
 
-struct FileListSearchResults {
-    std::vector<uint32_t> indexes;
-    int count = 0;
-};
+// Writes ids to [offset, offset + count) of shown results, while the search continues
+using PublishPartialResults = std::function<void(const uint32_t* ids, int offset, int count)>;
 
 struct SearchSettings {
     enum class Index {
         Direct = 0,
         Name = 1,
         Size = 2,
-        Date = 3
+        Date = 3,
+        Path = 4,
+        Extension = 5
     };
+    struct SortKey {
+        Index index = Index::Direct;
+        bool reverse = false;
+    };
+    static constexpr int MaxSortKeys = 5;
+
     bool allowSubstrings = true;
     bool isCaseSensitive = false;
     bool includeFiles = true;
     bool includeDirs = true;
     bool reverseIndex = false;
     Index index = Index::Direct;
+    std::array<SortKey, MaxSortKeys - 1> thenBy; // orders files equal on all previous keys
+    int thenByCount = 0;
 };
 
 static std::vector<std::string> splitPath(std::string_view str) {
@@ -42,157 +60,975 @@ static std::vector<std::string> splitPath(std::string_view str) {
     return result;
 }
 
-static bool compareStrToDir(const char* str, const std::string& dir) {
-    return !strcmp(str, dir.c_str());
+/*
+    Compares the first and the last char of pattern at 32 positions at once and only checks the rest where both match.
+    Loads go up to 31 bytes past the end of name, which is safe for names in name tables (see NameTableTailPadding)
+*/
+static bool containsSubstring(std::string_view name, std::string_view pattern) {
+    if (pattern.size() > name.size())
+        return false;
+    if (pattern.empty())
+        return true;
+#if defined(__AVX2__)
+    const auto first = _mm256_set1_epi8(pattern.front());
+    const auto last = _mm256_set1_epi8(pattern.back());
+    auto lastOffset = pattern.size() - 1;
+    auto startCount = name.size() - lastOffset;
+    for (size_t pos = 0; pos < startCount; pos += 32) {
+        auto firstMatches = _mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i*)(name.data() + pos)));
+        auto lastMatches = _mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i*)(name.data() + pos + lastOffset)));
+        auto mask = uint32_t(_mm256_movemask_epi8(_mm256_and_si256(firstMatches, lastMatches)));
+        if (startCount - pos < 32)
+            mask &= (1u << (startCount - pos)) - 1;
+        for (; mask; mask &= mask - 1) {
+            if (!memcmp(name.data() + pos + std::countr_zero(mask), pattern.data(), pattern.size()))
+                return true;
+        }
+    }
+    return false;
+#else
+    return name.find(pattern) != std::string_view::npos;
+#endif
 }
 
-template<typename Index> static void findFilesWithString(FileListSearchResults& results, FileList& fileList, const Index& sortIndex, const std::string& str, SearchSettings searchSettings, ThreadPool& threadPool, std::atomic<bool>& cancelSearch) {
-    auto& files = fileList.files;
+// Files are matched in chunks of this many ids, so matches of each chunk make one RoaringBitmap container
+constexpr inline int SearchChunkSize = int(RoaringBitmap::ContainerIdCount);
 
+static std::vector<std::string> searchPath(const std::string& str, const SearchSettings& searchSettings) {
     std::string searchString = str;
     if (!searchSettings.isCaseSensitive) {
-        fastBigStringToLower(searchString.data(), int(searchString.size()));
+        fastBigStringToLower(searchString.data(), searchString.size());
     }
-    auto path = splitPath(searchString);
+    return splitPath(searchString);
+}
 
-    DynamicBitset toAddMap(int(files.size()));
-    int stepSize = toAddMap.IntTypeBitSize * 1024;
-    for (int i = 0; i < files.size(); i += stepSize) {
-        threadPool.addTask([startIndex=i, stepSize, &path, &cancelSearch, &searchSettings, &files, &fileList, &toAddMap]() {
-            int endIndex = std::min(startIndex + stepSize, int(files.size()));
-            for (int i = startIndex; i < endIndex; ++i) {
-                if (cancelSearch)
-                    return;
-                auto& file = files[i];
-        
-                if (!searchSettings.includeDirs && file.isDir())
-                    continue;
-                if (!searchSettings.includeFiles && !file.isDir())
-                    continue;
+template<typename FilesView> static bool fileMatches(uint32_t i, const std::vector<std::string>& path, const SearchSettings& searchSettings, const FilesView& files, FileList& fileList) {
+    if (!searchSettings.includeDirs && files.isDir(i))
+        return false;
+    if (!searchSettings.includeFiles && !files.isDir(i))
+        return false;
 
-                if (path.size() == 1 && path[0].size() == 0) {
-                    toAddMap.set(i);
-                    continue;
+    if (path.size() == 1 && path[0].size() == 0)
+        return true;
+    if (files.isNameShorterThan(i, path[0].size()))
+        return false;
+
+    auto& nameTable = searchSettings.isCaseSensitive ? fileList.nameTable : fileList.lowerNameTable;
+    auto fileName = nameViewAt(nameTable, files.nameReference(i));
+    if (searchSettings.allowSubstrings) {
+        if (!containsSubstring(fileName, path[0])) {
+            return false;
+        }
+    } else {
+        if (!fileName.starts_with(path[0])) {
+            return false;
+        }
+    }
+
+    if (path.size() >= 2) {
+        auto index = files.parentIndex(i);
+        while (true) {
+            bool isInDir = false;
+            while (true) {
+                if (nameViewAt(nameTable, files.nameReference(index)) == path[1]) {
+                    isInDir = true;
+                    break;
                 }
+                if (index == files.parentIndex(index))
+                    break;
+                index = files.parentIndex(index);
+            }
+            if (!isInDir)
+                return false;
 
-                const char* fileName = file.getName(searchSettings.isCaseSensitive ? fileList.nameTable : fileList.lowerNameTable);
-                if (searchSettings.allowSubstrings) {
-                    if (!strstr(fileName, path[0].c_str())) {
-                        continue;
-                    }
-                } else {
-                    if (strncmp(fileName, path[0].c_str(), path[0].size())) {
-                        continue;
-                    }
+            bool pathMatches = true;
+            for (int i = 2; i < path.size(); ++i) {
+                index = files.parentIndex(index);
+                if (nameViewAt(nameTable, files.nameReference(index)) != path[i]) {
+                    pathMatches = false;
+                    break;
                 }
+            }
+            if (pathMatches)
+                break;
+        }
+    }
+    return true;
+}
 
-                if (path.size() >= 2) {
-                    auto index = file.parentIndex;
-                    while (true) {
-                        bool isInDir = false;
-                        while (true) {
-                            if (compareStrToDir(files[index].getName(searchSettings.isCaseSensitive ? fileList.nameTable : fileList.lowerNameTable), path[1])) {
-                                isInDir = true;
-                                break;
-                            }
-                            if (index == files[index].parentIndex)
-                                break;
-                            index = files[index].parentIndex;
-                        }
-                        if (!isInDir)
-                            goto ContinueMainLoop;
-
-                        bool pathMatches = true;
-                        for (int i = 2; i < path.size(); ++i) {
-                            index = files[index].parentIndex;
-                            if (strcmp(files[index].getName(searchSettings.isCaseSensitive ? fileList.nameTable : fileList.lowerNameTable), path[i].c_str())) {
-                                pathMatches = false;
-                                break;
-                            }
-                        }
-                        if (pathMatches)
-                            break;
-                    }
+// Chunks are queued in reverse when reverseChunkOrder is set, so that the ones shown first are done first.
+// onChunkDone is called from worker threads after each chunk that wasn't cancelled. With onlyIds only those files are
+// tested, and knownMatches are taken as matches without testing them (see SegmentMatchCache)
+static void markMatchingFiles(std::vector<RoaringBitmap::Container>& chunks, FileList& fileList, const std::string& str, const SearchSettings& searchSettings, ThreadPool& threadPool, std::atomic<bool>& cancelSearch,
+    bool reverseChunkOrder = false, const std::function<void(int)>& onChunkDone = {}, const RoaringBitmap* onlyIds = nullptr, const RoaringBitmap* knownMatches = nullptr
+) {
+    auto& files = fileList.files;
+    auto path = searchPath(str, searchSettings);
+
+    auto fileCount = uint32_t(files.size());
+    int chunkCount = int((uint64_t(fileCount) + SearchChunkSize - 1) / SearchChunkSize);
+    chunks.clear();
+    chunks.resize(chunkCount);
+    threadPool.addTasks(chunkCount, [chunkCount, fileCount, reverseChunkOrder, onlyIds, knownMatches, &path, &cancelSearch, &searchSettings, &fileList, &chunks, &onChunkDone](int c) {
+        int chunk = reverseChunkOrder ? chunkCount - 1 - c : c;
+        auto key = uint16_t(chunk);
+        uint64_t words[RoaringBitmap::BitmapWordCount];
+        if (auto known = knownMatches ? knownMatches->find(key) : nullptr)
+            known->writeWords(words);
+        else
+            memset(words, 0, sizeof(words));
+        auto startIndex = uint32_t(chunk) * SearchChunkSize;
+        auto endIndex = uint32_t(std::min<uint64_t>(uint64_t(startIndex) + SearchChunkSize, fileCount));
+        bool isCancelled = withFilesView(fileList, [&](const auto& files) {
+            auto test = [&](uint32_t i) {
+                if (fileMatches(i, path, searchSettings, files, fileList))
+                    words[(i - startIndex) / 64] |= uint64_t(1) << (i % 64);
+            };
+            if (onlyIds) {
+                bool isCancelled = false;
+                if (auto candidates = onlyIds->find(key)) {
+                    candidates->forEach([&](uint16_t low) {
+                        if (!isCancelled && !(isCancelled = cancelSearch))
+                            test(startIndex + low);
+                    });
                 }
-                toAddMap.set(i);
-            ContinueMainLoop: (void)0;
+                return isCancelled;
             }
+            for (auto i = startIndex; i < endIndex; ++i) {
+                if (cancelSearch)
+                    return true;
+                if (!((words[(i - startIndex) / 64] >> (i % 64)) & 1))
+                    test(i);
+            }
+            return false;
         });
-    }
+        if (isCancelled)
+            return;
+        chunks[chunk] = RoaringBitmap::fromWords(key, words);
+        if (onChunkDone)
+            onChunkDone(chunk);
+    });
     threadPool.wait();
+}
 
-    if (searchSettings.reverseIndex) {
-        for (int i = int(files.size() - 1); i >= 0; --i) {
-            if (cancelSearch)
-                return;
-            auto index = sortIndex[i];
-            if (toAddMap.test(index)) {
-                results.indexes[results.count++] = index;
+// Directories of the list as a set, to apply SearchSettings::includeFiles and includeDirs to cached matches
+static RoaringBitmap directoriesOf(const FileList& fileList, ThreadPool& threadPool) {
+    auto fileCount = uint32_t(fileList.files.size());
+    int chunkCount = int((uint64_t(fileCount) + SearchChunkSize - 1) / SearchChunkSize);
+    std::vector<RoaringBitmap::Container> chunks(chunkCount);
+    threadPool.addTasks(chunkCount, [fileCount, &fileList, &chunks](int chunk) {
+        uint64_t words[RoaringBitmap::BitmapWordCount] = {};
+        auto startIndex = uint32_t(chunk) * SearchChunkSize;
+        auto endIndex = uint32_t(std::min<uint64_t>(uint64_t(startIndex) + SearchChunkSize, fileCount));
+        withFilesView(fileList, [&](const auto& files) {
+            for (auto i = startIndex; i < endIndex; ++i)
+                words[(i - startIndex) / 64] |= uint64_t(files.isDir(i)) << (i % 64);
+        });
+        chunks[chunk] = RoaringBitmap::fromWords(uint16_t(chunk), words);
+    });
+    threadPool.wait();
+    return RoaringBitmap(std::move(chunks));
+}
+
+static RoaringBitmap withFileTypes(const RoaringBitmap& matches, const RoaringBitmap& directories, const SearchSettings& searchSettings) {
+    if (searchSettings.includeFiles && searchSettings.includeDirs)
+        return matches;
+    if (searchSettings.includeDirs)
+        return matches & directories;
+    if (searchSettings.includeFiles)
+        return matches - directories;
+    return RoaringBitmap();
+}
+
+// Same for the matches of one chunk, while the search still runs
+static RoaringBitmap::Container withFileTypes(const RoaringBitmap::Container& matches, const RoaringBitmap& directories, const SearchSettings& searchSettings) {
+    auto chunkDirectories = directories.find(matches.key);
+    RoaringBitmap::Container none;
+    none.key = matches.key;
+    if (searchSettings.includeFiles && searchSettings.includeDirs)
+        return matches;
+    if (searchSettings.includeDirs)
+        return chunkDirectories ? RoaringBitmap::combine(matches, *chunkDirectories, RoaringBitmap::Operation::And) : none;
+    if (searchSettings.includeFiles)
+        return chunkDirectories ? RoaringBitmap::combine(matches, *chunkDirectories, RoaringBitmap::Operation::AndNot) : matches;
+    return none;
+}
+
+static const MappedArray<std::vector<uint32_t>>* sortIndexOf(FileListExtension& fileListExt, SearchSettings::Index index) {
+    switch (index) {
+    case SearchSettings::Index::Direct: return nullptr;
+    case SearchSettings::Index::Name: return &fileListExt.nameSortIndex;
+    case SearchSettings::Index::Size: return &fileListExt.sizeSortIndex;
+    case SearchSettings::Index::Date: return &fileListExt.dateSortIndex;
+    case SearchSettings::Index::Path: return &fileListExt.pathSortIndex;
+    case SearchSettings::Index::Extension: return &fileListExt.extensionSortIndex;
+    }
+    return nullptr;
+}
+
+static const MappedArray<std::vector<uint32_t>>* ranksOf(const FileListExtension& fileListExt, SearchSettings::Index index) {
+    switch (index) {
+    case SearchSettings::Index::Name: return &fileListExt.nameRanks;
+    case SearchSettings::Index::Path: return &fileListExt.pathRanks;
+    case SearchSettings::Index::Extension: return &fileListExt.extensionRanks;
+    default: return nullptr;
+    }
+}
+
+// Key with the same order as the column (ascending)
+template<typename FilesView> static uint32_t sortKeyInView(const FilesView& files, const FileListExtension& fileListExt, SearchSettings::Index index, uint32_t id) {
+    switch (index) {
+    case SearchSettings::Index::Direct: return id;
+    case SearchSettings::Index::Name: return fileListExt.nameRanks[id];
+    case SearchSettings::Index::Size: return orderedSizeKey(files.size(id));
+    case SearchSettings::Index::Date: return files.lastModificationDateInMinutes(id);
+    case SearchSettings::Index::Path: return fileListExt.pathRanks[id];
+    case SearchSettings::Index::Extension: return fileListExt.extensionRanks[id];
+    }
+    return id;
+}
+
+static uint32_t sortKey(const FileList& fileList, const FileListExtension& fileListExt, SearchSettings::Index index, uint32_t id) {
+    return sortKeyInView(FileRecordsView{ fileList.files.data() }, fileListExt, index, id);
+}
+
+// Sorts ids by keys, first key being the most significant. Files equal on all keys stay in the input order.
+// Each pass packs (key, id) into 64 bits and radix sorts it by the key, going from the least significant key
+static void sortByKeys(uint32_t* ids, size_t count, const SearchSettings::SortKey* keys, int keyCount, const FileList& fileList, const FileListExtension& fileListExt, std::vector<uint64_t>& buffer) {
+    if (count < 2 || keyCount == 0)
+        return;
+    buffer.resize(count * 2);
+    auto pairs = buffer.data();
+    auto tmp = buffer.data() + count;
+    for (size_t i = 0; i < count; ++i)
+        pairs[i] = ids[i];
+    for (int k = keyCount - 1; k >= 0; --k) {
+        withFilesView(fileList, [&](const auto& files) {
+            for (size_t i = 0; i < count; ++i) {
+                auto id = uint32_t(pairs[i]);
+                auto key = sortKeyInView(files, fileListExt, keys[k].index, id);
+                if (!keys[k].reverse) // indexes are descending by default
+                    key = ~key;
+                pairs[i] = (uint64_t(key) << 32) | id;
             }
+        });
+        radixSort(pairs, tmp, count, 4, 7);
+    }
+    for (size_t i = 0; i < count; ++i)
+        ids[i] = uint32_t(pairs[i]);
+}
+
+static bool hasSortKeys(const FileListExtension& fileListExt, SearchSettings::Index index, size_t fileCount) {
+    auto ranks = ranksOf(fileListExt, index);
+    return !ranks || ranks->size() == fileCount;
+}
+
+// Root first, file itself last
+static void ancestorChain(const FileList& fileList, uint32_t id, std::vector<uint32_t>& chain) {
+    chain.clear();
+    chain.push_back(id);
+    while (fileList.files[id].parentIndex != id && chain.size() <= fileList.files.size()) {
+        id = fileList.files[id].parentIndex;
+        chain.push_back(id);
+    }
+    std::reverse(chain.begin(), chain.end());
+}
+
+// Compares files on a column in ascending order. Uses ranks when they are created, otherwise compares the same strings
+// the indexes are built from, so results can be sorted before refreshIndexesAsync is done
+static int compareOnColumn(const FileList& fileList, const FileListExtension& fileListExt, SearchSettings::Index index, uint32_t a, uint32_t b) {
+    auto& files = fileList.files;
+    if (hasSortKeys(fileListExt, index, files.size())) {
+        auto keyA = sortKey(fileList, fileListExt, index, a);
+        auto keyB = sortKey(fileList, fileListExt, index, b);
+        return keyA < keyB ? -1 : keyA > keyB;
+    }
+    auto lowerName = [&](uint32_t id) { return files[id].getName(fileList.lowerNameTable); };
+    switch (index) {
+    case SearchSettings::Index::Name:
+        return lowerName(a).compare(lowerName(b));
+    case SearchSettings::Index::Extension: {
+        auto extensionA = files[a].isDir() ? std::string_view() : fileNameExtension(lowerName(a));
+        auto extensionB = files[b].isDir() ? std::string_view() : fileNameExtension(lowerName(b));
+        return extensionA.compare(extensionB);
+    }
+    case SearchSettings::Index::Path: {
+        // same order as the pre-order walk of createPathSortIndex: siblings by lowercase name, then by id
+        thread_local std::vector<uint32_t> chainA, chainB;
+        ancestorChain(fileList, a, chainA);
+        ancestorChain(fileList, b, chainB);
+        for (size_t i = 0; i < std::min(chainA.size(), chainB.size()); ++i) {
+            if (chainA[i] == chainB[i])
+                continue;
+            auto cmp = lowerName(chainA[i]).compare(lowerName(chainB[i]));
+            if (cmp != 0)
+                return cmp;
+            return chainA[i] < chainB[i] ? -1 : 1;
         }
-    } else {
-        for (int i = 0; i < files.size(); ++i) {
+        return chainA.size() < chainB.size() ? -1 : chainA.size() > chainB.size();
+    }
+    default:
+        return 0;
+    }
+}
+
+// Sorts ids by keys, first key being the most significant, files equal on all keys ordered by id.
+// Ids must be in ascending order. Radix sorts packed keys when all of them are available, otherwise compares files
+static void sortMatches(uint32_t* ids, size_t count, const SearchSettings::SortKey* keys, int keyCount, const FileList& fileList, const FileListExtension& fileListExt, std::vector<uint64_t>& buffer) {
+    bool allKeysAvailable = true;
+    for (int i = 0; i < keyCount; ++i)
+        allKeysAvailable &= hasSortKeys(fileListExt, keys[i].index, fileList.files.size());
+    if (allKeysAvailable) {
+        sortByKeys(ids, count, keys, keyCount, fileList, fileListExt, buffer);
+        return;
+    }
+    parallelSort(ids, ids + count, [&](uint32_t a, uint32_t b) {
+        for (int i = 0; i < keyCount; ++i) {
+            auto cmp = compareOnColumn(fileList, fileListExt, keys[i].index, a, b);
+            if (cmp != 0)
+                return keys[i].reverse ? cmp < 0 : cmp > 0; // indexes are descending by default
+        }
+        return a < b;
+    });
+}
+
+// Ids are in the order of the first key's index. Runs equal on it are sorted by id and the remaining keys
+static void sortEqualKeyRuns(uint32_t* ids, int count, const SearchSettings::SortKey* keys, int keyCount, const FileList& fileList, const FileListExtension& fileListExt, std::vector<uint64_t>& buffer) {
+    int runStart = 0;
+    for (int i = 1; i <= count; ++i) {
+        if (i < count && sortKey(fileList, fileListExt, keys[0].index, ids[i]) == sortKey(fileList, fileListExt, keys[0].index, ids[runStart]))
+            continue;
+        if (i - runStart > 1) {
+            std::sort(ids + runStart, ids + i);
+            sortMatches(ids + runStart, i - runStart, keys + 1, keyCount - 1, fileList, fileListExt, buffer);
+        }
+        runStart = i;
+    }
+}
+
+// Finds the first results in their final order by testing files one by one in the order of the index.
+// Gives up after scanning one chunk worth of files, which happens for queries with few matches
+static std::vector<uint32_t> findFirstPageInIndexOrder(FileList& fileList, FileListExtension& fileListExt, std::span<const uint32_t> sortIndex, const SearchSettings::SortKey* keys, int keyCount,
+    bool needsRunSorting, const std::string& str, const SearchSettings& searchSettings, std::atomic<bool>& cancelSearch
+) {
+    constexpr int FirstPageResultCount = 128;
+    auto path = searchPath(str, searchSettings);
+    auto fileCount = sortIndex.size();
+    std::vector<uint32_t> page;
+    FileRecordsView files{ fileList.files.data() }; // files are visited in index order, so records bring in everything at once
+    for (size_t i = 0; i < std::min<size_t>(fileCount, SearchChunkSize); ++i) {
+        if (i % 1024 == 0 && cancelSearch)
+            return {};
+        auto id = sortIndex[keys[0].reverse ? fileCount - 1 - i : i];
+        if (!fileMatches(id, path, searchSettings, files, fileList))
+            continue;
+        // with run sorting the last run must be complete, otherwise its order could still change
+        if (page.size() >= FirstPageResultCount && (!needsRunSorting || sortKey(fileList, fileListExt, keys[0].index, id) != sortKey(fileList, fileListExt, keys[0].index, page.back()))) {
+            if (needsRunSorting) {
+                std::vector<uint64_t> buffer;
+                sortEqualKeyRuns(page.data(), int(page.size()), keys, keyCount, fileList, fileListExt, buffer);
+            }
+            return page;
+        }
+        page.push_back(id);
+    }
+    return {};
+}
+
+// Row of an index walk that starts a run of files equal on the first key, so a walk can start from it
+struct IndexWalkCheckpoint {
+    int row = 0;
+    size_t indexPosition = 0;
+};
+
+/*
+    Matches of a search in one segment and how they are ordered. The matches are kept as a compressed set, and ids in
+    the shown order are listed only for rows that are asked for (see materialize). Small match sets are sorted
+    by the search, for bigger ones the sort index of the first key is walked from the closest checkpoint
+*/
+struct SegmentSearchResults {
+    enum class Order {
+        Id, // any row is selected from matches directly
+        Sorted, // sortedIds hold all matches, sorted by the search
+        IndexWalk // ids hold the rows listed by the last walk of the sort index
+    };
+    static constexpr int MaterializedPageSize = 256;
+    static constexpr int CheckpointInterval = 4096; // rows between checkpoints of index walks, when runs aren't longer
+
+    std::shared_ptr<const RoaringBitmap> matches = std::make_shared<const RoaringBitmap>();
+    int count = 0;
+    Order order = Order::Id;
+    std::array<SearchSettings::SortKey, SearchSettings::MaxSortKeys> keys;
+    int keyCount = 1;
+    std::shared_ptr<const std::vector<uint32_t>> sortedIds;
+    int firstRow = 0; // row of ids[0]
+    std::vector<uint32_t> ids;
+    size_t indexPosition = 0; // position in the sort index after the last listed row
+    std::vector<IndexWalkCheckpoint> checkpoints = { IndexWalkCheckpoint() };
+    uint64_t indexesGeneration = 0; // FileListExtension::indexesGeneration the walk started with
+
+    bool isMaterialized(int from, int to) const {
+        to = std::min(to, count);
+        return order != Order::IndexWalk || from >= to || (from >= firstRow && to <= firstRow + int(ids.size()));
+    }
+    // Lists rows [from, to) and the rest of the last run in place of the rows listed before, unless sort indexes
+    // were replaced since the search. Caller must hold a shared lock on indexesMutex of fileListExt
+    void materialize(int from, int to, const FileList& fileList, FileListExtension& fileListExt) {
+        from = std::max(from, 0);
+        to = std::min(to, count);
+        if (isMaterialized(from, to) || fileListExt.indexesGeneration != indexesGeneration)
+            return;
+        // the walk goes on after the listed rows when they overlap the new ones or are closer than any checkpoint
+        auto listedEnd = firstRow + int(ids.size());
+        auto start = *(std::upper_bound(checkpoints.begin(), checkpoints.end(), from, [](int row, const IndexWalkCheckpoint& checkpoint) { return row < checkpoint.row; }) - 1);
+        int row = start.row;
+        auto position = start.indexPosition;
+        if (from >= firstRow && listedEnd >= start.row) {
+            ids.erase(ids.begin(), ids.begin() + std::min(from - firstRow, int(ids.size())));
+            row = listedEnd;
+            position = indexPosition;
+        } else {
+            ids.clear();
+        }
+        firstRow = from;
+
+        auto& sortIndex = *sortIndexOf(fileListExt, keys[0].index);
+        auto fileCount = sortIndex.size();
+        // walking the index in reverse gives equal files in descending id order, so they are re-sorted like with multiple columns
+        bool needsRunSorting = keyCount > 1 || keys[0].reverse;
+        std::vector<uint32_t> run;
+        std::vector<uint64_t> buffer;
+        auto addRun = [&]() {
+            if (needsRunSorting && run.size() > 1) {
+                std::sort(run.begin(), run.end());
+                sortMatches(run.data(), run.size(), keys.data() + 1, keyCount - 1, fileList, fileListExt, buffer);
+            }
+            for (auto id : run) {
+                if (row++ >= from)
+                    ids.push_back(id);
+            }
+            run.clear();
+        };
+        for (; position < fileCount; ++position) {
+            auto id = sortIndex[keys[0].reverse ? fileCount - 1 - position : position];
+            if (!matches->contains(id))
+                continue;
+            // with run sorting the last run must be complete, otherwise its order could still change
+            if (!run.empty() && (!needsRunSorting || sortKey(fileList, fileListExt, keys[0].index, id) != sortKey(fileList, fileListExt, keys[0].index, run.back()))) {
+                addRun();
+                if (row >= to)
+                    break;
+                if (row >= checkpoints.back().row + CheckpointInterval)
+                    checkpoints.push_back({ row, position });
+            }
+            run.push_back(id);
+        }
+        addRun();
+        indexPosition = position;
+    }
+    // Row must be materialized
+    uint32_t id(int row) const {
+        if (order == Order::Id)
+            return matches->select(keys[0].reverse ? count - 1 - row : row);
+        if (order == Order::Sorted)
+            return (*sortedIds)[row];
+        return ids[row - firstRow];
+    }
+    size_t sizeInBytes() const {
+        return sizeof(SegmentSearchResults) + matches->sizeInBytes() + (sortedIds ? sortedIds->capacity() * sizeof(uint32_t) : 0)
+            + ids.capacity() * sizeof(uint32_t) + checkpoints.capacity() * sizeof(IndexWalkCheckpoint);
+    }
+};
+
+/*
+    Matches of the previous query in one segment, whatever the file types, which the next search starts from:
+    when the query is the same nothing is scanned, when it narrows the previous one (a longer substring or prefix
+    of a single name) only previous matches are tested, and when it widens it previous matches are taken without
+    testing. File types are then applied with set operations on the directories of the segment
+*/
+struct SegmentMatchCache {
+    std::vector<std::string> path; // of the query, see searchPath
+    bool isCaseSensitive = false;
+    bool allowSubstrings = true;
+    std::shared_ptr<const RoaringBitmap> matches; // nullptr until a search is complete
+    std::shared_ptr<const RoaringBitmap> directories; // created when a search first needs it
+};
+
+// Caches of all segments, dropped when any segment changes
+struct SearchMatchCache {
+    uint64_t generation = ~uint64_t(0); // FileListSegments::generation they were made for
+    std::vector<SegmentMatchCache> segments;
+};
+
+// True when every name matching query also matches previous
+static bool narrowsQuery(std::string_view query, std::string_view previous, bool allowSubstrings) {
+    return allowSubstrings ? query.find(previous) != std::string_view::npos : query.starts_with(previous);
+}
+
+/*
+    Chooses how to order the matches. Small match sets are collected and sorted directly, which doesn't need
+    the global sort indexes at all. Big ones are listed in the order of the first column's index as they are shown,
+    and only runs of files equal on the first column are sorted by the remaining ones.
+    In all cases files equal on all columns are ordered by id, so the order doesn't change between keystrokes
+*/
+static void findFilesWithString(SegmentSearchResults& results, FileList& fileList, FileListExtension& fileListExt, const std::string& str, SearchSettings searchSettings, ThreadPool& threadPool, std::atomic<bool>& cancelSearch,
+    const PublishPartialResults& publishPartialResults = {}, SegmentMatchCache* cache = nullptr
+) {
+    constexpr int SortMatchesDirectlyFactor = 8; // sorting is used when there are that many times less matches than files
+    auto& files = fileList.files;
+    results = SegmentSearchResults();
+    auto& keys = results.keys;
+    keys[0] = { searchSettings.index, searchSettings.reverseIndex };
+    for (int i = 0; i < searchSettings.thenByCount; ++i)
+        keys[results.keyCount++] = searchSettings.thenBy[i];
+
+    // with a cache files are scanned for the query alone and file types are applied to the matches afterwards
+    auto scanSettings = searchSettings;
+    auto path = searchPath(str, searchSettings);
+    std::shared_ptr<const RoaringBitmap> queryMatches;
+    const RoaringBitmap* onlyIds = nullptr;
+    const RoaringBitmap* knownMatches = nullptr;
+    bool filtersFileTypes = cache && (!searchSettings.includeFiles || !searchSettings.includeDirs);
+    if (cache) {
+        scanSettings.includeFiles = true;
+        scanSettings.includeDirs = true;
+        if (cache->matches && cache->isCaseSensitive == searchSettings.isCaseSensitive && cache->allowSubstrings == searchSettings.allowSubstrings) {
+            if (cache->path == path) {
+                queryMatches = cache->matches;
+            } else if (path.size() == 1 && cache->path.size() == 1) {
+                if (narrowsQuery(path[0], cache->path[0], searchSettings.allowSubstrings))
+                    onlyIds = cache->matches.get();
+                else if (narrowsQuery(cache->path[0], path[0], searchSettings.allowSubstrings))
+                    knownMatches = cache->matches.get();
+            }
+        }
+        if (filtersFileTypes && !cache->directories) {
+            auto directories = std::make_shared<const RoaringBitmap>(directoriesOf(fileList, threadPool));
+            // a new request drops queued chunks, so the set is complete only if the search wasn't cancelled
             if (cancelSearch)
                 return;
-            auto index = sortIndex[i];
-            if (toAddMap.test(index)) {
-                results.indexes[results.count++] = index;
+            cache->directories = std::move(directories);
+        }
+    }
+
+    bool isDirect = keys[0].index == SearchSettings::Index::Direct;
+    auto primaryIndex = sortIndexOf(fileListExt, keys[0].index);
+    bool needsRunSorting = results.keyCount > 1 || keys[0].reverse;
+    bool canUseIndex = !isDirect && primaryIndex->size() == files.size() && (!needsRunSorting || hasSortKeys(fileListExt, keys[0].index, files.size()));
+    std::vector<RoaringBitmap::Container> chunks;
+    if (!queryMatches && isDirect) {
+        // chunks are published in the shown order once all chunks before them are done
+        constexpr double PublishInterval = 0.02;
+        int chunkCount = int((files.size() + SearchChunkSize - 1) / SearchChunkSize);
+        std::mutex publishMutex;
+        std::vector<char> isChunkDone(chunkCount, false);
+        int publishedChunkCount = 0;
+        int publishedCount = 0;
+        double lastPublishTime = -1;
+        auto timer = Timer();
+        std::vector<uint32_t> ids;
+        auto publishDoneChunks = [&](int chunk) {
+            std::lock_guard lp{ publishMutex };
+            isChunkDone[chunk] = true;
+            if (lastPublishTime >= 0 && timer.getTime() - lastPublishTime < PublishInterval)
+                return;
+            for (; publishedChunkCount < chunkCount; ++publishedChunkCount) {
+                int shownChunk = keys[0].reverse ? chunkCount - 1 - publishedChunkCount : publishedChunkCount;
+                if (!isChunkDone[shownChunk])
+                    break;
+                auto high = uint32_t(shownChunk) << 16;
+                ids.clear();
+                auto addIds = [&](const RoaringBitmap::Container& matches) { matches.forEach([&](uint16_t low) { ids.push_back(high | low); }); };
+                if (filtersFileTypes)
+                    addIds(withFileTypes(chunks[shownChunk], *cache->directories, searchSettings));
+                else
+                    addIds(chunks[shownChunk]);
+                if (ids.empty())
+                    continue;
+                if (keys[0].reverse)
+                    std::reverse(ids.begin(), ids.end());
+                publishPartialResults(ids.data(), publishedCount, int(ids.size()));
+                publishedCount += int(ids.size());
+                lastPublishTime = timer.getTime();
             }
+        };
+        markMatchingFiles(chunks, fileList, str, scanSettings, threadPool, cancelSearch, keys[0].reverse, publishPartialResults ? std::function<void(int)>(publishDoneChunks) : nullptr, onlyIds, knownMatches);
+    } else if (!queryMatches) {
+        if (publishPartialResults && canUseIndex && !onlyIds) {
+            auto page = findFirstPageInIndexOrder(fileList, fileListExt, *primaryIndex, keys.data(), results.keyCount, needsRunSorting, str, searchSettings, cancelSearch);
+            if (!page.empty())
+                publishPartialResults(page.data(), 0, int(page.size()));
         }
+        markMatchingFiles(chunks, fileList, str, scanSettings, threadPool, cancelSearch, false, {}, onlyIds, knownMatches);
     }
+    if (cancelSearch)
+        return;
+    if (!queryMatches) {
+        queryMatches = std::make_shared<const RoaringBitmap>(std::move(chunks));
+        if (cache) {
+            cache->path = path;
+            cache->isCaseSensitive = searchSettings.isCaseSensitive;
+            cache->allowSubstrings = searchSettings.allowSubstrings;
+            cache->matches = queryMatches;
+        }
+    }
+    results.matches = filtersFileTypes ? std::make_shared<const RoaringBitmap>(withFileTypes(*queryMatches, *cache->directories, searchSettings)) : queryMatches;
+    results.count = int(results.matches->count());
+    if (isDirect)
+        return;
+
+    if (size_t(results.count) * SortMatchesDirectlyFactor < files.size() || !canUseIndex) {
+        results.order = SegmentSearchResults::Order::Sorted;
+        auto sortedIds = std::make_shared<std::vector<uint32_t>>();
+        sortedIds->reserve(results.count);
+        results.matches->forEach([&](uint32_t id) { sortedIds->push_back(id); });
+        std::vector<uint64_t> buffer;
+        sortMatches(sortedIds->data(), sortedIds->size(), keys.data(), results.keyCount, fileList, fileListExt, buffer);
+        results.sortedIds = std::move(sortedIds);
+        return;
+    }
+    results.order = SegmentSearchResults::Order::IndexWalk;
+    results.indexesGeneration = fileListExt.indexesGeneration;
+    // the first page is listed here, so the table doesn't wait for it
+    results.materialize(0, SegmentSearchResults::MaterializedPageSize, fileList, fileListExt);
 }
 
-static void searchThread(FileList& fileList, FileListExtension& fileListExt, FileListSearchResults& shownResults, 
-    char (&searchFileName)[512], SearchSettings& searchSettings, std::atomic<double>& searchTime, 
-    std::atomic<bool>& shouldRunSearch, std::mutex& searchNotifyMutex, std::condition_variable& searchNotifyCondVar
-) {
-    std::atomic<bool> cancelSearch = false;
-    std::thread fileSearchTask;
-    ThreadPool threadPool(32);
-    while (true) {
-        std::unique_lock l{ searchNotifyMutex };
-        searchNotifyCondVar.wait(l, [&shouldRunSearch] { return bool(shouldRunSearch); });
-        shouldRunSearch = false;
-        l.unlock();
+// Key of a file that orders it among files of other segments on a column (ascending), consistently with compareOnColumn
+// within a segment. Paths of different volumes already differ in the root, so they are ordered by the root names
+struct SegmentSortKey {
+    std::string_view text;
+    uint64_t number = 0; // only one of them is set, depending on the column
 
-        cancelSearch = true;
-        if (fileSearchTask.joinable())
-            fileSearchTask.join();
+    int compare(const SegmentSortKey& other) const {
+        if (number != other.number)
+            return number < other.number ? -1 : 1;
+        return text.compare(other.text);
+    }
+};
 
-        cancelSearch = false;
-        static FileListSearchResults workShownResults;
+static SegmentSortKey segmentSortKey(const FileListSegments& segments, int segment, uint32_t id, SearchSettings::Index index) {
+    auto& fileList = segments.segments[segment]->fileList;
+    auto& file = fileList.files[id];
+    auto lowerName = [&](uint32_t id) { return fileList.files[id].getName(fileList.lowerNameTable); };
+    switch (index) {
+    case SearchSettings::Index::Direct: return { {}, uint64_t(segment) };
+    case SearchSettings::Index::Name: return { lowerName(id) };
+    case SearchSettings::Index::Size: return { {}, orderedSizeKey(file.size) };
+    case SearchSettings::Index::Date: return { {}, file.lastModificationDateInMinutes };
+    case SearchSettings::Index::Path: return { lowerName(0) };
+    case SearchSettings::Index::Extension: return { file.isDir() ? std::string_view() : fileNameExtension(lowerName(id)) };
+    }
+    return {};
+}
+
+static int compareAcrossSegments(const FileListSegments& segments, int segmentA, uint32_t a, int segmentB, uint32_t b, SearchSettings::Index index) {
+    return segmentSortKey(segments, segmentA, a, index).compare(segmentSortKey(segments, segmentB, b, index));
+}
+
+// Row of a merge of segments and the rows of each segment merged before it, so a merge can start from it
+struct MergeCheckpoint {
+    int row = 0;
+    std::vector<int> positions;
+};
+
+/*
+    Results shown in the table. While the search runs, ids hold the first results published so far. Complete results
+    keep the results of every segment, and rows are listed only where the table shows them: in direct order
+    any row is selected from the matches of its segment (global ids are already sorted by segment), otherwise rows
+    of the segments are k-way merged from the closest checkpoint, files equal on all keys ordered by global id like within a segment
+*/
+struct FileListSearchResults {
+    uint64_t searchNumber = 0; // tells complete results of different searches apart
+    int count = 0;
+    bool isComplete = true; // false while the search is still running and only first results are shown
+    std::vector<SegmentSearchResults> segmentResults; // empty until the search is complete
+    int firstRow = 0; // row of ids[0]
+    std::vector<uint32_t> ids; // global ids of the listed rows
+    std::vector<int> mergePositions; // rows of each segment merged before the end of the listed rows
+    std::vector<MergeCheckpoint> mergeCheckpoints;
+
+    void clear() {
+        *this = FileListSearchResults();
+    }
+
+    bool isMaterialized(int from, int to) const {
+        to = std::min(to, count);
+        if (from >= to)
+            return true;
+        if (segmentResults.size() == 1)
+            return segmentResults[0].isMaterialized(from, to);
+        if (!segmentResults.empty() && segmentResults[0].keys[0].index == SearchSettings::Index::Direct)
+            return true;
+        return from >= firstRow && to <= firstRow + int(ids.size());
+    }
+    // Lists rows [from, to) in place of the rows listed before, unless sort indexes were replaced since the search.
+    // It can take long for rows far from the listed ones, see SearchResultsLister.
+    // Caller must hold shared locks on mutex of segments and indexesMutex of every segment
+    void materialize(FileListSegments& segments, int from, int to) {
+        from = std::max(from, 0);
+        to = std::min(to, count);
+        if (isMaterialized(from, to))
+            return;
+        auto& list = segments.segments;
+        if (segmentResults.size() == 1)
+            segmentResults[0].materialize(from, to, list[0]->fileList, list[0]->fileListExt);
+        else if (!segmentResults.empty())
+            mergeRows(segments, from, to);
+    }
 
-        fileSearchTask = std::thread([&]() {
-            std::shared_lock lg{ fileListExt.globalMutex };
-            std::shared_lock li{ fileListExt.indexesMutex };
-            if (workShownResults.indexes.size() != shownResults.indexes.size()) {
-                workShownResults.indexes.resize(shownResults.indexes.size());
+    // Row must be materialized
+    uint32_t id(const FileListSegments& segments, int row) const {
+        if (segmentResults.size() == 1)
+            return segments.firstIds[0] + segmentResults[0].id(row);
+        if (!segmentResults.empty() && segmentResults[0].keys[0].index == SearchSettings::Index::Direct) {
+            int segmentCount = int(segmentResults.size());
+            for (int i = 0; i < segmentCount; ++i) {
+                int segment = segmentResults[0].keys[0].reverse ? segmentCount - 1 - i : i;
+                if (row < segmentResults[segment].count)
+                    return segments.firstIds[segment] + segmentResults[segment].id(row);
+                row -= segmentResults[segment].count;
             }
-            workShownResults.count = 0;
-            auto timer = Timer();
-            std::vector<uint32_t>* sortIndex = nullptr;
-            switch (searchSettings.index) {
-            case SearchSettings::Index::Direct: sortIndex = nullptr; break;
-            case SearchSettings::Index::Name: sortIndex = &fileListExt.nameSortIndex; break;
-            case SearchSettings::Index::Size: sortIndex = &fileListExt.sizeSortIndex; break;
-            case SearchSettings::Index::Date: sortIndex = &fileListExt.dateSortIndex; break;
+        }
+        return ids[row - firstRow];
+    }
+
+    size_t sizeInBytes() const {
+        size_t result = sizeof(FileListSearchResults) + ids.capacity() * sizeof(uint32_t) + mergePositions.capacity() * sizeof(int);
+        for (auto& checkpoint : mergeCheckpoints)
+            result += sizeof(MergeCheckpoint) + checkpoint.positions.capacity() * sizeof(int);
+        for (auto& results : segmentResults)
+            result += results.sizeInBytes();
+        return result;
+    }
+
+private:
+    void mergeRows(FileListSegments& segments, int from, int to) {
+        int segmentCount = int(segmentResults.size());
+        auto& keys = segmentResults[0].keys;
+        int keyCount = segmentResults[0].keyCount;
+        if (mergeCheckpoints.empty()) {
+            mergeCheckpoints.push_back({ 0, std::vector<int>(segmentCount, 0) });
+            mergePositions.assign(segmentCount, 0);
+        }
+        // like in SegmentSearchResults::materialize the merge goes on after the listed rows when it's closer
+        auto listedEnd = firstRow + int(ids.size());
+        auto& start = *(std::upper_bound(mergeCheckpoints.begin(), mergeCheckpoints.end(), from, [](int row, const MergeCheckpoint& checkpoint) { return row < checkpoint.row; }) - 1);
+        int row = start.row;
+        if (from >= firstRow && listedEnd >= start.row) {
+            ids.erase(ids.begin(), ids.begin() + std::min(from - firstRow, int(ids.size())));
+            row = listedEnd;
+        } else {
+            ids.clear();
+            mergePositions = start.positions;
+        }
+        firstRow = from;
+
+        auto rowOf = [&](int segment) { return segmentResults[segment].id(mergePositions[segment]); };
+        auto isAfter = [&](int segmentA, int segmentB) { // true when head of segmentB goes before head of segmentA
+            auto a = rowOf(segmentA);
+            auto b = rowOf(segmentB);
+            for (int i = 0; i < keyCount; ++i) {
+                auto cmp = compareAcrossSegments(segments, segmentA, a, segmentB, b, keys[i].index);
+                if (cmp != 0)
+                    return keys[i].reverse ? cmp > 0 : cmp < 0; // indexes are descending by default
             }
-            if (sortIndex == nullptr) {
-                struct DummyDirectIndex {
-                    uint32_t operator[](uint32_t i) const { return i; }
-                } dummyDirectIndex;
-                findFilesWithString(workShownResults, fileList, dummyDirectIndex, std::string(searchFileName), searchSettings, threadPool, cancelSearch);
-            } else if (sortIndex->size() != fileList.files.size()) {
-                return;
-            } else {
-                findFilesWithString(workShownResults, fileList, *sortIndex, std::string(searchFileName), searchSettings, threadPool, cancelSearch);
+            return segmentA > segmentB;
+        };
+        // there are only a few volumes, so the next file is picked by scanning all heads
+        while (row < to) {
+            int best = -1;
+            for (int segment = 0; segment < segmentCount; ++segment) {
+                auto& results = segmentResults[segment];
+                auto position = mergePositions[segment];
+                if (position == results.count)
+                    continue;
+                if (!results.isMaterialized(position, position + 1)) {
+                    auto& segmentList = *segments.segments[segment];
+                    results.materialize(position, position + SegmentSearchResults::MaterializedPageSize, segmentList.fileList, segmentList.fileListExt);
+                    if (!results.isMaterialized(position, position + 1))
+                        return; // the rest can't be merged in order
+                }
+                if (best < 0 || isAfter(best, segment))
+                    best = segment;
             }
-            if (cancelSearch)
+            if (best < 0)
                 return;
-            searchTime = timer.getTime();
-            std::unique_lock ls{ fileListExt.searchResultsMutex };
-            shownResults.indexes.swap(workShownResults.indexes);
-            shownResults.count = workShownResults.count;
+            if (row >= from)
+                ids.push_back(segments.firstIds[best] + rowOf(best));
+            mergePositions[best] += 1;
+            row += 1;
+            if (row >= mergeCheckpoints.back().row + SegmentSearchResults::CheckpointInterval)
+                mergeCheckpoints.push_back({ row, mergePositions });
+        }
+    }
+};
+
+/*
+    Lists rows of the shown results in the background, so scrolling far into big results doesn't walk sort indexes
+    on the UI thread. The task lists rows of a copy of the results, which replaces them at the next frame if they are
+    still the results of the same search. Until then the rows are shown as placeholders
+*/
+class SearchResultsLister {
+    static constexpr int Margin = SegmentSearchResults::MaterializedPageSize; // rows listed around the asked ones
+
+    std::future<FileListSearchResults> task;
+
+public:
+    SearchResultsLister() = default;
+    SearchResultsLister(const SearchResultsLister&) = delete;
+    SearchResultsLister& operator=(const SearchResultsLister&) = delete;
+    ~SearchResultsLister() {
+        if (task.valid())
+            task.wait();
+    }
+
+    // Call once per frame before reading results. Caller must hold a unique lock on searchResultsMutex
+    void beginFrame(FileListSearchResults& results) {
+        if (!task.valid() || task.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        auto listed = task.get();
+        if (results.searchNumber != 0 && listed.searchNumber == results.searchNumber)
+            results = std::move(listed);
+    }
+
+    // Lists rows [from, to) and the rows around them in the background, unless they are listed or the rows of
+    // another task weren't taken by beginFrame yet. Caller must hold a shared lock on mutex of segments and a unique lock on searchResultsMutex
+    void materialize(FileListSegments& segments, const FileListSearchResults& results, int from, int to) {
+        if (results.isMaterialized(std::max(from - Margin / 2, 0), to + Margin / 2) || task.valid())
+            return;
+        task = std::async(std::launch::async, [&segments, results = FileListSearchResults(results), from = std::max(from - Margin, 0), to = to + Margin, generation = segments.generation]() mutable {
+            std::shared_lock lg{ segments.mutex };
+            if (segments.generation != generation)
+                return results;
+            std::vector<std::shared_lock<std::shared_mutex>> indexLocks;
+            for (auto& segment : segments.segments)
+                indexLocks.emplace_back(segment->fileListExt.indexesMutex);
+            results.materialize(segments, from, to);
+            return results;
         });
     }
+};
+
+/*
+    Searches all segments. A single segment is searched directly (with partial results). With more of them every
+    segment is searched in parallel in its own task group, and their results are merged as rows are shown, so the
+    order is over all volumes. With a cache, searches start from the matches of the previous one (see SegmentMatchCache)
+*/
+static void findFilesInSegments(FileListSearchResults& results, FileListSegments& segments, const std::string& str, const SearchSettings& searchSettings, ThreadPool& threadPool, std::atomic<bool>& cancelSearch,
+    const PublishPartialResults& publishPartialResults = {}, SearchMatchCache* cache = nullptr
+) {
+    auto& list = segments.segments;
+    if (cache && (cache->generation != segments.generation || cache->segments.size() != list.size())) {
+        cache->generation = segments.generation;
+        cache->segments.assign(list.size(), SegmentMatchCache());
+    }
+    auto segmentCache = [&](int segment) { return cache ? &cache->segments[segment] : nullptr; };
+    results.clear();
+    results.segmentResults.resize(list.size());
+    if (list.size() == 1) {
+        findFilesWithString(results.segmentResults[0], list[0]->fileList, list[0]->fileListExt, str, searchSettings, threadPool, cancelSearch, publishPartialResults, segmentCache(0));
+    } else {
+        threadPool.addTasks(int(list.size()), [&](int segment) {
+            ThreadPool segmentThreadPool(threadPool.taskPriority());
+            findFilesWithString(results.segmentResults[segment], list[segment]->fileList, list[segment]->fileListExt, str, searchSettings, segmentThreadPool, cancelSearch, {}, segmentCache(segment));
+        });
+        threadPool.wait();
+    }
+    static std::atomic<uint64_t> searchCount = 0;
+    results.searchNumber = ++searchCount;
+    for (auto& segmentResults : results.segmentResults)
+        results.count += segmentResults.count;
+}
+
+/*
+    New search requests from the UI. A request cancels the running search right away and drops its queued chunks.
+    Requests coming quicker than coalesceWindow after the previous one (fast typing) are coalesced: the search
+    starts only after no new request came for that long. A single request starts the search immediately
+*/
+struct SearchRequests {
+    std::mutex mutex;
+    std::condition_variable condVar;
+    bool hasNewRequest = false;
+    bool isCoalescing = false;
+    std::chrono::steady_clock::time_point lastRequestTime;
+    std::chrono::microseconds coalesceWindow{ 0 };
+    std::atomic<bool> cancelSearch = false;
+    ThreadPool* searchThreadPool = nullptr;
+
+    void notify() {
+        {
+            std::lock_guard l{ mutex };
+            auto now = std::chrono::steady_clock::now();
+            isCoalescing = now - lastRequestTime < coalesceWindow;
+            hasNewRequest = true;
+            lastRequestTime = now;
+            cancelSearch = true;
+            if (searchThreadPool)
+                searchThreadPool->clearQueuedTasks();
+        }
+        condVar.notify_all();
+    }
+
+    // Returns time of the request the search is run for
+    std::chrono::steady_clock::time_point waitForRequest() {
+        std::unique_lock l{ mutex };
+        condVar.wait(l, [this] { return hasNewRequest; });
+        while (isCoalescing && std::chrono::steady_clock::now() < lastRequestTime + coalesceWindow)
+            condVar.wait_until(l, lastRequestTime + coalesceWindow);
+        hasNewRequest = false;
+        cancelSearch = false;
+        return lastRequestTime;
+    }
+};
+
+// Only this many first results are shown while the search runs, the rest when it is complete
+constexpr inline int PartialResultsLimit = SearchChunkSize;
+
+static void searchThread(FileListSegments& segments, FileListSearchResults& shownResults, 
+    char (&searchFileName)[512], SearchSettings& searchSettings, std::atomic<double>& searchTime, std::atomic<double>& timeToFirstResults,
+    SearchRequests& searchRequests
+) {
+    auto& cancelSearch = searchRequests.cancelSearch;
+    TaskScheduler::setCurrentThreadTaskPriority(TaskPriority::Interactive);
+    ThreadPool threadPool(TaskPriority::Interactive);
+    {
+        std::lock_guard l{ searchRequests.mutex };
+        searchRequests.searchThreadPool = &threadPool;
+    }
+    SearchMatchCache matchCache;
+    while (true) {
+        auto requestTime = searchRequests.waitForRequest();
+
+        std::shared_lock lg{ segments.mutex };
+        std::vector<std::shared_lock<std::shared_mutex>> indexLocks;
+        for (auto& segment : segments.segments)
+            indexLocks.emplace_back(segment->fileListExt.indexesMutex);
+        FileListSearchResults results;
+        auto timer = Timer();
+        bool publishedAny = false;
+        auto onPublish = [&]() {
+            if (!publishedAny)
+                timeToFirstResults = Timer(requestTime).getTime();
+            publishedAny = true;
+        };
+        auto publishPartialResults = [&](const uint32_t* ids, int offset, int count) {
+            count = std::min(count, PartialResultsLimit - offset);
+            if (cancelSearch || count <= 0)
+                return;
+            std::unique_lock ls{ segments.searchResultsMutex };
+            if (offset == 0)
+                shownResults.clear();
+            shownResults.ids.insert(shownResults.ids.end(), ids, ids + count);
+            shownResults.count = offset + count;
+            shownResults.isComplete = false;
+            onPublish();
+        };
+        findFilesInSegments(results, segments, std::string(searchFileName), searchSettings, threadPool, cancelSearch, publishPartialResults, &matchCache);
+        if (cancelSearch)
+            continue;
+        searchTime = timer.getTime();
+        std::unique_lock ls{ segments.searchResultsMutex };
+        shownResults = std::move(results);
+        onPublish();
+    }
 }
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "commonFileReading.h"
+#include "mappedFile.h"
+#include "utility.h"
+#include "windowsInclude.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+class IndexArena;
+
+// Memory of one array moved into the arena. Released when the last array using it is gone
+class IndexArenaBlock {
+    friend class IndexArena;
+
+    char* data_ = nullptr;
+    uint64_t size_ = 0;
+    bool isLargePages_ = false;
+    std::vector<uint64_t> bytesOnNode;
+
+public:
+    IndexArenaBlock(const IndexArenaBlock&) = delete;
+    IndexArenaBlock& operator=(const IndexArenaBlock&) = delete;
+    IndexArenaBlock(char* data, uint64_t size, bool isLargePages) : data_(data), size_(size), isLargePages_(isLargePages) {}
+    ~IndexArenaBlock();
+
+    char* data() const {
+        return data_;
+    }
+    uint64_t size() const {
+        return size_;
+    }
+    bool isLargePages() const {
+        return isLargePages_;
+    }
+};
+
+/*
+    Memory for the arrays every search scans (files, name tables and sort indexes). With 4 KiB pages a scan over a few
+    hundred MB misses the TLB all the time, so when the process may lock memory in RAM (SeLockMemoryPrivilege) arrays
+    are copied into large pages. On machines with more NUMA nodes, arrays in small pages are committed in stripes that
+    go to the nodes in turn, and arrays in large pages (which can't be committed in parts) are put on the nodes in turn,
+    so scans read from the memory of every node instead of the one that loaded the list.
+    Arrays that can't be allocated that way stay where they are. Nothing is moved until enable() is called
+*/
+class IndexArena {
+    friend class IndexArenaBlock;
+
+public:
+    // Smaller arrays stay where they are, it's also the granularity of NUMA interleaving
+    static constexpr uint64_t MinArraySize = uint64_t(1) << 21;
+    static constexpr int MaxNodeCount = 64;
+    static constexpr uint64_t SmallPageSize = 4096;
+
+private:
+    bool isEnabled_ = false;
+    uint64_t largePageSize = 0;
+    int nodeCount = 1;
+    std::string largePagesUnavailableReason;
+    std::atomic<uint32_t> nextNode = 0;
+    std::atomic<uint64_t> largePageBytes = 0;
+    std::atomic<uint64_t> smallPageBytes = 0;
+    std::atomic<int> largePageFailures = 0;
+    std::atomic<uint64_t> bytesOnNode[MaxNodeCount] = {};
+
+    IndexArena() = default;
+
+    static bool enableLockMemoryPrivilege() {
+        HANDLE token = NULL;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+            return false;
+        TOKEN_PRIVILEGES privileges = {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        // AdjustTokenPrivileges succeeds even when the privilege isn't granted, only the last error tells
+        bool isEnabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+            && AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+        CloseHandle(token);
+        return isEnabled;
+    }
+
+    // Pages are checked where they are after the block was written to, since that's when they get their physical memory
+    void recordPlacement(IndexArenaBlock& block) {
+        auto sampleStep = block.isLargePages_ ? largePageSize : MinArraySize;
+        std::vector<PSAPI_WORKING_SET_EX_INFORMATION> pages(size_t((block.size_ + sampleStep - 1) / sampleStep));
+        for (size_t i = 0; i < pages.size(); ++i)
+            pages[i].VirtualAddress = block.data_ + i * sampleStep;
+        block.bytesOnNode.assign(nodeCount, 0);
+        if (!QueryWorkingSetEx(GetCurrentProcess(), pages.data(), DWORD(pages.size() * sizeof(pages[0]))))
+            return;
+        for (size_t i = 0; i < pages.size(); ++i) {
+            auto& attributes = pages[i].VirtualAttributes;
+            if (attributes.Valid && attributes.Node < unsigned(nodeCount))
+                block.bytesOnNode[attributes.Node] += std::min(sampleStep, block.size_ - i * sampleStep);
+        }
+        for (int node = 0; node < nodeCount; ++node)
+            bytesOnNode[node] += block.bytesOnNode[node];
+    }
+
+    void release(IndexArenaBlock& block) {
+        (block.isLargePages_ ? largePageBytes : smallPageBytes) -= block.size_;
+        for (int node = 0; node < int(block.bytesOnNode.size()); ++node)
+            bytesOnNode[node] -= block.bytesOnNode[node];
+    }
+
+public:
+    static IndexArena& instance() {
+        static IndexArena arena;
+        return arena;
+    }
+
+    // Call before any array is moved. Large pages are used when they're supported and the privilege to lock them is granted
+    void enable() {
+        isEnabled_ = true;
+        ULONG highestNode = 0;
+        if (GetNumaHighestNodeNumber(&highestNode))
+            nodeCount = std::min(int(highestNode) + 1, MaxNodeCount);
+        largePageSize = GetLargePageMinimum();
+        if (largePageSize == 0) {
+            largePagesUnavailableReason = "not supported";
+        } else if (!enableLockMemoryPrivilege()) {
+            largePageSize = 0;
+            largePagesUnavailableReason = "SeLockMemoryPrivilege not granted";
+        }
+    }
+    bool isEnabled() const {
+        return isEnabled_;
+    }
+
+    // Returns nullptr when the arena is disabled, size is below MinArraySize or memory can't be allocated
+    std::shared_ptr<IndexArenaBlock> allocate(uint64_t size) {
+        // with neither large pages nor more nodes there is nothing to gain from copying arrays
+        if (!isEnabled_ || (largePageSize == 0 && nodeCount == 1) || size < MinArraySize)
+            return nullptr;
+        auto process = GetCurrentProcess();
+        auto node = DWORD(nextNode.fetch_add(1, std::memory_order_relaxed) % nodeCount);
+        if (largePageSize != 0) {
+            auto allocatedSize = (size + largePageSize - 1) / largePageSize * largePageSize;
+            auto data = (char*)VirtualAllocExNuma(process, NULL, allocatedSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+            if (data) {
+                largePageBytes += size;
+                return std::make_shared<IndexArenaBlock>(data, size, true);
+            }
+            // large pages run out when physical memory is fragmented
+            largePageFailures += 1;
+        }
+        if (nodeCount == 1)
+            return nullptr;
+        auto allocatedSize = (size + MinArraySize - 1) / MinArraySize * MinArraySize;
+        auto data = (char*)VirtualAlloc(NULL, allocatedSize, MEM_RESERVE, PAGE_READWRITE);
+        if (!data)
+            return nullptr;
+        for (uint64_t offset = 0; offset < allocatedSize; offset += MinArraySize) {
+            auto stripeNode = DWORD((node + offset / MinArraySize) % nodeCount);
+            if (!VirtualAllocExNuma(process, data + offset, MinArraySize, MEM_COMMIT, PAGE_READWRITE, stripeNode)) {
+                VirtualFree(data, 0, MEM_RELEASE);
+                return nullptr;
+            }
+        }
+        smallPageBytes += size;
+        return std::make_shared<IndexArenaBlock>(data, size, false);
+    }
+
+    // Moves elements of the array into the arena, or leaves the array as it is. Mapped arrays are moved too,
+    // so their pages are no longer shared with other processes that have the same file list mapped
+    template<typename Container> void move(MappedArray<Container>& array) {
+        using Value = typename Container::value_type;
+        auto count = array.size();
+        auto block = allocate(count * sizeof(Value));
+        if (!block)
+            return;
+        memcpy(block->data(), array.data(), count * sizeof(Value));
+        recordPlacement(*block);
+        auto data = (Value*)block->data();
+        array = MappedArray<Container>(std::move(block), data, count);
+    }
+
+    // Like "index arena: 1.2 GB in 2 MiB pages, 3.1 MB in 4 KiB pages, node 0: 610 MB, node 1: 590 MB"
+    std::string report() const {
+        if (!isEnabled_)
+            return "index arena: disabled";
+        if (largePageSize == 0 && nodeCount == 1)
+            return "index arena: not used (large pages " + largePagesUnavailableReason + ", 1 NUMA node)";
+        auto megabytes = [](uint64_t bytes) { return std::to_string((bytes + (1 << 19)) >> 20) + " MB"; };
+        std::string result = "index arena: ";
+        if (largePageSize != 0)
+            result += megabytes(largePageBytes) + " in " + std::to_string(largePageSize >> 20) + " MiB pages, ";
+        else
+            result += "no large pages (" + largePagesUnavailableReason + "), ";
+        result += megabytes(smallPageBytes) + " in " + std::to_string(SmallPageSize >> 10) + " KiB pages";
+        if (largePageFailures > 0)
+            result += " (" + std::to_string(largePageFailures) + " arrays didn't get large pages)";
+        for (int node = 0; node < nodeCount && nodeCount > 1; ++node)
+            result += ", node " + std::to_string(node) + ": " + megabytes(bytesOnNode[node]);
+        return result;
+    }
+};
+
+inline IndexArenaBlock::~IndexArenaBlock() {
+    IndexArena::instance().release(*this);
+    VirtualFree(data_, 0, MEM_RELEASE);
+}
+
+// Arrays that searches scan, the rest is only read for shown results
+static void moveToIndexArena(FileList& fileList) {
+    auto& arena = IndexArena::instance();
+    arena.move(fileList.files);
+    arena.move(fileList.nameTable);
+    arena.move(fileList.lowerNameTable);
+}
+
+static void moveToIndexArena(FileListExtension& fileListExt) {
+    auto& arena = IndexArena::instance();
+    for (auto index : { &fileListExt.sizeSortIndex, &fileListExt.nameSortIndex, &fileListExt.dateSortIndex, &fileListExt.pathSortIndex,
+        &fileListExt.extensionSortIndex, &fileListExt.nameRanks, &fileListExt.pathRanks, &fileListExt.extensionRanks }) {
+        arena.move(*index);
+    }
+}
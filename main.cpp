@@ -5,6 +5,10 @@
 #include "fileListStoreAndLoadFromFile.h"
 #include "fileIcons.h"
 #include "fileSearching.h"
+#include "sortIndexes.h"
+#include "fileListDisplayCache.h"
+#include "indexArena.h"
+#include "benchmarks.h"
 #include "imgui_directx11.h"
 
 #include <array>
@@ -18,46 +22,65 @@
 #include <vector>
 #include <algorithm>
 
-std::string dateToStr(uint32_t lastModificationDateInMinutes) {
-    auto date = uint64_t(lastModificationDateInMinutes) * Date100nsTo1MinPrecisionFactor;
-    SYSTEMTIME systemTime;
-    FILETIME filetime;
-    filetime.dwLowDateTime = date & 0xffffffff;
-    filetime.dwHighDateTime = date >> 32;
-    FILETIME localfiletime;
-    FileTimeToLocalFileTime(&filetime, &localfiletime);
-    FileTimeToSystemTime(&localfiletime, &systemTime);
-
-    auto toStringWith0Padding = [](int value) -> std::string {
-        auto str = std::to_string(value);
-        if (str.size() == 1)
-            str = "0" + str;
-        return str;
-    };
-    std::string result;
-    result += toStringWith0Padding(systemTime.wDay) + '.' + toStringWith0Padding(systemTime.wMonth) + '.' + std::to_string(systemTime.wYear) + ' '
-        + toStringWith0Padding(systemTime.wHour) + ':' + toStringWith0Padding(systemTime.wMinute);
-    return result;
-}
-
 std::string doubleToString(double value, int precision) {
     std::array<char, 64> buf;
     auto [ptr, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), value, std::chars_format::fixed, precision);
     return std::string(buf.data(), ptr);
 }
 
-void updateFileList(FileList& fileList, FileList&& newFileList, FileListExtension& fileListExt, FileListSearchResults& shownResults) {
-    std::unique_lock lg{ fileListExt.globalMutex };
-    shownResults.count = 0;
-    shownResults.indexes.resize(newFileList.files.size());
-            
+// Replaces the file list of the volume's segment (adds a segment for a new volume). Other segments keep their lists and indexes.
+// Indexes loaded together with the list are taken from loadedIndexes, others are created by refreshIndexesAsync
+FileListSegment& updateSegment(FileListSegments& segments, uint64_t serialNumber, const std::string& volumePath, FileList&& newFileList,
+    FileListSearchResults& shownResults, FileListExtension* loadedIndexes = nullptr
+) {
+    if (segments.createsFileColumns)
+        newFileList.columns = createFileColumns(newFileList);
+    moveToIndexArena(newFileList);
+    if (loadedIndexes)
+        moveToIndexArena(*loadedIndexes);
+    FileListSegment* segment;
+    {
+        std::unique_lock ls{ segments.mutex };
+        segment = segments.find(serialNumber, volumePath);
+        if (!segment) {
+            auto position = std::find_if(segments.segments.begin(), segments.segments.end(), [&](auto& s) { return s->volumePath > volumePath; });
+            segment = segments.segments.insert(position, std::make_unique<FileListSegment>())->get();
+            segment->serialNumber = serialNumber;
+            segment->volumePath = volumePath;
+            segments.updateFirstIds();
+            segments.generation += 1;
+        }
+    }
+    std::unique_lock lg{ segment->fileListExt.globalMutex };
+    std::unique_lock ls{ segments.mutex };
+    auto& fileList = segment->fileList;
+    auto& fileListExt = segment->fileListExt;
+    segment->serialNumber = serialNumber;
+    segment->volumePath = volumePath;
+
     fileList.files = std::move(newFileList.files);
     fileList.nameTable = std::move(newFileList.nameTable);
     fileList.lowerNameTable = std::move(newFileList.lowerNameTable);
-        
-    fileListExt.nameSortIndex.clear();
-    fileListExt.sizeSortIndex.clear();
-    fileListExt.dateSortIndex.clear();
+    fileList.sizes = std::move(newFileList.sizes);
+    fileList.allocatedSizes = std::move(newFileList.allocatedSizes);
+    fileList.columns = std::move(newFileList.columns);
+
+    FileListExtension noIndexes;
+    auto& indexes = loadedIndexes ? *loadedIndexes : noIndexes;
+    fileListExt.sizeSortIndex = std::move(indexes.sizeSortIndex);
+    fileListExt.nameSortIndex = std::move(indexes.nameSortIndex);
+    fileListExt.dateSortIndex = std::move(indexes.dateSortIndex);
+    fileListExt.pathSortIndex = std::move(indexes.pathSortIndex);
+    fileListExt.extensionSortIndex = std::move(indexes.extensionSortIndex);
+    fileListExt.nameRanks = std::move(indexes.nameRanks);
+    fileListExt.pathRanks = std::move(indexes.pathRanks);
+    fileListExt.extensionRanks = std::move(indexes.extensionRanks);
+    fileListExt.indexesGeneration += 1;
+
+    segments.updateFirstIds();
+    segments.generation += 1;
+    shownResults.clear();
+    return *segment;
 }
 
 void setImGuiStyle() {
@@ -133,55 +156,68 @@ void setImGuiStyle() {
     style->Colors[ImGuiCol_PlotHistogram] = ImVec4(0.00f, 0.40f, 0.00f, 1.00f);
 }
 
-static std::vector<uint32_t> createNameSortIndex(const FileList& fileList, const std::string& lowerNameTable) {
-    auto& files = fileList.files;
-    std::vector<uint32_t> nameIndex(files.size());
-    std::iota(nameIndex.begin(), nameIndex.end(), uint32_t(0));
-    std::sort(std::execution::par, nameIndex.begin(), nameIndex.end(), [&](auto i, auto j) {
-        return std::strcmp(&lowerNameTable[files[i].nameTableIndexAndInfo & 0x7fffffff], &lowerNameTable[files[j].nameTableIndexAndInfo & 0x7fffffff]) > 0;
-    });
-    return nameIndex;
-}
-static std::vector<uint32_t> createDateSortIndex(const FileList& fileList) {
-    auto& files = fileList.files;
-    std::vector<uint32_t> dateIndex(files.size());
-    std::iota(dateIndex.begin(), dateIndex.end(), uint32_t(0));
-    std::sort(std::execution::par, dateIndex.begin(), dateIndex.end(), [&](auto i, auto j) {
-        return files[i].lastModificationDateInMinutes > files[j].lastModificationDateInMinutes;
+// Creates all sort indexes of the segment's list and publishes them together. Caller must hold shared lock on globalMutex
+void createIndexes(FileList& fileList, FileListExtension& fileListExt) {
+    ThreadPool tp(TaskPriority::Background);
+    std::vector<uint32_t> sizeSortIndex, nameSortIndex, dateSortIndex, pathSortIndex, extensionSortIndex;
+    std::vector<uint64_t> extensionOffsets;
+    bool hasPathSortIndex = fileListExt.pathSortIndex.size() == fileList.files.size(); // files saved by older versions have only this one
+    if (hasPathSortIndex)
+        pathSortIndex.assign(fileListExt.pathSortIndex.begin(), fileListExt.pathSortIndex.end());
+    tp.addTask([&]() { sizeSortIndex = createSizeSortIndex(fileList); });
+    std::vector<uint32_t> nameRanks, pathRanks, extensionRanks;
+    tp.addTask([&]() { nameSortIndex = createNameSortIndex(fileList, fileList.lowerNameTable, nameRanks); });
+    tp.addTask([&]() { dateSortIndex = createDateSortIndex(fileList); });
+    if (!hasPathSortIndex)
+        tp.addTask([&]() { pathSortIndex = createPathSortIndex(fileList, fileList.lowerNameTable); });
+    tp.addTask([&]() {
+        extensionOffsets = createExtensionOffsets(fileList, fileList.lowerNameTable);
+        extensionSortIndex = createExtensionSortIndex(fileList, fileList.lowerNameTable, extensionOffsets);
     });
-    return dateIndex;
-}
-static std::vector<uint32_t> createSizeSortIndex(const FileList& fileList) {
-    auto& files = fileList.files;
-    std::vector<uint32_t> sizeIndex(files.size());
-    std::iota(sizeIndex.begin(), sizeIndex.end(), uint32_t(0));
-    std::sort(std::execution::par, sizeIndex.begin(), sizeIndex.end(), [&](auto i, auto j) {
-        return files[i].size > files[j].size;
-    });
-    return sizeIndex;
+    tp.wait();
+
+    tp.addTask([&]() { pathRanks = createPathRanks(pathSortIndex); });
+    tp.addTask([&]() { extensionRanks = createExtensionRanks(fileList.lowerNameTable, extensionOffsets, extensionSortIndex); });
+    tp.wait();
+
+    // moved to the arena before they're published, so searches don't wait for the copy
+    FileListExtension indexes;
+    indexes.sizeSortIndex = std::move(sizeSortIndex);
+    indexes.nameSortIndex = std::move(nameSortIndex);
+    indexes.dateSortIndex = std::move(dateSortIndex);
+    indexes.pathSortIndex = std::move(pathSortIndex);
+    indexes.extensionSortIndex = std::move(extensionSortIndex);
+    indexes.nameRanks = std::move(nameRanks);
+    indexes.pathRanks = std::move(pathRanks);
+    indexes.extensionRanks = std::move(extensionRanks);
+    moveToIndexArena(indexes);
+    {
+        std::unique_lock li{ fileListExt.indexesMutex };
+        fileListExt.sizeSortIndex = std::move(indexes.sizeSortIndex);
+        fileListExt.nameSortIndex = std::move(indexes.nameSortIndex);
+        fileListExt.dateSortIndex = std::move(indexes.dateSortIndex);
+        fileListExt.pathSortIndex = std::move(indexes.pathSortIndex);
+        fileListExt.extensionSortIndex = std::move(indexes.extensionSortIndex);
+        fileListExt.nameRanks = std::move(indexes.nameRanks);
+        fileListExt.pathRanks = std::move(indexes.pathRanks);
+        fileListExt.extensionRanks = std::move(indexes.extensionRanks);
+        fileListExt.indexesGeneration += 1;
+    }
 }
 
-void refreshIndexesAsync(const FileList& fileList, FileListExtension& fileListExt, std::function<void(void)> notifySearchThread) {
-    static std::future<void> refreshIndexesTask;
-    if (refreshIndexesTask.valid())
-        refreshIndexesTask.wait();
-    refreshIndexesTask = std::async(std::launch::async, [notifySearchThread, &fileList, &fileListExt]() {
+void refreshIndexesAsync(FileListSegment& segment, std::function<void(void)> notifySearchThread, std::function<void(void)> onIndexesCreated = {}) {
+    if (segment.refreshIndexesTask.valid())
+        segment.refreshIndexesTask.wait();
+    segment.refreshIndexesTask = std::async(std::launch::async, [notifySearchThread, onIndexesCreated, &segment]() {
         {
-            std::shared_lock lg{ fileListExt.globalMutex };
-            ThreadPoolAsync tp;
-            std::vector<uint32_t> sizeSortIndex, nameSortIndex, dateSortIndex;
-            tp.addTask([&]() { sizeSortIndex = createSizeSortIndex(fileList); });
-            tp.addTask([&]() { nameSortIndex = createNameSortIndex(fileList, fileList.lowerNameTable); });
-            tp.addTask([&]() { dateSortIndex = createDateSortIndex(fileList); });
-            tp.wait();
-            {
-                std::unique_lock li{ fileListExt.indexesMutex };
-                fileListExt.sizeSortIndex = std::move(sizeSortIndex);
-                fileListExt.nameSortIndex = std::move(nameSortIndex);
-                fileListExt.dateSortIndex = std::move(dateSortIndex);
-            }
+            std::shared_lock lg{ segment.fileListExt.globalMutex };
+            // indexes loaded together with the file list are used as they are
+            if (!segment.fileListExt.hasAllIndexes(segment.fileList.files.size()))
+                createIndexes(segment.fileList, segment.fileListExt);
         }
         notifySearchThread();
+        if (onIndexesCreated)
+            onIndexesCreated();
     });
 }
 
@@ -206,12 +242,54 @@ enum class ErrorType {
     PathNoLongerExists,
     FailedToRunExplorer,
     DeniedPrivileges,
-    FailedToRunAsAdmin
+    FailedToRunAsAdmin,
+    FailedToSaveFileList
 };
 
-ErrorType runRefreshFileTaskAsync(FileList& fileList, FileListExtension& fileListExt, FileListSearchResults& shownResults,
-    std::atomic<double>& refreshProgress, std::atomic<double>& lastFileListCreateTime, uint64_t& processedRecordCount,
-    std::function<void(void)> notifySearchThread, std::future<void>& saveFileListTask, char** argv
+// Drive names of all NTFS volumes, like "C:"
+std::vector<std::string> ntfsVolumePaths() {
+    std::vector<std::string> result;
+    auto drives = GetLogicalDrives();
+    for (int i = 0; i < 26; ++i) {
+        if (!(drives & (1 << i)))
+            continue;
+        std::string root = std::string(1, char('A' + i)) + ":\\";
+        char fileSystemName[MAX_PATH + 1] = { 0 };
+        if (GetVolumeInformationA(root.c_str(), nullptr, 0, nullptr, nullptr, nullptr, fileSystemName, sizeof(fileSystemName)) && !strcmp(fileSystemName, "NTFS"))
+            result.push_back(root.substr(0, 2));
+    }
+    return result;
+}
+
+void saveSegmentAsync(FileListSegment& segment, Compression compression) {
+    if (segment.saveTask.valid())
+        segment.saveTask.wait();
+    segment.saveTask = std::async(std::launch::async, [&segment, compression]() {
+        std::shared_lock lg{ segment.fileListExt.globalMutex };
+        std::shared_lock li{ segment.fileListExt.indexesMutex };
+        if (!saveFileList(segmentFileName(segment.serialNumber), segment.fileList, segment.fileListExt, compression))
+            segment.hasFailedToSave = true;
+    });
+}
+
+// Parses MFT of the volume and replaces its segment as soon as it's done, without waiting for other volumes
+void refreshSegment(FileListSegments& segments, const std::string& volumePath, FileListSearchResults& shownResults,
+    std::atomic<double>& refreshProgress, MftParsingStats& stats, std::function<void(void)> notifySearchThread, double progressShare, Compression fileListCompression
+) {
+    auto newFileList = getVolumeFileListWithMftParsing(volumePath, refreshProgress, stats, progressShare);
+    if (stats.serialNumber == 0)
+        return;
+    auto& segment = updateSegment(segments, stats.serialNumber, volumePath, std::move(newFileList), shownResults);
+    notifySearchThread();
+    // saved after indexes are created, because path sort index is stored together with the file list
+    refreshIndexesAsync(segment, notifySearchThread, [&segment, fileListCompression]() {
+        saveSegmentAsync(segment, fileListCompression);
+    });
+}
+
+ErrorType runRefreshFileTaskAsync(FileListSegments& segments, FileListSearchResults& shownResults,
+    std::atomic<double>& refreshProgress, std::atomic<double>& lastFileListCreateTime, MftParsingStats& mftParsingStats,
+    std::function<void(void)> notifySearchThread, const std::vector<std::string>& imagePaths, Compression fileListCompression, char** argv
 ) {
     static std::future<void> refreshFileListTask;
     if (isRunning(refreshFileListTask))
@@ -221,17 +299,24 @@ ErrorType runRefreshFileTaskAsync(FileList& fileList, FileListExtension& fileLis
         refreshFileListTask = std::async(std::launch::async, [&, notifySearchThread]() {
             lastFileListCreateTime = 0;
             auto timer = Timer();
-            auto newFileList = getVolumeFileListWithMftParsing(refreshProgress, processedRecordCount);
-            lastFileListCreateTime = timer.getTime();
-            if (saveFileListTask.valid())
-                saveFileListTask.wait();
-            saveFileListTask = std::async(std::launch::async, [&fileListExt, newFileList]() {
-                saveFileList("fileList", newFileList, fileListExt.fileListFileMutex);
+            auto volumePaths = ntfsVolumePaths();
+            volumePaths.insert(volumePaths.end(), imagePaths.begin(), imagePaths.end());
+            std::vector<MftParsingStats> volumeStats(volumePaths.size());
+            // volumes are parsed concurrently on background workers, so they share CPU with each other and yield to searches
+            ThreadPool threadPool(TaskPriority::Background);
+            threadPool.addTasks(int(volumePaths.size()), [&](int i) {
+                refreshSegment(segments, volumePaths[i], shownResults, refreshProgress, volumeStats[i], notifySearchThread, 1.0 / volumePaths.size(), fileListCompression);
             });
-            updateFileList(fileList, std::move(newFileList), fileListExt, shownResults);
+            threadPool.wait();
+            MftParsingStats totalStats;
+            for (auto& stats : volumeStats) {
+                totalStats.recordCount += stats.recordCount;
+                totalStats.nameCount += stats.nameCount;
+                totalStats.distinctNameCount += stats.distinctNameCount;
+            }
+            mftParsingStats = totalStats;
+            lastFileListCreateTime = timer.getTime();
             refreshProgress = 0;
-            notifySearchThread();
-            refreshIndexesAsync(fileList, fileListExt, notifySearchThread);
         });
         return ErrorType::None;
     } else {
@@ -243,6 +328,14 @@ ErrorType runRefreshFileTaskAsync(FileList& fileList, FileListExtension& fileLis
             args += " " + std::to_string(rect.right - rect.left);
             args += " " + std::to_string(rect.bottom - rect.top);
         }
+        for (auto& imagePath : imagePaths)
+            args += " -image \"" + imagePath + "\"";
+        if (fileListCompression != Compression::None)
+            args += std::string(" -compression ") + CompressionNames[int(fileListCompression)];
+        if (segments.createsFileColumns)
+            args += " -fileColumns";
+        if (IndexArena::instance().isEnabled())
+            args += " -indexArena";
         auto errorCode = uint64_t(ShellExecuteA(nullptr, "runas", argv[0], args.c_str(), nullptr, SW_NORMAL));
         if (errorCode > 32) {
             std::quick_exit(0);
@@ -290,6 +383,17 @@ void setClipboardText(const std::string& text) {
     }
 }
 
+SearchSettings::Index columnSortIndex(ImGuiID columnUserId) {
+    switch (columnUserId) {
+    case 0: return SearchSettings::Index::Name;
+    case 1: return SearchSettings::Index::Path;
+    case 2: return SearchSettings::Index::Size;
+    case 3: return SearchSettings::Index::Date;
+    case 4: return SearchSettings::Index::Extension;
+    default: return SearchSettings::Index::Direct;
+    }
+}
+
 std::optional<int> tryParseInt(char* str) {
     char* end;
     int result = int(std::strtol(str, &end, 10));
@@ -304,12 +408,21 @@ std::optional<int> tryParseInt(char* str) {
     - make findFirstFile use W option (maybe WEx? Saw somewhere it's faster)
     - search in swiftsearch how he discards $MFT and other such files
     - clean the code
-    - make it search all volumes not just C:/
-        - have to figure out how do I save/work with that. Might just work on them separetly and only combine when creating search results
 */
 
 //#pragma comment(linker, "/SUBSYSTEM:console /ENTRY:main")
 int main(int argc, char** argv) {
+    if (argc >= 2 && !strcmp(argv[1], "-benchmark")) {
+        if (argc >= 4)
+            TaskScheduler::configure(tryParseInt(argv[3]).value_or(0));
+        runBenchmarks(argc >= 3 ? tryParseInt(argv[2]).value_or(0) : 0);
+        std::quick_exit(0);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "-benchmarkScale")) {
+        runScaleBenchmark(argc >= 3 ? tryParseInt(argv[2]).value_or(200'000'000) : 200'000'000);
+        std::quick_exit(0);
+    }
+
     std::string debugText = "";
     bool showDebugWindow = false;
 
@@ -317,15 +430,41 @@ int main(int argc, char** argv) {
     ULONG_PTR gdiplusToken;
     GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
 
-    FileList fileList;
-    FileListExtension fileListExt;
+    FileListSegments segments;
     FileListSearchResults shownResults;
+    FileListDisplayCache displayCache;
+    SearchResultsLister resultsLister;
     char searchFileName[512] = { 0 };
     
     SearchSettings searchSettings;
 
     std::atomic<double> refreshProgress;
-    std::future<void> saveFileListTask;
+
+    // NTFS images given with "-image <path>" are indexed together with the volumes
+    std::vector<std::string> imagePaths;
+    // "-compression lz4", "lz4hc" or "columnar" saves file lists compressed, so they take less space but are decompressed on start instead of mapped.
+    // Columnar lists are the smallest, but their indexes are created again on every start
+    Compression fileListCompression = Compression::None;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (!strcmp(argv[i], "-image")) {
+            imagePaths.push_back(argv[++i]);
+        } else if (!strcmp(argv[i], "-compression")) {
+            ++i;
+            for (int j = 0; j < int(std::size(CompressionNames)); ++j) {
+                if (!strcmp(argv[i], CompressionNames[j]))
+                    fileListCompression = Compression(j);
+            }
+        }
+    }
+    // "-fileColumns" keeps a structure of arrays copy of the files (see FileColumns), which makes searches read less memory
+    // at the cost of about 17 more bytes per file
+    // "-indexArena" copies files, name tables and sort indexes into large pages, interleaved between NUMA nodes (see IndexArena).
+    // Large pages need the "Lock pages in memory" right
+    for (int i = 1; i < argc; ++i) {
+        segments.createsFileColumns |= !strcmp(argv[i], "-fileColumns");
+        if (!strcmp(argv[i], "-indexArena"))
+            IndexArena::instance().enable();
+    }
 
     std::string errorPopupFileName = "";
 
@@ -333,33 +472,36 @@ int main(int argc, char** argv) {
     bool setResultColumnsWidth = false;
     std::atomic<double> lastSearchTime = 0;
     std::atomic<double> lastFileListCreateTime = 0;
-    std::atomic<bool> shouldRunSearchFunc = false;
-    uint64_t processedRecordCount;
-    std::mutex searchNotifyMutex;
-    std::condition_variable searchNotifyCondVar;
+    std::atomic<double> lastTimeToFirstResults = 0;
+    MftParsingStats mftParsingStats;
+    SearchRequests searchRequests;
+    searchRequests.coalesceWindow = std::chrono::milliseconds(15);
     auto searchThreadHandle = std::thread([&] {
-        searchThread(fileList, fileListExt, shownResults, searchFileName, searchSettings, lastSearchTime, shouldRunSearchFunc, searchNotifyMutex, searchNotifyCondVar);
+        searchThread(segments, shownResults, searchFileName, searchSettings, lastSearchTime, lastTimeToFirstResults, searchRequests);
     });
 
-    auto notifySearchThread = [&searchNotifyMutex, &searchNotifyCondVar, &shouldRunSearchFunc] {
-        {
-            std::lock_guard l(searchNotifyMutex);
-            shouldRunSearchFunc = true;
-        }
-        searchNotifyCondVar.notify_all();
+    auto notifySearchThread = [&searchRequests] {
+        searchRequests.notify();
     };
 
     auto loadListTask = std::async(std::launch::async, [&]() {
-        auto newFileList = loadFileList("fileList", fileListExt.fileListFileMutex);
-        updateFileList(fileList, std::move(newFileList), fileListExt, shownResults);
-        notifySearchThread();
-        refreshIndexesAsync(fileList, fileListExt, notifySearchThread);
+        for (auto& loaded : loadFileListSegments()) {
+            bool isSaved = loaded->fileListExt.hasAllIndexes(loaded->fileList.files.size()) && !loaded->fileListExt.isInOlderFormat;
+            auto& segment = updateSegment(segments, loaded->serialNumber, loaded->volumePath, std::move(loaded->fileList), shownResults, &loaded->fileListExt);
+            notifySearchThread();
+            // lists in older formats are saved again in the current one, so the next start doesn't create indexes or convert names.
+            // Columnar lists never have indexes
+            refreshIndexesAsync(segment, notifySearchThread, [&segment, isSaved, fileListCompression]() {
+                if (!isSaved && segment.serialNumber != 0 && fileListCompression != Compression::Columnar)
+                    saveSegmentAsync(segment, fileListCompression);
+            });
+        }
     });
 
     ErrorType error = ErrorType::None;
 
     if (argc >= 2 && !strcmp(argv[1], "-refreshFileList")) {
-        error = runRefreshFileTaskAsync(fileList, fileListExt, shownResults, refreshProgress, lastFileListCreateTime, processedRecordCount, notifySearchThread, saveFileListTask, argv);
+        error = runRefreshFileTaskAsync(segments, shownResults, refreshProgress, lastFileListCreateTime, mftParsingStats, notifySearchThread, imagePaths, fileListCompression, argv);
     }
     
     int windowX = 100;
@@ -418,7 +560,7 @@ int main(int argc, char** argv) {
 
         ImGui::SameLine();
         if (ImGui::Button("Refresh file list", ImVec2((ImGui::GetWindowWidth() - ImGui::GetStyle().ItemSpacing.x * 2) * 0.3f, 0))) {
-            error = runRefreshFileTaskAsync(fileList, fileListExt, shownResults, refreshProgress, lastFileListCreateTime, processedRecordCount, notifySearchThread, saveFileListTask, argv);
+            error = runRefreshFileTaskAsync(segments, shownResults, refreshProgress, lastFileListCreateTime, mftParsingStats, notifySearchThread, imagePaths, fileListCompression, argv);
         }
 
         if (ImGui::BeginTable("searchSettingsTable", 4, ImGuiTableFlags_NoBordersInBody | ImGuiTableFlags_SizingStretchSame)) {
@@ -451,17 +593,19 @@ int main(int argc, char** argv) {
 
         static int hoveredItem = 0;
         {
-            std::shared_lock lg{ fileListExt.globalMutex };
-            std::shared_lock ls{ fileListExt.searchResultsMutex };
+            std::shared_lock lg{ segments.mutex };
+            std::unique_lock ls{ segments.searchResultsMutex };
+            resultsLister.beginFrame(shownResults);
 
             auto tableFlags = ImGuiTableFlags_SizingStretchProp | ImGuiTableFlags_Resizable 
                 | ImGuiTableFlags_Reorderable | ImGuiTableFlags_ScrollY 
-                | ImGuiTableFlags_Hideable | ImGuiTableFlags_RowBg  | ImGuiTableFlags_Sortable| ImGuiTableFlags_SortTristate;
-            if (ImGui::BeginTable("searchResultsTable", 4, tableFlags, ImVec2(0.0f, -(fontSize * 2.5f)), 0.0)) {
+                | ImGuiTableFlags_Hideable | ImGuiTableFlags_RowBg  | ImGuiTableFlags_Sortable| ImGuiTableFlags_SortTristate | ImGuiTableFlags_SortMulti;
+            if (ImGui::BeginTable("searchResultsTable", 5, tableFlags, ImVec2(0.0f, -(fontSize * 2.5f)), 0.0)) {
                 ImGui::TableSetupColumn("Name", ImGuiTableColumnFlags_NoHide | ImGuiTableColumnFlags_WidthStretch | ImGuiTableColumnFlags_PreferSortDescending, 0.4f, 0);
-                ImGui::TableSetupColumn("Path", ImGuiTableColumnFlags_WidthStretch | ImGuiTableColumnFlags_NoResize | ImGuiTableColumnFlags_NoSort, 0.6f, 1);
+                ImGui::TableSetupColumn("Path", ImGuiTableColumnFlags_WidthStretch | ImGuiTableColumnFlags_NoResize, 0.6f, 1);
                 ImGui::TableSetupColumn("Size", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_NoResize | ImGuiTableColumnFlags_PreferSortDescending, (fontSize / 20.0f) * 65.0f, 2);
                 ImGui::TableSetupColumn("Date", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_NoResize | ImGuiTableColumnFlags_PreferSortDescending, (fontSize / 20.0f) * 120.0f, 3);
+                ImGui::TableSetupColumn("Extension", ImGuiTableColumnFlags_WidthFixed | ImGuiTableColumnFlags_NoResize | ImGuiTableColumnFlags_DefaultHide, (fontSize / 20.0f) * 70.0f, 4);
                 ImGui::TableSetupScrollFreeze(0, 1);
 
                 ImGuiTableSortSpecs* sortSpecs = ImGui::TableGetSortSpecs();
@@ -471,15 +615,15 @@ int main(int argc, char** argv) {
                         searchSettings.reverseIndex = false;
                     } else {
                         const ImGuiTableColumnSortSpecs& sortSpec = sortSpecs->Specs[0];
-                        int delta = 0;
-                        switch (sortSpec.ColumnUserID) {
-                        case 0: searchSettings.index = SearchSettings::Index::Name; break;
-                        case 2: searchSettings.index = SearchSettings::Index::Size; break;
-                        case 3: searchSettings.index = SearchSettings::Index::Date; break;
-                        default: break;
-                        }
+                        searchSettings.index = columnSortIndex(sortSpec.ColumnUserID);
                         searchSettings.reverseIndex = sortSpec.SortDirection == ImGuiSortDirection_Ascending;
                     }
+                    searchSettings.thenByCount = 0;
+                    for (int i = 1; i < std::min(sortSpecs->SpecsCount, SearchSettings::MaxSortKeys); ++i) {
+                        auto& thenBy = searchSettings.thenBy[searchSettings.thenByCount++];
+                        thenBy.index = columnSortIndex(sortSpecs->Specs[i].ColumnUserID);
+                        thenBy.reverse = sortSpecs->Specs[i].SortDirection == ImGuiSortDirection_Ascending;
+                    }
                     if (!firstFrame)
                         notifySearchThread();
                     sortSpecs->SpecsDirty = false;
@@ -487,19 +631,33 @@ int main(int argc, char** argv) {
 
                 ImGui::TableHeadersRow();
 
+                displayCache.beginFrame();
+                int visibleStart = 0;
+                int visibleEnd = 0;
                 ImGuiListClipper clipper;
                 clipper.Begin(shownResults.count);
                 while (clipper.Step()) {
+                    visibleStart = clipper.DisplayStart;
+                    visibleEnd = clipper.DisplayEnd;
                     for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
-                        auto& result = fileList.files[shownResults.indexes[i]];
-                        auto fullPath = fullFilePath(result, fileList);
+                        // rows are listed in the background (see SearchResultsLister), or sort indexes were replaced and the search they trigger shows them
+                        if (!shownResults.isMaterialized(i, i + 1)) {
+                            ImGui::TableNextRow(ImGuiTableRowFlags_None, float(fontSize));
+                            ImGui::TableSetColumnIndex(0);
+                            ImGui::Dummy(ImVec2(0, float(fontSize)));
+                            continue;
+                        }
+                        auto fileId = shownResults.id(segments, i);
+                        auto& result = segments.file(fileId);
+                        auto& row = displayCache.get(segments, fileId);
+                        auto& fullPath = row.fullPath;
 
                         ImGui::TableNextRow(ImGuiTableRowFlags_None, float(fontSize));
 
                         ImGui::TableSetColumnIndex(0);
 
                         bool isSelected = false;
-                        ImGui::PushID(shownResults.indexes[i]);
+                        ImGui::PushID(fileId);
                         if (ImGui::Selectable("##", isSelected, ImGuiSelectableFlags_SpanAllColumns, ImVec2(0, float(fontSize)))) {
                             error = runExplorer(fullPath);
                         }
@@ -507,7 +665,7 @@ int main(int argc, char** argv) {
                             ImGui::OpenPopup("FileOptionsPopup");
                         }
                         if (ImGui::BeginPopup("FileOptionsPopup")) {
-                            ImGui::SeparatorText(result.getName(fileList.nameTable));
+                            ImGui::SeparatorText(row.name.data());
                             if (ImGui::Selectable("Open")) {
                                 system(std::string("\"" + fullPath + "\"").c_str());
                             }
@@ -515,7 +673,7 @@ int main(int argc, char** argv) {
                                 error = runExplorer(fullPath);
                             }
                             if (ImGui::Selectable("Copy file name")) {
-                                setClipboardText(result.getName(fileList.nameTable));
+                                setClipboardText(std::string(row.name));
                             }
                             if (ImGui::Selectable("Copy path")) {
                                 setClipboardText(fullPath);
@@ -525,10 +683,10 @@ int main(int argc, char** argv) {
                         ImGui::PopID();
                         ImGui::SameLine();
 
-                        auto img = getIcon(result, fileList, fullPath);
+                        auto img = getIcon(result, row.extension, fullPath);
                         ImGui::Image((void*)img.srv, ImVec2(float(fontSize), float(fontSize)));
                         ImGui::SameLine();
-                        ImGui::Text("%s", result.getName(fileList.nameTable));
+                        ImGui::Text("%.*s", int(row.name.size()), row.name.data());
 
                         if (ImGui::TableSetColumnIndex(1)) {
                             ImGui::Text(itemFormatStr.c_str(), fullPath.c_str());
@@ -536,41 +694,49 @@ int main(int argc, char** argv) {
 
                         ImGui::PushStyleVar(ImGuiStyleVar_SelectableTextAlign, ImVec2(1, 0.5));
                         if (ImGui::TableSetColumnIndex(2)) {
-                            if (result.size >= 1'000'000'000) {
-                                ImGui::Selectable((doubleToString(result.size / 1'000'000'000, 1) + " GB").c_str(), false, ImGuiSelectableFlags_None);
-                            } else if (result.size >= 1'000'000) {
-                                ImGui::Selectable((doubleToString(result.size / 1'000'000, 1) + " MB").c_str(), false, ImGuiSelectableFlags_None);
-                            } else {
-                                ImGui::Selectable((doubleToString(result.size / 1'000, 1) + " KB").c_str(), false, ImGuiSelectableFlags_None);
-                            }
+                            ImGui::Selectable(row.size.data(), false, ImGuiSelectableFlags_None);
                         }
                         if (ImGui::TableSetColumnIndex(3)) {
-                            ImGui::Selectable(dateToStr(result.lastModificationDateInMinutes).c_str(), false, ImGuiSelectableFlags_None);
+                            ImGui::Selectable(row.date.data(), false, ImGuiSelectableFlags_None);
                         }
                         ImGui::PopStyleVar();
+                        if (ImGui::TableSetColumnIndex(4)) {
+                            ImGui::Text("%.*s", int(row.extension.size()), row.extension.data());
+                        }
                     }
                 }
                 clipper.End();
+                resultsLister.materialize(segments, shownResults, visibleStart, visibleEnd);
+                displayCache.prefetch(segments, shownResults, visibleEnd, visibleEnd - visibleStart);
                 ImGui::EndTable();
             }
         }
 
-        ImGui::Text("Last search time: %7.3f ms", lastSearchTime.load() * 1'000);
+        ImGui::Text("Last search time: %7.3f ms (first results after %7.3f ms)", lastSearchTime.load() * 1'000, lastTimeToFirstResults.load() * 1'000);
         ImGui::SameLine();
-        std::string filesFoundText = std::to_string(shownResults.count) + " files found";
+        std::string filesFoundText = std::to_string(shownResults.count) + (shownResults.isComplete ? " files found" : "+ files found (still counting...)");
         auto posX = (ImGui::GetWindowWidth() - ImGui::CalcTextSize(filesFoundText.c_str()).x - ImGui::GetStyle().ItemSpacing.x);
         if (posX > ImGui::GetCursorPosX())
             ImGui::SetCursorPosX(posX);
         ImGui::Text("%s", filesFoundText.c_str());
 
         if (refreshProgress == 0 && lastFileListCreateTime != 0) {
-            std::shared_lock lg{ fileListExt.globalMutex };
-            std::string text = "Parsed MFT in " + doubleToString(lastFileListCreateTime, 3) + " [s] (speed of " + std::to_string(int(processedRecordCount / 1'000.0 / lastFileListCreateTime)) + " MB / s)";
+            std::shared_lock lg{ segments.mutex };
+            std::string text = "Parsed MFT in " + doubleToString(lastFileListCreateTime, 3) + " [s] (speed of " + std::to_string(int(mftParsingStats.recordCount / 1'000.0 / lastFileListCreateTime)) + " MB / s, "
+                + std::to_string(mftParsingStats.nameCount) + " names deduplicated " + doubleToString(mftParsingStats.nameDedupRatio(), 2) + "x)";
             ImGui::ProgressBar(0, ImVec2(-1, 0), text.c_str());
         } else {
             ImGui::ProgressBar(float(refreshProgress), ImVec2(-1, 0));
         }
+        if (IndexArena::instance().isEnabled())
+            ImGui::Text("%s", IndexArena::instance().report().c_str());
 
+        if (std::shared_lock ls{ segments.mutex, std::try_to_lock }; ls.owns_lock()) {
+            for (auto& segment : segments.segments) {
+                if (segment->hasFailedToSave.exchange(false))
+                    error = ErrorType::FailedToSaveFileList;
+            }
+        }
         if (error != ErrorType::None) {
             ImGui::OpenPopup("Error");
             errorPopupOpen = true;
@@ -585,6 +751,8 @@ int main(int argc, char** argv) {
                 errorMessage = "Failed to run as administrator";
             } else if (error == ErrorType::DeniedPrivileges) {
                 errorMessage = "You have to grant admin privileges to create fileList";
+            } else if (error == ErrorType::FailedToSaveFileList) {
+                errorMessage = "Failed to save fileList.\nThe next start loads the previous one";
             }
             error = ErrorType::None;
             ImGui::Text("%s", errorMessage.c_str());
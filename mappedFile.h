@@ -0,0 +1,145 @@
+#pragma once
+
+#include "windowsInclude.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/*
+    Whole file mapped into memory. Pages are copy-on-write, so every process that maps the same file shares one
+    physical copy until some page is written to, and writes never reach the file
+*/
+class MappedFile {
+    HANDLE mapping = NULL;
+    char* view = nullptr;
+    uint64_t size_ = 0;
+
+    MappedFile() = default;
+
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (view)
+            UnmapViewOfFile(view);
+        if (mapping)
+            CloseHandle(mapping);
+    }
+
+    // Returns nullptr when the file doesn't exist, is empty or can't be mapped
+    static std::shared_ptr<MappedFile> open(const std::string& fileName) {
+        // FILE_SHARE_DELETE lets a newer version of the file be moved into its place while it's mapped
+        auto file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return nullptr;
+        std::shared_ptr<MappedFile> result(new MappedFile());
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+            result->mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+            if (result->mapping) {
+                result->view = (char*)MapViewOfFile(result->mapping, FILE_MAP_COPY, 0, 0, 0);
+                result->size_ = uint64_t(fileSize.QuadPart);
+            }
+        }
+        CloseHandle(file); // the mapping keeps its own reference to the file
+        return result->view ? result : nullptr;
+    }
+
+    char* data() const {
+        return view;
+    }
+    uint64_t size() const {
+        return size_;
+    }
+};
+
+/*
+    Array that is either owned by a container (std::vector or std::string) or lies in place in memory it keeps alive:
+    a mapped file or a block of IndexArena. Elements can be read and written the same way in both cases. Changing the size
+    needs owned(), which first copies the mapped elements into the container
+*/
+template<typename Container> class MappedArray {
+public:
+    using value_type = typename Container::value_type;
+
+private:
+    Container ownedElements;
+    std::shared_ptr<void> mapping; // MappedFile or IndexArenaBlock
+    value_type* mappedData = nullptr;
+    size_t mappedSize = 0;
+
+public:
+    MappedArray() = default;
+    MappedArray(Container&& container) : ownedElements(std::move(container)) {}
+    MappedArray(std::shared_ptr<MappedFile> mapping, uint64_t offset, size_t size)
+        : mapping(mapping), mappedData((value_type*)(mapping->data() + offset)), mappedSize(size) {}
+    MappedArray(std::shared_ptr<void> memory, value_type* data, size_t size) : mapping(std::move(memory)), mappedData(data), mappedSize(size) {}
+    // copies are always owned, so writing to them doesn't change the original
+    MappedArray(const MappedArray& other) : ownedElements(other.begin(), other.end()) {}
+    MappedArray(MappedArray&& other) noexcept = default;
+    MappedArray& operator=(const MappedArray& other) {
+        if (this != &other)
+            *this = Container(other.begin(), other.end());
+        return *this;
+    }
+    MappedArray& operator=(MappedArray&& other) noexcept = default;
+    MappedArray& operator=(Container&& container) {
+        ownedElements = std::move(container);
+        mapping.reset();
+        mappedData = nullptr;
+        mappedSize = 0;
+        return *this;
+    }
+
+    bool isMapped() const {
+        return mapping != nullptr;
+    }
+    Container& owned() {
+        if (mapping) {
+            ownedElements.assign(mappedData, mappedData + mappedSize);
+            mapping.reset();
+        }
+        return ownedElements;
+    }
+    void clear() {
+        *this = Container();
+    }
+
+    size_t size() const {
+        return mapping ? mappedSize : ownedElements.size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    value_type* data() {
+        return mapping ? mappedData : ownedElements.data();
+    }
+    const value_type* data() const {
+        return mapping ? mappedData : ownedElements.data();
+    }
+    value_type& operator[](size_t i) {
+        return data()[i];
+    }
+    const value_type& operator[](size_t i) const {
+        return data()[i];
+    }
+    value_type* begin() {
+        return data();
+    }
+    value_type* end() {
+        return data() + size();
+    }
+    const value_type* begin() const {
+        return data();
+    }
+    const value_type* end() const {
+        return data() + size();
+    }
+    value_type& back() {
+        return data()[size() - 1];
+    }
+    const value_type& back() const {
+        return data()[size() - 1];
+    }
+};
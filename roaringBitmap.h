@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <iterator>
+#include <span>
+#include <vector>
+
+/*
+    Set of uint32 ids split into containers of the 65536 ids that share the upper 16 bits, like Roaring bitmaps.
+    A container with at most ArrayContainerMaxSize ids keeps them as a sorted array of the lower 16 bits, a bigger one
+    as a bitmap of all 65536 ids, so a set takes at most 2 bytes per id and never more than 1 bit per possible id.
+    Bitmap containers are combined and counted 256 bits at a time. Sets don't change once they are built,
+    so cardinalities are summed up front and count() and select() never scan the bits
+*/
+class RoaringBitmap {
+public:
+    static constexpr uint32_t ContainerIdCount = uint32_t(1) << 16;
+    static constexpr int BitmapWordCount = ContainerIdCount / 64;
+    // above it the array would be bigger than the bitmap
+    static constexpr uint32_t ArrayContainerMaxSize = 4096;
+
+    struct Container {
+        uint16_t key = 0; // upper 16 bits of its ids
+        uint32_t cardinality = 0;
+        std::vector<uint16_t> values; // ascending lower bits, when cardinality <= ArrayContainerMaxSize
+        std::vector<uint64_t> words; // BitmapWordCount words otherwise
+
+        bool isBitmap() const {
+            return !words.empty();
+        }
+        bool contains(uint16_t low) const {
+            if (isBitmap())
+                return (words[low / 64] >> (low % 64)) & 1;
+            return std::binary_search(values.begin(), values.end(), low);
+        }
+        // Calls f(low) for the lower bits of every id in ascending order
+        template<typename F> void forEach(F f) const {
+            if (!isBitmap()) {
+                for (auto low : values)
+                    f(low);
+                return;
+            }
+            for (int i = 0; i < BitmapWordCount; ++i) {
+                for (auto word = words[i]; word; word &= word - 1)
+                    f(uint16_t(i * 64 + std::countr_zero(word)));
+            }
+        }
+        // Lower bits of the id with rank ids before it in the container
+        uint16_t select(uint32_t rank) const {
+            if (!isBitmap())
+                return values[rank];
+            int i = 0;
+            for (; uint32_t(std::popcount(words[i])) <= rank; ++i)
+                rank -= std::popcount(words[i]);
+            auto word = words[i];
+            for (; rank > 0; --rank)
+                word &= word - 1;
+            return uint16_t(i * 64 + std::countr_zero(word));
+        }
+        void writeWords(uint64_t* out) const {
+            if (isBitmap()) {
+                memcpy(out, words.data(), BitmapWordCount * sizeof(uint64_t));
+                return;
+            }
+            memset(out, 0, BitmapWordCount * sizeof(uint64_t));
+            for (auto low : values)
+                out[low / 64] |= uint64_t(1) << (low % 64);
+        }
+        size_t sizeInBytes() const {
+            return sizeof(Container) + values.capacity() * sizeof(uint16_t) + words.capacity() * sizeof(uint64_t);
+        }
+    };
+
+    enum class Operation { And, Or, AndNot };
+
+private:
+    std::vector<Container> containers; // ascending keys, none empty
+    std::vector<uint64_t> countBefore; // ids in all containers before each one, and the total at the end
+
+#if defined(__AVX2__)
+    // Number of set bits in each 64-bit lane, from counts of nibbles looked up with a byte shuffle
+    static __m256i popcount256(__m256i v) {
+        const auto lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const auto lowNibbles = _mm256_set1_epi8(0x0f);
+        auto low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, lowNibbles));
+        auto high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibbles));
+        return _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256());
+    }
+    static uint32_t sumLanes(__m256i counts) {
+        return uint32_t(_mm256_extract_epi64(counts, 0) + _mm256_extract_epi64(counts, 1) + _mm256_extract_epi64(counts, 2) + _mm256_extract_epi64(counts, 3));
+    }
+#endif
+
+    // Combines all words of two bitmap containers into out and returns how many bits are set in out
+    template<Operation operation> static uint32_t combineWords(const uint64_t* a, const uint64_t* b, uint64_t* out) {
+#if defined(__AVX2__)
+        auto counts = _mm256_setzero_si256();
+        for (int i = 0; i < BitmapWordCount; i += 4) {
+            auto wordsA = _mm256_loadu_si256((const __m256i*)(a + i));
+            auto wordsB = _mm256_loadu_si256((const __m256i*)(b + i));
+            __m256i result;
+            if constexpr (operation == Operation::And)
+                result = _mm256_and_si256(wordsA, wordsB);
+            else if constexpr (operation == Operation::Or)
+                result = _mm256_or_si256(wordsA, wordsB);
+            else
+                result = _mm256_andnot_si256(wordsB, wordsA);
+            _mm256_storeu_si256((__m256i*)(out + i), result);
+            counts = _mm256_add_epi64(counts, popcount256(result));
+        }
+        return sumLanes(counts);
+#else
+        uint32_t count = 0;
+        for (int i = 0; i < BitmapWordCount; ++i) {
+            if constexpr (operation == Operation::And)
+                out[i] = a[i] & b[i];
+            else if constexpr (operation == Operation::Or)
+                out[i] = a[i] | b[i];
+            else
+                out[i] = a[i] & ~b[i];
+            count += std::popcount(out[i]);
+        }
+        return count;
+#endif
+    }
+
+    template<Operation operation> static Container combine(const Container& a, const Container& b) {
+        if (a.isBitmap() && b.isBitmap()) {
+            uint64_t words[BitmapWordCount];
+            auto cardinality = combineWords<operation>(a.words.data(), b.words.data(), words);
+            return fromWords(a.key, words, cardinality);
+        }
+        Container result;
+        result.key = a.key;
+        if constexpr (operation == Operation::Or) {
+            if (a.cardinality + b.cardinality > ArrayContainerMaxSize) {
+                uint64_t words[BitmapWordCount];
+                (a.isBitmap() ? a : b).writeWords(words);
+                (a.isBitmap() ? b : a).forEach([&](uint16_t low) { words[low / 64] |= uint64_t(1) << (low % 64); });
+                return fromWords(a.key, words);
+            }
+            std::set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), std::back_inserter(result.values));
+        } else if (!a.isBitmap()) { // the result is a subset of a, so it's an array too
+            for (auto low : a.values) {
+                if (b.contains(low) == (operation == Operation::And))
+                    result.values.push_back(low);
+            }
+        } else if constexpr (operation == Operation::And) {
+            for (auto low : b.values) {
+                if (a.contains(low))
+                    result.values.push_back(low);
+            }
+        } else {
+            uint64_t words[BitmapWordCount];
+            a.writeWords(words);
+            for (auto low : b.values)
+                words[low / 64] &= ~(uint64_t(1) << (low % 64));
+            return fromWords(a.key, words);
+        }
+        result.cardinality = uint32_t(result.values.size());
+        return result;
+    }
+
+    template<Operation operation> static RoaringBitmap combine(const RoaringBitmap& a, const RoaringBitmap& b) {
+        std::vector<Container> result;
+        size_t i = 0, j = 0;
+        while (i < a.containers.size() || j < b.containers.size()) {
+            bool hasA = i < a.containers.size(), hasB = j < b.containers.size();
+            if (hasA && hasB && a.containers[i].key == b.containers[j].key) {
+                result.push_back(combine<operation>(a.containers[i++], b.containers[j++]));
+            } else if (hasA && (!hasB || a.containers[i].key < b.containers[j].key)) {
+                if (operation != Operation::And)
+                    result.push_back(a.containers[i]);
+                ++i;
+            } else {
+                if (operation == Operation::Or)
+                    result.push_back(b.containers[j]);
+                ++j;
+            }
+        }
+        return RoaringBitmap(std::move(result));
+    }
+
+public:
+    RoaringBitmap() : countBefore(1, 0) {}
+    // Empty containers are dropped
+    explicit RoaringBitmap(std::vector<Container>&& newContainers) : containers(std::move(newContainers)) {
+        std::erase_if(containers, [](const Container& container) { return container.cardinality == 0; });
+        countBefore.resize(containers.size() + 1);
+        countBefore[0] = 0;
+        for (size_t i = 0; i < containers.size(); ++i)
+            countBefore[i + 1] = countBefore[i] + containers[i].cardinality;
+    }
+
+    static uint32_t countWords(const uint64_t* words) {
+#if defined(__AVX2__)
+        auto counts = _mm256_setzero_si256();
+        for (int i = 0; i < BitmapWordCount; i += 4)
+            counts = _mm256_add_epi64(counts, popcount256(_mm256_loadu_si256((const __m256i*)(words + i))));
+        return sumLanes(counts);
+#else
+        uint32_t count = 0;
+        for (int i = 0; i < BitmapWordCount; ++i)
+            count += std::popcount(words[i]);
+        return count;
+#endif
+    }
+
+    // Container with the set bits of BitmapWordCount words, in whichever form is smaller
+    static Container fromWords(uint16_t key, const uint64_t* words, uint32_t cardinality) {
+        Container result;
+        result.key = key;
+        result.cardinality = cardinality;
+        if (cardinality > ArrayContainerMaxSize) {
+            result.words.assign(words, words + BitmapWordCount);
+            return result;
+        }
+        result.values.reserve(cardinality);
+        for (int i = 0; i < BitmapWordCount; ++i) {
+            for (auto word = words[i]; word; word &= word - 1)
+                result.values.push_back(uint16_t(i * 64 + std::countr_zero(word)));
+        }
+        return result;
+    }
+    static Container fromWords(uint16_t key, const uint64_t* words) {
+        return fromWords(key, words, countWords(words));
+    }
+
+    static Container combine(const Container& a, const Container& b, Operation operation) {
+        switch (operation) {
+        case Operation::And: return combine<Operation::And>(a, b);
+        case Operation::Or: return combine<Operation::Or>(a, b);
+        case Operation::AndNot: return combine<Operation::AndNot>(a, b);
+        }
+        return {};
+    }
+    friend RoaringBitmap operator&(const RoaringBitmap& a, const RoaringBitmap& b) {
+        return combine<Operation::And>(a, b);
+    }
+    friend RoaringBitmap operator|(const RoaringBitmap& a, const RoaringBitmap& b) {
+        return combine<Operation::Or>(a, b);
+    }
+    // a AND NOT b
+    friend RoaringBitmap operator-(const RoaringBitmap& a, const RoaringBitmap& b) {
+        return combine<Operation::AndNot>(a, b);
+    }
+
+    uint64_t count() const {
+        return countBefore.back();
+    }
+    std::span<const Container> containerList() const {
+        return containers;
+    }
+    const Container* find(uint16_t key) const {
+        // sets of files usually have a container for every key, so it is tried before searching
+        if (key < containers.size() && containers[key].key == key)
+            return &containers[key];
+        auto it = std::lower_bound(containers.begin(), containers.end(), key, [](const Container& container, uint16_t key) { return container.key < key; });
+        return it != containers.end() && it->key == key ? &*it : nullptr;
+    }
+    bool contains(uint32_t id) const {
+        auto container = find(uint16_t(id >> 16));
+        return container && container->contains(uint16_t(id));
+    }
+    // Id with rank ids before it in ascending order
+    uint32_t select(uint64_t rank) const {
+        auto container = size_t(std::upper_bound(countBefore.begin(), countBefore.end(), rank) - countBefore.begin()) - 1;
+        auto& c = containers[container];
+        return (uint32_t(c.key) << 16) | c.select(uint32_t(rank - countBefore[container]));
+    }
+    // Calls f(id) in ascending order
+    template<typename F> void forEach(F f) const {
+        for (auto& container : containers) {
+            auto high = uint32_t(container.key) << 16;
+            container.forEach([&](uint16_t low) { f(high | low); });
+        }
+    }
+    size_t sizeInBytes() const {
+        size_t result = sizeof(RoaringBitmap) + countBefore.capacity() * sizeof(uint64_t);
+        for (auto& container : containers)
+            result += container.sizeInBytes();
+        return result;
+    }
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "commonFileReading.h"
+#include "utility.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+    All sort indexes hold file ids in descending order of their column, equal files ordered by id. Searching in reverse gives ascending order.
+    Ranks are the inverse: position of the file in ascending order, where files equal on the column share the same rank.
+*/
+
+// Sizes are never negative, so bits of the float compare the same way as the float itself
+static uint32_t orderedSizeKey(float size) {
+    uint32_t bits;
+    std::memcpy(&bits, &size, sizeof(bits));
+    return bits;
+}
+
+// Stable LSD radix sort of 64-bit values by bytes in [firstByte, lastByte]. Passes over bytes equal in all values are skipped.
+// tmp has to be at least count elements long
+static void radixSort(uint64_t* data, uint64_t* tmp, size_t count, int firstByte, int lastByte) {
+    uint64_t* src = data;
+    uint64_t* dst = tmp;
+    for (int byte = firstByte; byte <= lastByte && count > 0; ++byte) {
+        int shift = byte * 8;
+        std::array<size_t, 256> offsets{};
+        for (size_t i = 0; i < count; ++i)
+            offsets[(src[i] >> shift) & 0xff] += 1;
+        if (offsets[(src[0] >> shift) & 0xff] == count)
+            continue;
+        size_t sum = 0;
+        for (auto& offset : offsets) {
+            auto c = offset;
+            offset = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < count; ++i)
+            dst[offsets[(src[i] >> shift) & 0xff]++] = src[i];
+        std::swap(src, dst);
+    }
+    if (src != data)
+        std::copy(src, src + count, data);
+}
+
+// Parallel version of radixSort for any element type with a 64-bit key. Each pass counts digits per chunk,
+// computes chunk write offsets with prefix sum in (digit, chunk) order and then scatters chunks in parallel, so it stays stable
+template<typename T, typename Key> static void parallelRadixSort(std::vector<T>& data, Key key, int firstByte, int lastByte) {
+    size_t count = data.size();
+    if (count < (1 << 16)) {
+        std::vector<T> tmp(count);
+        T* src = data.data();
+        T* dst = tmp.data();
+        for (int byte = firstByte; byte <= lastByte && count > 0; ++byte) {
+            int shift = byte * 8;
+            std::array<size_t, 256> offsets{};
+            for (size_t i = 0; i < count; ++i)
+                offsets[(key(src[i]) >> shift) & 0xff] += 1;
+            if (offsets[(key(src[0]) >> shift) & 0xff] == count)
+                continue;
+            std::exclusive_scan(offsets.begin(), offsets.end(), offsets.begin(), size_t(0));
+            for (size_t i = 0; i < count; ++i)
+                dst[offsets[(key(src[i]) >> shift) & 0xff]++] = src[i];
+            std::swap(src, dst);
+        }
+        if (src != data.data())
+            data.swap(tmp);
+        return;
+    }
+
+    size_t chunkCount = std::min<size_t>(count / (1 << 15), size_t(TaskScheduler::instance().threadCount()) * 4);
+    size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+    std::vector<std::array<size_t, 256>> offsets(chunkCount);
+    std::vector<T> tmp(count);
+    for (int byte = firstByte; byte <= lastByte; ++byte) {
+        int shift = byte * 8;
+        parallelFor(0, chunkCount, [&](size_t chunk) {
+            auto& chunkOffsets = offsets[chunk];
+            chunkOffsets.fill(0);
+            for (size_t i = chunk * chunkSize; i < std::min(count, (chunk + 1) * chunkSize); ++i)
+                chunkOffsets[(key(data[i]) >> shift) & 0xff] += 1;
+        }, 1);
+        if (offsets[0][(key(data[0]) >> shift) & 0xff] == std::min(count, chunkSize)) {
+            bool allInOneDigit = true;
+            auto digit = (key(data[0]) >> shift) & 0xff;
+            for (size_t chunk = 1; chunk < chunkCount && allInOneDigit; ++chunk)
+                allInOneDigit = offsets[chunk][digit] == std::min(count, (chunk + 1) * chunkSize) - chunk * chunkSize;
+            if (allInOneDigit)
+                continue;
+        }
+        size_t sum = 0;
+        for (int digit = 0; digit < 256; ++digit) {
+            for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+                auto c = offsets[chunk][digit];
+                offsets[chunk][digit] = sum;
+                sum += c;
+            }
+        }
+        parallelFor(0, chunkCount, [&](size_t chunk) {
+            auto& chunkOffsets = offsets[chunk];
+            for (size_t i = chunk * chunkSize; i < std::min(count, (chunk + 1) * chunkSize); ++i)
+                tmp[chunkOffsets[(key(data[i]) >> shift) & 0xff]++] = data[i];
+        }, 1);
+        data.swap(tmp);
+    }
+}
+
+// Sorts ids by 32-bit keys in descending order, equal keys ordered by id
+template<typename KeyOf> static std::vector<uint32_t> createDescendingSortIndex(size_t count, KeyOf keyOf) {
+    std::vector<uint64_t> pairs(count);
+    std::vector<uint32_t> ids(count);
+    parallelFor(0, count, [&](size_t i) {
+        pairs[i] = (uint64_t(~keyOf(uint32_t(i))) << 32) | i;
+    });
+    parallelRadixSort(pairs, [](uint64_t v) { return v; }, 4, 7);
+    parallelFor(0, count, [&](size_t i) {
+        ids[i] = uint32_t(pairs[i]);
+    });
+    return ids;
+}
+
+static std::vector<uint32_t> createDateSortIndex(const FileList& fileList) {
+    auto& files = fileList.files;
+    return createDescendingSortIndex(files.size(), [&](uint32_t i) { return files[i].lastModificationDateInMinutes; });
+}
+static std::vector<uint32_t> createSizeSortIndex(const FileList& fileList) {
+    auto& files = fileList.files;
+    return createDescendingSortIndex(files.size(), [&](uint32_t i) { return orderedSizeKey(files[i].size); });
+}
+
+// First 8 bytes of the string starting at depth, big-endian so that integer order is the same as strcmp order.
+// Bytes after the terminator are 0
+static uint64_t namePrefix(const char* str, int depth) {
+    for (int i = 0; i < depth; ++i) {
+        if (!str[i])
+            return 0;
+    }
+    uint64_t prefix = 0;
+    int i = 0;
+    for (; i < 8 && str[depth + i]; ++i)
+        prefix = (prefix << 8) | uint8_t(str[depth + i]);
+    return prefix << ((8 - i) * 8);
+}
+static bool prefixContainsTerminator(uint64_t prefix) {
+    return (prefix & 0xff) == 0;
+}
+
+/*
+    Many files share the same name and the name table stores each of them once, so only distinct names are sorted.
+    They are radix sorted by their 8-byte prefix and only runs with equal prefixes are compared further.
+    Files are then ordered by the dense rank of their name, which is also returned as nameRanks
+*/
+static std::vector<uint32_t> createNameSortIndex(const FileList& fileList, std::span<const char> lowerNameTable, std::vector<uint32_t>& nameRanks) {
+    auto& files = fileList.files;
+    auto referenceCount = lowerNameTable.size() >> NameAlignmentShift;
+    DynamicBitset isNameUsed(referenceCount);
+    for (auto& file : files)
+        isNameUsed.set(file.nameReference());
+    // position of a name in nameReferences is the number of used references before it
+    auto wordCount = referenceCount / DynamicBitset::IntTypeBitSize + 1;
+    std::vector<uint32_t> usedBeforeWord(wordCount);
+    std::vector<uint32_t> nameReferences;
+    nameReferences.reserve(isNameUsed.count(referenceCount));
+    for (size_t word = 0; word < wordCount; ++word) {
+        usedBeforeWord[word] = uint32_t(nameReferences.size());
+        for (auto bits = isNameUsed.bits[word]; bits; bits &= bits - 1)
+            nameReferences.push_back(uint32_t(word * DynamicBitset::IntTypeBitSize + std::countr_zero(bits)));
+    }
+
+    struct DistinctName {
+        uint64_t prefix;
+        uint32_t nameId; // position in nameReferences
+        uint32_t rank;
+    };
+    std::vector<DistinctName> names(nameReferences.size());
+    parallelFor(0, names.size(), [&](size_t i) {
+        names[i] = { namePrefix(nameAt(lowerNameTable, nameReferences[i]), 0), uint32_t(i), 0 };
+    });
+    parallelRadixSort(names, [](const DistinctName& n) { return n.prefix; }, 0, 7);
+
+    // runs of names with the same prefix that continue past it
+    std::vector<std::pair<uint32_t, uint32_t>> tiedRuns;
+    for (uint32_t i = 0; i < names.size();) {
+        uint32_t j = i + 1;
+        while (j < names.size() && names[j].prefix == names[i].prefix)
+            ++j;
+        if (j - i > 1 && !prefixContainsTerminator(names[i].prefix))
+            tiedRuns.emplace_back(i, j);
+        i = j;
+    }
+    parallelFor(0, tiedRuns.size(), [&](size_t i) {
+        auto run = tiedRuns[i];
+        std::sort(names.begin() + run.first, names.begin() + run.second, [&](auto& a, auto& b) {
+            auto cmp = std::strcmp(nameAt(lowerNameTable, nameReferences[a.nameId]) + 8, nameAt(lowerNameTable, nameReferences[b.nameId]) + 8);
+            return cmp != 0 ? cmp < 0 : a.nameId < b.nameId;
+        });
+    }, 64);
+
+    std::vector<uint32_t> rankOfName(names.size());
+    uint32_t rank = 0;
+    for (uint32_t i = 0; i < names.size(); ++i) {
+        if (i > 0 && (names[i].prefix != names[i - 1].prefix
+            || (!prefixContainsTerminator(names[i].prefix) && std::strcmp(nameAt(lowerNameTable, nameReferences[names[i].nameId]) + 8, nameAt(lowerNameTable, nameReferences[names[i - 1].nameId]) + 8))))
+            rank += 1;
+        rankOfName[names[i].nameId] = rank;
+    }
+
+    nameRanks.resize(files.size());
+    parallelFor(0, files.size(), [&](size_t i) {
+        auto reference = files[i].nameReference();
+        auto word = reference / DynamicBitset::IntTypeBitSize;
+        auto lowerBits = isNameUsed.bits[word] & ((1ull << (reference % DynamicBitset::IntTypeBitSize)) - 1);
+        nameRanks[i] = rankOfName[usedBeforeWord[word] + std::popcount(lowerBits)];
+    });
+    return createDescendingSortIndex(files.size(), [&](uint32_t i) { return nameRanks[i]; });
+}
+
+// Pre-order DFS over the directory tree with siblings ordered by lowercase name visits files in full path order,
+// so the index is built without creating any path strings
+static std::vector<uint32_t> createPathSortIndex(const FileList& fileList, std::span<const char> lowerNameTable) {
+    auto& files = fileList.files;
+    auto fileCount = uint32_t(files.size());
+
+    auto tree = createDirectoryChildren(files);
+    auto& childrenBegin = tree.childrenBegin;
+    auto& children = tree.children;
+
+    std::vector<uint32_t> dirsWithManyChildren;
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        if (childrenBegin[i + 1] - childrenBegin[i] > 1)
+            dirsWithManyChildren.push_back(i);
+    }
+    parallelFor(0, dirsWithManyChildren.size(), [&](size_t dirPos) {
+        auto dir = dirsWithManyChildren[dirPos];
+        std::sort(children.begin() + childrenBegin[dir], children.begin() + childrenBegin[dir + 1], [&](auto i, auto j) {
+            auto cmp = files[i].getName(lowerNameTable).compare(files[j].getName(lowerNameTable));
+            return cmp != 0 ? cmp < 0 : i < j;
+        });
+    }, 64);
+
+    // like other indexes it's stored in descending order, so it's filled from the back
+    std::vector<uint32_t> pathIndex(fileCount);
+    DynamicBitset visited(files.size());
+    uint32_t pos = fileCount;
+    std::vector<uint32_t> stack;
+    if (fileCount > 0)
+        stack.push_back(0);
+    while (!stack.empty()) {
+        auto dir = stack.back();
+        stack.pop_back();
+        if (visited.test(dir))
+            continue;
+        visited.set(dir);
+        pathIndex[--pos] = dir;
+        for (auto i = childrenBegin[dir + 1]; i > childrenBegin[dir]; --i)
+            stack.push_back(children[i - 1]);
+    }
+    // files not reachable from root (broken parent links) go after everything else
+    for (uint32_t i = 0; i < fileCount; ++i) {
+        if (!visited.test(i))
+            pathIndex[--pos] = i;
+    }
+    return pathIndex;
+}
+
+// Offset of the lowercase extension of each file in lowerNameTable. Files without extension point to the name terminator
+static std::vector<uint64_t> createExtensionOffsets(const FileList& fileList, std::span<const char> lowerNameTable) {
+    auto& files = fileList.files;
+    std::vector<uint64_t> extensionOffsets(files.size());
+    parallelFor(0, files.size(), [&](size_t i) {
+        std::string_view name(files[i].getName(lowerNameTable));
+        auto extension = files[i].isDir() ? std::string_view() : fileNameExtension(name);
+        extensionOffsets[i] = uint64_t((extension.empty() ? name.data() + name.size() : extension.data()) - lowerNameTable.data());
+    });
+    return extensionOffsets;
+}
+static std::vector<uint32_t> createExtensionSortIndex(const FileList& fileList, std::span<const char> lowerNameTable, const std::vector<uint64_t>& extensionOffsets) {
+    std::vector<uint32_t> extensionIndex(fileList.files.size());
+    std::iota(extensionIndex.begin(), extensionIndex.end(), uint32_t(0));
+    parallelSort(extensionIndex.begin(), extensionIndex.end(), [&](auto i, auto j) {
+        auto cmp = std::strcmp(&lowerNameTable[extensionOffsets[i]], &lowerNameTable[extensionOffsets[j]]);
+        return cmp != 0 ? cmp > 0 : i < j;
+    });
+    return extensionIndex;
+}
+
+template<typename IsEqual> static std::vector<uint32_t> createDenseRanks(std::span<const uint32_t> sortIndex, IsEqual isEqual) {
+    std::vector<uint32_t> ranks(sortIndex.size());
+    uint32_t rank = 0;
+    for (auto i = sortIndex.size(); i > 0; --i) {
+        if (i < sortIndex.size() && !isEqual(sortIndex[i], sortIndex[i - 1]))
+            rank += 1;
+        ranks[sortIndex[i - 1]] = rank;
+    }
+    return ranks;
+}
+static std::vector<uint32_t> createExtensionRanks(std::span<const char> lowerNameTable, const std::vector<uint64_t>& extensionOffsets, std::span<const uint32_t> extensionSortIndex) {
+    return createDenseRanks(extensionSortIndex, [&](auto i, auto j) {
+        return !std::strcmp(&lowerNameTable[extensionOffsets[i]], &lowerNameTable[extensionOffsets[j]]);
+    });
+}
+// paths are unique, so it's just an inverse permutation
+static std::vector<uint32_t> createPathRanks(std::span<const uint32_t> pathSortIndex) {
+    std::vector<uint32_t> ranks(pathSortIndex.size());
+    for (uint32_t i = 0; i < pathSortIndex.size(); ++i)
+        ranks[pathSortIndex[i]] = uint32_t(pathSortIndex.size() - 1 - i);
+    return ranks;
+}
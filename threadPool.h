@@ -0,0 +1,570 @@
+#pragma once
+
+#include "windowsInclude.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+    Work-stealing task scheduler shared by the whole program (MFT parsing, crawling, searching, index building).
+    Every worker owns a Chase-Lev deque per priority: it pushes and pops at the bottom, idle workers steal from the top.
+    Tasks submitted from other threads go through shared injection queues, in bulk when possible.
+    Interactive tasks (search) are always taken before background ones (refresh), a few workers can be reserved
+    for interactive tasks only, and long background loops call yieldToInteractive() between chunks.
+    ThreadPool is a group of tasks on this scheduler that can be waited for.
+*/
+
+class ThreadPool;
+
+// Type erased callable stored inline when it's small and trivially copyable (most lambdas capturing references),
+// otherwise on the heap. The task itself is always trivially copyable, so deques can copy it without locks
+class Task {
+    static constexpr size_t StorageSize = 48;
+    using Invoke = void (*)(Task& task, bool shouldRun);
+
+    Invoke invoke = nullptr;
+    ThreadPool* group = nullptr;
+    uint32_t generation = 0;
+    alignas(8) unsigned char storage[StorageSize];
+
+public:
+    template<typename F> static Task create(F&& function, ThreadPool* group, uint32_t generation) {
+        using Function = std::decay_t<F>;
+        Task task;
+        task.group = group;
+        task.generation = generation;
+        if constexpr (sizeof(Function) <= StorageSize && alignof(Function) <= 8 && std::is_trivially_copyable_v<Function>) {
+            new (task.storage) Function(std::forward<F>(function));
+            task.invoke = [](Task& task, bool shouldRun) {
+                if (shouldRun)
+                    (*std::launder(reinterpret_cast<Function*>(task.storage)))();
+            };
+        } else {
+            auto heapFunction = new Function(std::forward<F>(function));
+            std::memcpy(task.storage, &heapFunction, sizeof(heapFunction));
+            task.invoke = [](Task& task, bool shouldRun) {
+                Function* heapFunction;
+                std::memcpy(&heapFunction, task.storage, sizeof(heapFunction));
+                if (shouldRun)
+                    (*heapFunction)();
+                delete heapFunction;
+            };
+        }
+        return task;
+    }
+
+    inline void run();
+};
+static_assert(std::is_trivially_copyable_v<Task>);
+
+// Chase-Lev deque (with memory orderings from "Correct and Efficient Work-Stealing for Weak Memory Models").
+// Slots are stored as relaxed atomic words, because a thief can read a slot the owner is overwriting (it then fails the CAS).
+// Buffers replaced when growing are kept until destruction, because thieves might still read them
+class WorkStealingDeque {
+    static constexpr size_t WordsPerTask = sizeof(Task) / sizeof(uint64_t);
+    static_assert(sizeof(Task) % sizeof(uint64_t) == 0);
+
+    struct Buffer {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+        Buffer(int64_t capacity) : capacity(capacity), words(new std::atomic<uint64_t>[capacity * WordsPerTask]) {}
+        void put(int64_t i, const Task& task) {
+            uint64_t taskWords[WordsPerTask];
+            std::memcpy(taskWords, &task, sizeof(Task));
+            auto slot = &words[(i & (capacity - 1)) * WordsPerTask];
+            for (size_t w = 0; w < WordsPerTask; ++w)
+                slot[w].store(taskWords[w], std::memory_order_relaxed);
+        }
+        Task get(int64_t i) const {
+            uint64_t taskWords[WordsPerTask];
+            auto slot = &words[(i & (capacity - 1)) * WordsPerTask];
+            for (size_t w = 0; w < WordsPerTask; ++w)
+                taskWords[w] = slot[w].load(std::memory_order_relaxed);
+            Task task;
+            std::memcpy(&task, taskWords, sizeof(Task));
+            return task;
+        }
+    };
+
+    alignas(64) std::atomic<int64_t> top = 0;
+    alignas(64) std::atomic<int64_t> bottom = 0;
+    std::atomic<Buffer*> buffer;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+
+public:
+    WorkStealingDeque() {
+        buffers.emplace_back(std::make_unique<Buffer>(1024));
+        buffer = buffers.back().get();
+    }
+
+    // Only the owner
+    void push(const Task& task) {
+        auto b = bottom.load(std::memory_order_relaxed);
+        auto t = top.load(std::memory_order_acquire);
+        auto a = buffer.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            buffers.emplace_back(std::make_unique<Buffer>(a->capacity * 2));
+            for (auto i = t; i < b; ++i)
+                buffers.back()->put(i, a->get(i));
+            a = buffers.back().get();
+            buffer.store(a, std::memory_order_release);
+        }
+        a->put(b, task);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // Only the owner
+    bool pop(Task& task) {
+        auto b = bottom.load(std::memory_order_relaxed) - 1;
+        auto a = buffer.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        task = a->get(b);
+        if (t == b) {
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread
+    bool steal(Task& task) {
+        auto t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return false;
+        auto a = buffer.load(std::memory_order_acquire);
+        task = a->get(t);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    int64_t sizeEstimate() const {
+        return std::max<int64_t>(bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed), 0);
+    }
+};
+
+enum class TaskPriority {
+    Interactive = 0, // searching, anything the user waits for
+    Background = 1 // parsing MFT, crawling, building indexes
+};
+constexpr inline int TaskPriorityCount = 2;
+
+class TaskScheduler {
+    struct Worker {
+        WorkStealingDeque deques[TaskPriorityCount];
+        std::thread thread;
+        bool isReserved = false; // runs only interactive tasks
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex injectedTasksMutex;
+    std::deque<Task> injectedTasks[TaskPriorityCount];
+    std::atomic<int64_t> injectedTaskCount[TaskPriorityCount] = {};
+    std::atomic<int64_t> queuedInteractiveTaskCount = 0;
+
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondVar;
+    std::condition_variable reservedSleepCondVar;
+    std::atomic<int> sleepingWorkerCount = 0;
+    uint64_t wakeUpCount = 0;
+    bool stopping = false;
+
+    static inline std::atomic<int> configuredThreadCount = 0;
+    static inline std::atomic<int> configuredReservedThreadCount = -1;
+    static inline thread_local Worker* currentWorker = nullptr;
+    static inline thread_local TaskPriority currentPriority = TaskPriority::Background;
+    static inline thread_local uint32_t randomState = 0;
+
+    TaskScheduler(int threadCount, int reservedThreadCount) {
+        for (int i = 0; i < threadCount; ++i) {
+            workers.emplace_back(std::make_unique<Worker>());
+            workers.back()->isReserved = i >= threadCount - reservedThreadCount;
+        }
+        for (int i = 0; i < threadCount; ++i) {
+            workers[i]->thread = std::thread(&TaskScheduler::workerThread, this, workers[i].get());
+            if (workers[i]->isReserved)
+                setInteractiveThreadAffinity(workers[i]->thread, i);
+        }
+    }
+
+    // Reserved workers get the last cores and higher OS priority, so background threads don't preempt them
+    static void setInteractiveThreadAffinity(std::thread& thread, int core) {
+        if (core < 64)
+            SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << core);
+        SetThreadPriority(thread.native_handle(), THREAD_PRIORITY_ABOVE_NORMAL);
+    }
+
+    uint32_t nextRandom() {
+        if (randomState == 0)
+            randomState = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return randomState;
+    }
+
+    bool takeInjectedTask(Task& task, int priority) {
+        if (injectedTaskCount[priority].load(std::memory_order_relaxed) == 0)
+            return false;
+        std::lock_guard l{ injectedTasksMutex };
+        if (injectedTasks[priority].empty())
+            return false;
+        task = injectedTasks[priority].front();
+        injectedTasks[priority].pop_front();
+        injectedTaskCount[priority].fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool findTask(Task& task, int priority) {
+        bool found = [&] {
+            if (currentWorker && currentWorker->deques[priority].pop(task))
+                return true;
+            if (takeInjectedTask(task, priority))
+                return true;
+            auto start = nextRandom();
+            for (size_t i = 0; i < workers.size(); ++i) {
+                auto& victim = workers[(start + i) % workers.size()];
+                if (victim.get() != currentWorker && victim->deques[priority].steal(task))
+                    return true;
+            }
+            return false;
+        }();
+        if (found && priority == int(TaskPriority::Interactive))
+            queuedInteractiveTaskCount.fetch_sub(1, std::memory_order_relaxed);
+        return found;
+    }
+
+    // Interactive tasks always go first. Reserved workers never take background ones
+    bool findTask(Task& task) {
+        if (findTask(task, int(TaskPriority::Interactive)))
+            return true;
+        return !(currentWorker && currentWorker->isReserved) && findTask(task, int(TaskPriority::Background));
+    }
+
+    bool hasQueuedTasks(bool interactiveOnly) const {
+        for (int priority = 0; priority < (interactiveOnly ? 1 : TaskPriorityCount); ++priority) {
+            if (injectedTaskCount[priority].load() > 0)
+                return true;
+            for (auto& worker : workers) {
+                if (worker->deques[priority].sizeEstimate() > 0)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    void wakeUpWorkers(TaskPriority priority, bool all) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepingWorkerCount.load() == 0)
+            return;
+        {
+            std::lock_guard l{ sleepMutex };
+            wakeUpCount += 1;
+        }
+        if (all) {
+            sleepCondVar.notify_all();
+        } else {
+            sleepCondVar.notify_one();
+        }
+        if (priority == TaskPriority::Interactive)
+            reservedSleepCondVar.notify_all();
+    }
+
+    void workerThread(Worker* worker) {
+        currentWorker = worker;
+        Task task;
+        while (true) {
+            if (findTask(task)) {
+                task.run();
+                continue;
+            }
+            std::unique_lock l{ sleepMutex };
+            if (stopping)
+                return;
+            sleepingWorkerCount.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!hasQueuedTasks(worker->isReserved)) {
+                auto seenWakeUpCount = wakeUpCount;
+                (worker->isReserved ? reservedSleepCondVar : sleepCondVar).wait(l, [&] { return wakeUpCount != seenWakeUpCount || stopping; });
+            }
+            sleepingWorkerCount.fetch_sub(1);
+        }
+    }
+
+public:
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+    ~TaskScheduler() {
+        {
+            std::lock_guard l{ sleepMutex };
+            stopping = true;
+        }
+        sleepCondVar.notify_all();
+        reservedSleepCondVar.notify_all();
+        for (auto& worker : workers)
+            worker->thread.join();
+    }
+
+    // Sets number of worker threads (0 for one per core) and how many of them only run interactive tasks
+    // (-1 for one when there are at least 4 workers). Has effect only before the scheduler is first used
+    static void configure(int threadCount, int reservedInteractiveThreadCount = -1) {
+        configuredThreadCount = threadCount;
+        configuredReservedThreadCount = reservedInteractiveThreadCount;
+    }
+
+    static TaskScheduler& instance() {
+        static TaskScheduler scheduler = [] {
+            int threadCount = configuredThreadCount;
+            if (threadCount <= 0)
+                threadCount = std::max(int(std::thread::hardware_concurrency()), 1);
+            int reservedThreadCount = configuredReservedThreadCount;
+            if (reservedThreadCount < 0)
+                reservedThreadCount = threadCount >= 4 ? 1 : 0;
+            // at least one worker has to run background tasks
+            reservedThreadCount = std::clamp(reservedThreadCount, 0, threadCount - 1);
+            return TaskScheduler(threadCount, reservedThreadCount);
+        }();
+        return scheduler;
+    }
+
+    int threadCount() const {
+        return int(workers.size());
+    }
+
+    static bool isWorkerThread() {
+        return currentWorker != nullptr;
+    }
+
+    // Priority of the task running on the calling thread, used by groups created without explicit priority
+    static TaskPriority runningTaskPriority() {
+        return currentPriority;
+    }
+
+    // Marks work done by a thread outside of the scheduler (like the search thread) as interactive or background
+    static void setCurrentThreadTaskPriority(TaskPriority priority) {
+        currentPriority = priority;
+    }
+
+    // Number of tasks of given priority waiting in the deque of the calling worker
+    static int64_t localQueueSize(TaskPriority priority) {
+        return currentWorker ? currentWorker->deques[int(priority)].sizeEstimate() : 0;
+    }
+
+    void submit(const Task* tasks, size_t count, TaskPriority priority) {
+        if (count == 0)
+            return;
+        if (priority == TaskPriority::Interactive)
+            queuedInteractiveTaskCount.fetch_add(count, std::memory_order_relaxed);
+        if (currentWorker) {
+            // owner pops from the bottom, so pushing in reverse keeps submission order
+            for (size_t i = count; i > 0; --i)
+                currentWorker->deques[int(priority)].push(tasks[i - 1]);
+        } else {
+            std::lock_guard l{ injectedTasksMutex };
+            injectedTasks[int(priority)].insert(injectedTasks[int(priority)].end(), tasks, tasks + count);
+            injectedTaskCount[int(priority)].fetch_add(count, std::memory_order_relaxed);
+        }
+        wakeUpWorkers(priority, count > 1);
+    }
+
+    // Runs one queued task on the calling thread. Returns false if there was none
+    bool runOneTask() {
+        Task task;
+        if (!findTask(task))
+            return false;
+        task.run();
+        return true;
+    }
+
+    /*
+        Called by background work at chunk boundaries. Runs queued interactive tasks first, so a search started
+        during a refresh doesn't wait for whole background tasks to finish. Cheap when there is nothing to run
+    */
+    static void yieldToInteractive() {
+        if (!currentWorker || currentPriority == TaskPriority::Interactive)
+            return;
+        auto& scheduler = instance();
+        Task task;
+        while (scheduler.queuedInteractiveTaskCount.load(std::memory_order_relaxed) > 0 && scheduler.findTask(task, int(TaskPriority::Interactive)))
+            task.run();
+    }
+
+    friend class Task;
+};
+
+/*
+    Group of tasks on the shared scheduler. wait() returns once all tasks added so far are done.
+    Worker threads keep running other tasks while they wait, so nested groups can't deadlock.
+*/
+class ThreadPool {
+    friend class Task;
+
+    std::atomic<int64_t> pendingTaskCount = 0;
+    std::atomic<uint32_t> generation = 0;
+    std::mutex doneMutex;
+    std::condition_variable doneCondVar;
+    std::vector<std::shared_ptr<const void>> bulkFunctions; // shared by tasks from addTasks, released in wait()
+    TaskPriority priority;
+
+    // The last task decrements the count while holding doneMutex, so wait() can't return (and the group
+    // can't be destroyed) before that task stops touching it
+    void taskDone() {
+        auto count = pendingTaskCount.load(std::memory_order_relaxed);
+        while (count > 1) {
+            if (pendingTaskCount.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+                return;
+        }
+        std::lock_guard l{ doneMutex };
+        if (pendingTaskCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            doneCondVar.notify_all();
+    }
+
+public:
+    explicit ThreadPool(TaskPriority priority = TaskScheduler::runningTaskPriority()) : priority(priority) {}
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+    ~ThreadPool() {
+        wait();
+    }
+
+    template<typename F> void addTask(F&& task) {
+        pendingTaskCount.fetch_add(1, std::memory_order_relaxed);
+        auto t = Task::create(std::forward<F>(task), this, generation.load(std::memory_order_relaxed));
+        TaskScheduler::instance().submit(&t, 1, priority);
+    }
+
+    // Adds task(i) for every i in [0, count) with one submission
+    template<typename F> void addTasks(int count, const F& task) {
+        if (count <= 0)
+            return;
+        pendingTaskCount.fetch_add(count, std::memory_order_relaxed);
+        auto function = std::make_shared<const F>(task);
+        {
+            std::lock_guard l{ doneMutex };
+            bulkFunctions.push_back(function);
+        }
+        std::vector<Task> tasks;
+        tasks.reserve(count);
+        auto currentGeneration = generation.load(std::memory_order_relaxed);
+        for (int i = 0; i < count; ++i)
+            tasks.push_back(Task::create([i, function = function.get()]() { (*function)(i); }, this, currentGeneration));
+        TaskScheduler::instance().submit(tasks.data(), tasks.size(), priority);
+    }
+
+    // Tasks added before this call and not started yet are skipped. Running ones are not interrupted
+    void clearQueuedTasks() {
+        generation.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TaskPriority taskPriority() const {
+        return priority;
+    }
+
+    void wait() {
+        if (TaskScheduler::isWorkerThread()) {
+            while (pendingTaskCount.load(std::memory_order_acquire) > 0) {
+                if (!TaskScheduler::instance().runOneTask())
+                    std::this_thread::yield();
+            }
+        }
+        std::unique_lock l{ doneMutex };
+        doneCondVar.wait(l, [this] { return pendingTaskCount.load(std::memory_order_acquire) == 0; });
+        bulkFunctions.clear();
+    }
+};
+
+inline void Task::run() {
+    auto taskGroup = group;
+    auto previousPriority = std::exchange(TaskScheduler::currentPriority, taskGroup->priority);
+    invoke(*this, generation == taskGroup->generation.load(std::memory_order_relaxed));
+    TaskScheduler::currentPriority = previousPriority;
+    taskGroup->taskDone();
+}
+
+/*
+    Calls function(i) for every i in [begin, end). The range is split lazily: a task keeps handing off the second half
+    of its range while its worker has nothing else queued, so the grain adapts to how busy the workers are.
+    Runs with the priority of the calling task; background loops let interactive tasks in after every grain
+*/
+template<typename F> void parallelFor(size_t begin, size_t end, const F& function, size_t minGrainSize = 1024) {
+    if (begin >= end)
+        return;
+    auto& scheduler = TaskScheduler::instance();
+    if (end - begin <= minGrainSize || scheduler.threadCount() == 1) {
+        for (auto i = begin; i < end; ++i) {
+            function(i);
+            if ((i - begin) % minGrainSize == minGrainSize - 1)
+                TaskScheduler::yieldToInteractive();
+        }
+        return;
+    }
+    ThreadPool group;
+    struct Range {
+        static void run(ThreadPool& group, const F& function, size_t begin, size_t end, size_t minGrainSize) {
+            while (begin < end) {
+                if (end - begin > 2 * minGrainSize && TaskScheduler::localQueueSize(group.taskPriority()) == 0) {
+                    auto middle = begin + (end - begin) / 2;
+                    group.addTask([&group, &function, middle, end, minGrainSize]() { run(group, function, middle, end, minGrainSize); });
+                    end = middle;
+                }
+                auto chunkEnd = std::min(end, begin + minGrainSize);
+                for (auto i = begin; i < chunkEnd; ++i)
+                    function(i);
+                begin = chunkEnd;
+                TaskScheduler::yieldToInteractive();
+            }
+        }
+    };
+    // a few initial pieces so that all workers can start right away
+    size_t pieceCount = std::min<size_t>(scheduler.threadCount(), (end - begin) / minGrainSize);
+    size_t pieceSize = (end - begin) / pieceCount;
+    group.addTasks(int(pieceCount), [&](int piece) {
+        auto pieceBegin = begin + piece * pieceSize;
+        auto pieceEnd = piece + 1 == pieceCount ? end : pieceBegin + pieceSize;
+        Range::run(group, function, pieceBegin, pieceEnd, minGrainSize);
+    });
+    group.wait();
+}
+
+// Sorts pieces of the range in parallel and merges them pairwise. Pieces are small enough to let interactive tasks in between them
+template<typename It, typename Compare> void parallelSort(It first, It last, Compare compare, size_t minPieceSize = 16 * 1024) {
+    size_t count = last - first;
+    size_t pieceCount = std::max<size_t>(TaskScheduler::instance().threadCount() * 4, count / (256 * 1024));
+    pieceCount = std::min(pieceCount, count / minPieceSize);
+    if (pieceCount <= 1) {
+        std::sort(first, last, compare);
+        return;
+    }
+    auto pieceBegin = [&](size_t piece) { return first + std::min(piece, pieceCount) * count / pieceCount; };
+    parallelFor(0, pieceCount, [&](size_t piece) {
+        std::sort(pieceBegin(piece), pieceBegin(piece + 1), compare);
+    }, 1);
+    for (size_t width = 1; width < pieceCount; width *= 2) {
+        parallelFor(0, (pieceCount + 2 * width - 1) / (2 * width), [&](size_t pair) {
+            auto begin = pair * 2 * width;
+            if (begin + width < pieceCount)
+                std::inplace_merge(pieceBegin(begin), pieceBegin(begin + width), pieceBegin(begin + 2 * width), compare);
+        }, 1);
+    }
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "threadPool.h"
 #include "windowsInclude.h"
 #include <chrono>
 #include <cstdint>
@@ -8,11 +9,16 @@
 #include <immintrin.h>
 #include <vector>
 #include <atomic>
+#include <bit>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
 #include <iostream>
+#include <cstring>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
 
 #if defined(__clang__)
 #define COMPILER_CLANG
@@ -24,109 +30,6 @@
 #define COMPILER_GCC
 #endif
 
-class ThreadPoolAsync {
-    std::vector<std::future<void>> tasks;
-    std::vector<std::shared_future<void>> sharedTasks;
-public:
-    std::shared_future<void> addSharedTask(std::function<void(void)> task) {
-        return sharedTasks.emplace_back(std::async(std::launch::async, task).share());
-    }
-    void addTask(std::function<void(void)> task) {
-        tasks.emplace_back(std::async(std::launch::async, task));
-    }
-    void wait() {
-        for (auto& task : tasks)
-            task.wait();
-        for (auto& task : sharedTasks)
-            task.wait();
-        tasks.clear();
-        sharedTasks.clear();
-    }
-};
-
-
-class ThreadPool {
-    std::condition_variable taskInQueueOrAbortCondVar;
-    std::condition_variable taskDoneCondVar;
-    std::queue<std::function<void()>> tasks;
-    int activeTasksCount = 0;
-    std::mutex tasksMutex;
-    std::vector<std::thread> threads;
-    bool waiting = false;
-    bool active = false;
-
-    void workerThread() {
-        std::unique_lock tasksLock(tasksMutex);
-        while (true) {
-            activeTasksCount -= 1;
-            tasksLock.unlock();
-            if (waiting && activeTasksCount == 0 && tasks.empty())
-                taskDoneCondVar.notify_all();
-            tasksLock.lock();
-            taskInQueueOrAbortCondVar.wait(tasksLock, [this] {
-                return !tasks.empty() || !active;
-            });
-            if (!active)
-                break;
-            {
-                const std::function<void()> task = std::move(tasks.front());
-                tasks.pop();
-                activeTasksCount += 1;
-                tasksLock.unlock();
-                task();
-            }
-            tasksLock.lock();
-        }
-    }
-
-public:
-    ThreadPool(int threadCount = 0) {
-        if (threadCount <= 0) {
-            threadCount = (std::thread::hardware_concurrency() > 0) ? std::thread::hardware_concurrency() : 1;
-        }
-        activeTasksCount = threadCount;
-        active = true;
-        for (int i = 0; i < threadCount; ++i) {
-            threads.emplace_back(std::thread(&ThreadPool::workerThread, this));
-        }
-    }
-
-    ThreadPool(const ThreadPool&) = delete;
-    ThreadPool(ThreadPool&&) = delete;
-    ThreadPool& operator=(const ThreadPool&) = delete;
-    ThreadPool& operator=(ThreadPool&&) = delete;
-
-    ~ThreadPool() {
-        wait();
-        {
-            const std::scoped_lock tasks_lock(tasksMutex);
-            active = false;
-        }
-        taskInQueueOrAbortCondVar.notify_all();
-        for (int i = 0; i < threads.size(); ++i) {
-            threads[i].join();
-        }
-    }
-
-    template<typename F> void addTask(F&& task) {
-        {
-            std::scoped_lock tasks_lock(tasksMutex);
-            tasks.emplace(std::forward<F>(task));
-        }
-        taskInQueueOrAbortCondVar.notify_one();
-    }
-
-    void wait() {
-        std::unique_lock tasks_lock(tasksMutex);
-        waiting = true;
-        taskDoneCondVar.wait(tasks_lock, [this] {
-            return activeTasksCount == 0 && tasks.empty();
-        });
-        waiting = false;
-    }
-}; 
-
-
 template<typename T> bool isRunning(const std::future<T>& f) {
     return f.valid() && f.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
 }
@@ -151,7 +54,7 @@ struct DynamicBitset {
     IntType* bits;
 
     DynamicBitset() : bits(nullptr) {}
-    DynamicBitset(int size) {
+    DynamicBitset(size_t size) {
         bits = (IntType*)calloc(1, (size + IntTypeBitSize) / 8);
     }
     DynamicBitset(const DynamicBitset&) = delete;
@@ -159,18 +62,24 @@ struct DynamicBitset {
     ~DynamicBitset() {
         free(bits);
     }
-    void init(int size) {
+    void init(size_t size) {
         free(bits);
         bits = (IntType*)calloc(1, (size + IntTypeBitSize) / 8);
     }
-    bool test(int i) const {
+    bool test(size_t i) const {
         return bits[i / IntTypeBitSize] & singleBit(i);
     }
-    void set(int i) {
+    void set(size_t i) {
         bits[i / IntTypeBitSize] |= singleBit(i);
     }
+    size_t count(size_t size) const {
+        size_t result = 0;
+        for (size_t i = 0; i < (size + IntTypeBitSize - 1) / IntTypeBitSize; ++i)
+            result += std::popcount(bits[i]);
+        return result;
+    }
 private:
-    IntType singleBit(int i) const {
+    IntType singleBit(size_t i) const {
         return (1ull << (i % IntTypeBitSize));
     }
 };
@@ -227,7 +136,7 @@ static uint64_t mostSignificantBitPosition(uint64_t a) {
 #endif
 }
 
-static void fastBigStringToLower(char* str, int size) {
+static void fastBigStringToLower(char* str, size_t size) {
 #if defined(__AVX2__)
     const auto asciiA = _mm256_set1_epi8('A' - 1);
     const auto asciiZ = _mm256_set1_epi8('Z' + 1);
@@ -272,6 +181,38 @@ static void fastBigStringToLower(char* str, int size) {
 }
 
 
+/*
+    64-bit checksum for detecting corrupted files, not a cryptographic hash. Input is consumed by four independent
+    multiply-rotate lanes (the same rounds as xxHash64), so it runs at about memory speed
+*/
+static uint64_t checksum64(const void* data, size_t size) {
+    constexpr uint64_t Prime1 = 0x9e3779b185ebca87ull;
+    constexpr uint64_t Prime2 = 0xc2b2ae3d27d4eb4full;
+    auto round = [](uint64_t accumulator, uint64_t value) { return std::rotl(accumulator + value * Prime2, 31) * Prime1; };
+    auto bytes = (const char*)data;
+    uint64_t lanes[4] = { Prime1 + Prime2, Prime2, 0, 0 - Prime1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; ++lane) {
+            uint64_t value;
+            memcpy(&value, bytes + i + lane * 8, sizeof(value));
+            lanes[lane] = round(lanes[lane], value);
+        }
+    }
+    uint64_t hash = std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) + std::rotl(lanes[2], 12) + std::rotl(lanes[3], 18) + size;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t value;
+        memcpy(&value, bytes + i, sizeof(value));
+        hash = round(hash, value);
+    }
+    for (; i < size; ++i)
+        hash = round(hash, uint8_t(bytes[i]));
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
 template<typename T> void atomicMax(std::atomic<T>& max, T newVal) {
     auto curMax = max.load();
     while (std::max(newVal, curMax) != curMax) {
@@ -285,22 +226,22 @@ template<typename T> struct ThreadSafeVec {
 
     FastSmallVector<std::unique_ptr<std::vector<T>>, 32> blocks;
     int blockCount;
-    int totalCapacity;
+    size_t totalCapacity;
     std::mutex mutex;
 
     ThreadSafeVec() : totalCapacity(1 << smallestPower2) {
         blocks.emplace_back(std::make_unique<std::vector<T>>(totalCapacity));
         blockCount = 1;
     }
-    std::pair<int, int> getBlockIdAndPosInBlock(int i) {
+    std::pair<int, size_t> getBlockIdAndPosInBlock(size_t i) {
         if (i == 0)
             return { 0, 0 };
         auto bitPos = mostSignificantBitPosition(i);
         auto blockId = std::max<int>(0, int(bitPos - smallestPower2 + 1));
-        auto posInBlock = (blockId == 0) ? i : (i - (1 << bitPos));
+        auto posInBlock = (blockId == 0) ? i : (i - (size_t(1) << bitPos));
         return { blockId, posInBlock };
     }
-    T& operator[](int i) {
+    T& operator[](size_t i) {
         auto [blockId, posInBlock] = getBlockIdAndPosInBlock(i);
         if (blockId >= blockCount) {
             std::unique_lock l{ mutex };
@@ -314,208 +255,341 @@ template<typename T> struct ThreadSafeVec {
     }
 };
 
-static int wideCharToUtf8(char* buf, int buf_size, unsigned int c) {
-    if (c < 0x80) {
-        buf[0] = (char)c;
-        return 1;
-    }
-    if (c < 0x800) {
-        if (buf_size < 2) return 0;
-        buf[0] = (char)(0xc0 + (c >> 6));
-        buf[1] = (char)(0x80 + (c & 0x3f));
-        return 2;
-    }
-    if (c < 0x10000) {
-        if (buf_size < 3) return 0;
-        buf[0] = (char)(0xe0 + (c >> 12));
-        buf[1] = (char)(0x80 + ((c >> 6) & 0x3f));
-        buf[2] = (char)(0x80 + ((c) & 0x3f));
-        return 3;
-    }
-    if (c <= 0x10FFFF) {
-        if (buf_size < 4) return 0;
-        buf[0] = (char)(0xf0 + (c >> 18));
-        buf[1] = (char)(0x80 + ((c >> 12) & 0x3f));
-        buf[2] = (char)(0x80 + ((c >> 6) & 0x3f));
-        buf[3] = (char)(0x80 + ((c) & 0x3f));
-        return 4;
-    }
-    return 0;
+// Upper bound of UTF-8 bytes per UTF-16 code unit (surrogate pairs take 4 bytes for 2 units)
+constexpr inline int MaxUtf8BytesPerUtf16Unit = 3;
+
+/*
+    Converts UTF-16LE to UTF-8 (not null terminated) and returns number of written bytes. Output needs room for
+    length * MaxUtf8BytesPerUtf16Unit bytes. Unpaired surrogates become U+FFFD, like in WideCharToMultiByte.
+    With AVX2, blocks of 16 or 8 ASCII units are converted with one pack, other blocks go unit by unit. While everything
+    so far was ASCII, the last short block is loaded overlapping already converted units, so most names never
+    reach the scalar loop
+*/
+static int utf16ToUtf8(char* out, const uint16_t* in, int length) {
+    auto outBegin = out;
+    int i = 0;
+    while (i < length) {
+        int blockEnd;
+#if defined(__AVX2__)
+        bool onlyAsciiSoFar = out - outBegin == i;
+        if (length - i >= 16 || (length >= 16 && onlyAsciiSoFar)) {
+            int blockStart = std::min(i, length - 16);
+            auto units = _mm256_loadu_si256((const __m256i*)(in + blockStart));
+            if (_mm256_testz_si256(units, _mm256_set1_epi16(int16_t(0xff80)))) {
+                out -= i - blockStart;
+                _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(_mm256_castsi256_si128(units), _mm256_extracti128_si256(units, 1)));
+                out += 16;
+                i = blockStart + 16;
+                continue;
+            }
+            blockEnd = blockStart + 16;
+        } else if (length - i >= 8 || (length >= 8 && onlyAsciiSoFar)) {
+            int blockStart = std::min(i, length - 8);
+            auto units = _mm_loadu_si128((const __m128i*)(in + blockStart));
+            if (_mm_testz_si128(units, _mm_set1_epi16(int16_t(0xff80)))) {
+                out -= i - blockStart;
+                _mm_storel_epi64((__m128i*)out, _mm_packus_epi16(units, units));
+                out += 8;
+                i = blockStart + 8;
+                continue;
+            }
+            blockEnd = blockStart + 8;
+        } else {
+            blockEnd = length;
+        }
+#else
+        blockEnd = length;
+#endif
+        while (i < blockEnd) {
+            uint32_t c = in[i++];
+            if (c < 0x80) {
+                *out++ = char(c);
+            } else if (c < 0x800) {
+                out[0] = char(0xc0 | (c >> 6));
+                out[1] = char(0x80 | (c & 0x3f));
+                out += 2;
+            } else {
+                if (c - 0xd800 < 0x800) { // surrogate
+                    if (c < 0xdc00 && i < length && uint32_t(in[i]) - 0xdc00 < 0x400) {
+                        c = 0x10000 + ((c - 0xd800) << 10) + (in[i++] - 0xdc00);
+                        out[0] = char(0xf0 | (c >> 18));
+                        out[1] = char(0x80 | ((c >> 12) & 0x3f));
+                        out[2] = char(0x80 | ((c >> 6) & 0x3f));
+                        out[3] = char(0x80 | (c & 0x3f));
+                        out += 4;
+                        continue;
+                    }
+                    c = 0xfffd;
+                }
+                out[0] = char(0xe0 | (c >> 12));
+                out[1] = char(0x80 | ((c >> 6) & 0x3f));
+                out[2] = char(0x80 | (c & 0x3f));
+                out += 3;
+            }
+        }
+    }
+    return int(out - outBegin);
 }
 
-static int wideStringToUtf8(char* buf, int buf_size, const wchar_t* in_text, const wchar_t* in_text_end) {
-    char* buf_out = buf;
-    const char* buf_end = buf + buf_size;
-    while (buf_out < buf_end - 1 && (!in_text_end || in_text < in_text_end) && *in_text)
-    {
-        unsigned int c = (unsigned int)(*in_text++);
-        if (c < 0x80)
-            *buf_out++ = (char)c;
-        else
-            buf_out += wideCharToUtf8(buf_out, (int)(buf_end - buf_out - 1), c);
-    }
-    *buf_out = 0;
-    return (int)(buf_out - buf);
+/*
+    Names in name tables start at multiples of NameAlignment bytes and are referred to by their offset / NameAlignment,
+    so 31-bit references (FileInfo keeps the top bit for the directory flag) address 8 GiB of names. Every name is its
+    length (see encodeNameLength), the name itself and a null terminator, padded with zeros to NameAlignment. Tables end with
+    NameTableTailPadding zero bytes, so 32-byte loads from anywhere inside a name stay within the table
+*/
+constexpr inline int NameAlignmentShift = 2;
+constexpr inline uint64_t NameAlignment = uint64_t(1) << NameAlignmentShift;
+constexpr inline uint32_t MaxNameReference = 0x7fffffff;
+constexpr inline uint64_t NameLengthSize = sizeof(uint32_t);
+constexpr inline uint64_t NameTableTailPadding = 32;
+
+// Length is stored 6 bits per byte, so no byte of it is a letter and lowercasing the whole table (see fastBigStringToLower) keeps it.
+// That limits names to 16 MiB
+static uint32_t encodeNameLength(size_t length) {
+    auto value = uint32_t(length);
+    return (value & 0x3f) | ((value << 2) & 0x3f00) | ((value << 4) & 0x3f0000) | ((value << 6) & 0x3f000000);
 }
 
+static size_t decodeNameLength(uint32_t encoded) {
+    return (encoded & 0x3f) | ((encoded >> 2) & 0xfc0) | ((encoded >> 4) & 0x3f000) | ((encoded >> 6) & 0xfc0000);
+}
 
+// Bytes taken by the name in a table, including its length, terminator and padding
+static uint64_t storedNameSize(size_t length) {
+    return (NameLengthSize + length + NameAlignment) & ~(NameAlignment - 1);
+}
 
+// Writes the name with its length and terminator to out, which must be zeroed up to storedNameSize
+static void storeName(char* out, std::string_view name) {
+    auto encodedLength = encodeNameLength(name.size());
+    memcpy(out, &encodedLength, sizeof(encodedLength));
+    memcpy(out + NameLengthSize, name.data(), name.size());
+}
 
+// Null terminated name
+static const char* nameAt(std::span<const char> nameTable, uint32_t nameReference) {
+    return nameTable.data() + (uint64_t(nameReference) << NameAlignmentShift) + NameLengthSize;
+}
 
-template <class T, std::size_t BufferSize = 1024>
-class PoolAllocator {
-    struct Block {
-        Block* next;
-    };
+static std::string_view nameViewAt(std::span<const char> nameTable, uint32_t nameReference) {
+    uint32_t encodedLength;
+    auto stored = nameTable.data() + (uint64_t(nameReference) << NameAlignmentShift);
+    memcpy(&encodedLength, stored, sizeof(encodedLength));
+    return std::string_view(stored + NameLengthSize, decodeNameLength(encodedLength));
+}
 
-    class Buffer {
-        static constexpr std::size_t BlockSize = std::max(sizeof(T), sizeof(Block));
-    public:
-        Buffer(Buffer* next) : next(next) {}
-        T* getBlock(std::size_t index) { return reinterpret_cast<T*>(&data[BlockSize * index]); }
+// Appends name to a table and returns its reference. The table keeps its tail padding
+static uint32_t appendName(std::string& nameTable, std::string_view name) {
+    if (nameTable.size() >= NameTableTailPadding)
+        nameTable.resize(nameTable.size() - NameTableTailPadding);
+    auto reference = uint32_t(nameTable.size() >> NameAlignmentShift);
+    nameTable.append(storedNameSize(name.size()) + NameTableTailPadding, '\0');
+    storeName(nameTable.data() + (uint64_t(reference) << NameAlignmentShift), name);
+    return reference;
+}
 
-        Buffer* next;
-    private:
-        alignas(T) alignas(Block) char data[BlockSize * BufferSize];
+/*
+    Concurrent string interner. Every distinct string is stored once, the same way as in name tables, in an arena of fixed size chunks,
+    so the returned reference is a stable name id and also the position of the string in the flattened table (see copyTo
+    and nameAt). The lookup table uses open addressing with linear probing. Each slot packs 31 bits of the hash with the reference,
+    so most mismatches are rejected without touching the arena. Inserting claims an empty slot with CAS and publishes
+    the reference once the string is written. When the table gets half full, one thread moves the entries to a twice
+    bigger table; inserts that reach an already moved slot wait for it to finish and retry there.
+*/
+class ConcurrentStringInterner {
+    static constexpr int ChunkBits = 20;
+    static constexpr uint32_t ChunkSize = 1u << ChunkBits;
+    static constexpr int ChunkReferenceBits = ChunkBits - NameAlignmentShift;
+    static constexpr int MaxChunkCount = 1 << (31 - ChunkReferenceBits);
+    static constexpr uint64_t TagMask = 0xffffffff'00000000;
+    static constexpr uint32_t PendingReference = 0xffffffff;
+    static constexpr uint64_t MovedSlot = ~uint64_t(0); // tags are 31 bits, so it can't be a valid slot
+
+    struct Table {
+        uint64_t mask;
+        std::atomic<int64_t> count = 0;
+        std::unique_ptr<std::atomic<uint64_t>[]> slots; // tag << 32 | (reference + 1), 0 means empty
+
+        Table(size_t capacity) : mask(capacity - 1), slots(new std::atomic<uint64_t>[capacity]()) {}
     };
 
-    Block* freeBlocksHead = nullptr;
-    Buffer* bufferHead = nullptr;
-    std::size_t indexInCurrentBuffer = BufferSize;
-
-public:
-    PoolAllocator() {};
-    PoolAllocator(const PoolAllocator&) = delete;
-    PoolAllocator operator=(const PoolAllocator&) = delete;
-
-    ~PoolAllocator() {
-        while (bufferHead) {
-            auto buffer = bufferHead;
-            bufferHead = buffer->next;
-            delete buffer;
+    std::atomic<Table*> table;
+    std::vector<std::unique_ptr<Table>> tables; // replaced tables are kept, other threads might still probe them
+    std::mutex growMutex;
+    std::unique_ptr<std::atomic<char*>[]> chunks;
+    std::atomic<uint32_t> arenaSize = 0; // in NameAlignment units
+
+    static uint64_t hashString(const char* str, int length) {
+        uint64_t hash = 0x9e3779b97f4a7c15 ^ uint64_t(length);
+        int i = 0;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t word;
+            memcpy(&word, str + i, 8);
+            hash = (hash ^ word) * 0xbf58476d1ce4e5b9;
+            hash ^= hash >> 31;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, str + i, length - i);
+        hash = (hash ^ tail) * 0x94d049bb133111eb;
+        hash ^= hash >> 29;
+        hash *= 0xbf58476d1ce4e5b9;
+        return hash ^ (hash >> 32);
+    }
+    static uint64_t tagOf(uint64_t hash) {
+        return (hash >> 33) << 32;
+    }
+
+    char* ensureChunk(uint32_t chunk) {
+        auto ptr = chunks[chunk].load(std::memory_order_acquire);
+        if (ptr)
+            return ptr;
+        auto newChunk = new char[ChunkSize]();
+        if (chunks[chunk].compare_exchange_strong(ptr, newChunk, std::memory_order_acq_rel))
+            return newChunk;
+        delete[] newChunk;
+        return ptr;
+    }
+
+    // Strings never cross chunk boundaries. When one would, the rest of the chunk is left as zeros (empty strings)
+    uint32_t allocate(int length) {
+        auto units = uint32_t(storedNameSize(length) >> NameAlignmentShift);
+        while (true) {
+            auto reference = arenaSize.fetch_add(units, std::memory_order_relaxed);
+            auto chunk = reference >> ChunkReferenceBits;
+            ensureChunk(chunk);
+            if (((reference + units - 1) >> ChunkReferenceBits) == chunk)
+                return reference;
         }
     }
 
-    T* allocate() {
-        if (freeBlocksHead) {
-            auto block = freeBlocksHead;
-            freeBlocksHead = block->next;
-            return reinterpret_cast<T*>(block);
-        }
-        if (indexInCurrentBuffer >= BufferSize) {
-            bufferHead = new Buffer(bufferHead);
-            indexInCurrentBuffer = 0;
+    // Start of the stored string, its length comes first
+    char* slotAt(uint32_t reference) const {
+        return chunks[reference >> ChunkReferenceBits].load(std::memory_order_acquire) + (uint64_t(reference & ((1u << ChunkReferenceBits) - 1)) << NameAlignmentShift);
+    }
+
+    bool matches(uint32_t reference, const char* str, int length) const {
+        return at(reference) == std::string_view(str, length);
+    }
+
+    // Returns false if the table was replaced in the meantime
+    bool internInto(Table& t, const char* str, int length, uint64_t hash, uint32_t& result) {
+        auto tag = tagOf(hash);
+        for (auto i = hash & t.mask;; i = (i + 1) & t.mask) {
+            auto slot = t.slots[i].load(std::memory_order_acquire);
+            if (slot == 0) {
+                if (!t.slots[i].compare_exchange_strong(slot, tag | PendingReference, std::memory_order_acq_rel)) {
+                    i = (i - 1) & t.mask; // look at the same slot again
+                    continue;
+                }
+                auto reference = allocate(length);
+                storeName(slotAt(reference), std::string_view(str, length));
+                t.slots[i].store(tag | (reference + 1), std::memory_order_release);
+                if (t.count.fetch_add(1, std::memory_order_relaxed) + 1 > int64_t(t.mask / 2))
+                    grow(&t);
+                result = reference;
+                return true;
+            }
+            if (slot == MovedSlot)
+                return false;
+            if ((slot & TagMask) != tag)
+                continue;
+            while (uint32_t(slot) == PendingReference) {
+                std::this_thread::yield();
+                slot = t.slots[i].load(std::memory_order_acquire);
+            }
+            if (matches(uint32_t(slot) - 1, str, length)) {
+                result = uint32_t(slot) - 1;
+                return true;
+            }
         }
-        return bufferHead->getBlock(indexInCurrentBuffer++);
     }
 
-    void deallocate(T* ptr) {
-        auto block = reinterpret_cast<Block*>(ptr);
-        block->next = freeBlocksHead;
-        freeBlocksHead = block;
+    void insertMoved(Table& t, uint64_t slot) {
+        auto stored = at(uint32_t(slot) - 1);
+        auto hash = hashString(stored.data(), int(stored.size()));
+        auto i = hash & t.mask;
+        while (t.slots[i].load(std::memory_order_relaxed) != 0)
+            i = (i + 1) & t.mask;
+        t.slots[i].store(slot, std::memory_order_relaxed);
     }
-};
-
-template<typename T> struct FastThreadSafeishHashSet {
-    struct Node {
-        Node(const T& value) { new (&value_) T(value); }
-        ~Node() { value().~T(); }
-        Node(const Node&) = delete;
-        Node& operator=(const Node&) = delete;
-        T& value() { return *(T*)value_; }
-
-        Node* next = nullptr;
-    private:
-        alignas(T) char value_[sizeof(T)];
-    };
 
-private:
-    Node** data;
-    int capacity_;
-    PoolAllocator<Node, sizeof(T) * 8192> allocator;
-    std::mutex mutex;
-
-    static constexpr int InitialCapacity = 256;
-    static constexpr double ResizeThreshold = 0.8;
+    void grow(Table* oldTable) {
+        std::lock_guard l{ growMutex };
+        if (table.load(std::memory_order_acquire) != oldTable)
+            return;
+        auto newTable = std::make_unique<Table>(2 * (oldTable->mask + 1));
+        int64_t count = 0;
+        for (size_t i = 0; i <= oldTable->mask; ++i) {
+            uint64_t slot = 0;
+            if (oldTable->slots[i].compare_exchange_strong(slot, MovedSlot, std::memory_order_acq_rel))
+                continue;
+            while (uint32_t(slot) == PendingReference) {
+                std::this_thread::yield();
+                slot = oldTable->slots[i].load(std::memory_order_acquire);
+            }
+            insertMoved(*newTable, slot);
+            count += 1;
+        }
+        newTable->count = count;
+        table.store(newTable.get(), std::memory_order_release);
+        tables.push_back(std::move(newTable));
+    }
 
 public:
-    FastThreadSafeishHashSet() : data(allocData(InitialCapacity)), capacity_(InitialCapacity) {}
-    FastThreadSafeishHashSet(int power2InitialCapacity) : data(allocData(1 << power2InitialCapacity)), capacity_(1 << power2InitialCapacity) {}
-
-    Node*& node(int index) { return data[index]; }
-    Node*& node(Node** data_, int index) { return data_[index]; }
-    T& at(int index) { return node(index)->value(); }
-    T& at(Node** data_, int index) { return node(data_, index)->value(); }
-    Node*& next(int index) { return node(index)->next; }
-    Node*& next(Node** data_, int index) { return node(data_, index)->next; }
-    int capacity() { return capacity_; }
-
-    Node** allocData(int size) {
-        auto x = (Node**)::operator new(size * sizeof(Node*), std::align_val_t(alignof(Node*)));
-        memset(x, 0, size * sizeof(Node*));
-        return x;
-    }
-    void deallocData(Node** data) {
-        ::operator delete(data, capacity_ * sizeof(Node*), std::align_val_t(alignof(Node*)));
-    }
-    Node* allocNode(T&& value) {
-        auto node = allocator.allocate();
-        new (node) Node(std::move(value));
-        return node;
-    }
-    Node* allocNode(const T& value) {
-        allocNode(T(value));
-    }
-    void deallocNode(Node* node) {
-        node->~Node();
-        allocator.deallocate(node);
+    ConcurrentStringInterner(size_t expectedCount = 1024) : chunks(new std::atomic<char*>[MaxChunkCount]()) {
+        tables.push_back(std::make_unique<Table>(std::bit_ceil(std::max<size_t>(2 * expectedCount, 64))));
+        table = tables.back().get();
+    }
+    ConcurrentStringInterner(const ConcurrentStringInterner&) = delete;
+    ConcurrentStringInterner& operator=(const ConcurrentStringInterner&) = delete;
+    ~ConcurrentStringInterner() {
+        for (int i = 0; i < MaxChunkCount; ++i)
+            delete[] chunks[i].load();
+    }
+
+    // Makes room for expectedCount strings up front. Not thread safe, call before interning concurrently
+    void reserve(size_t expectedCount) {
+        auto t = table.load();
+        while (2 * expectedCount > t->mask + 1) {
+            grow(t);
+            t = table.load();
+        }
     }
 
-    std::size_t hash(const T& value) {
-        return std::hash<T>{}(value);
-    }
-    std::size_t getIndexWithCapacity(const T& value, std::size_t capacity) {
-        return hash(value) & (capacity - 1);
+    // Returns reference of the string in the arena, the same for all equal strings
+    uint32_t intern(const char* str, int length) {
+        auto hash = hashString(str, length);
+        uint32_t result;
+        while (!internInto(*table.load(std::memory_order_acquire), str, length, hash, result)) {
+            std::lock_guard l{ growMutex }; // the table is replaced before this mutex is released
+        }
+        return result;
     }
-    std::size_t modIndex(std::size_t index) {
-        return index & (capacity_ - 1);
+
+    std::string_view at(uint32_t reference) const {
+        uint32_t encodedLength;
+        auto stored = slotAt(reference);
+        memcpy(&encodedLength, stored, sizeof(encodedLength));
+        return std::string_view(stored + NameLengthSize, decodeNameLength(encodedLength));
     }
-    std::size_t getIndex(const T& value) {
-        return modIndex(hash(value));
+
+    // Number of distinct strings
+    int64_t size() const {
+        return table.load()->count;
     }
 
-    T* find(const T& value) {
-        auto i = getIndex(value);
-        Node* n = node(i);
-        while (n) {
-            if (n->value() == value)
-                return &n->value();
-            n = n->next;
-        }
-        return nullptr;
+    // Size of the flattened table, including gaps left at the end of chunks
+    uint64_t arenaSizeInBytes() const {
+        return uint64_t(arenaSize.load()) << NameAlignmentShift;
     }
 
-    void emplace(T&& value) {
-        auto i = getIndex(value);
-        auto n = node(i);
-        Node* allocatedNode;
-        {
-            std::scoped_lock l{ mutex };
-            allocatedNode = allocNode(std::move(value));
+    // Copies the arena into one contiguous table with tail padding, references returned by intern() index into it (see nameAt)
+    void copyTo(std::string& out) const {
+        auto size = arenaSizeInBytes();
+        out.assign(size + NameTableTailPadding, '\0');
+        for (uint64_t offset = 0; offset < size; offset += ChunkSize) {
+            if (auto chunk = chunks[offset >> ChunkBits].load())
+                memcpy(out.data() + offset, chunk, std::min<uint64_t>(ChunkSize, size - offset));
         }
-        // This is not thread safe, but good enough in practice.
-        // worst case what happens is I will add into same location twice which will result in orphan node which won't be findable,
-        // or it will add duplicate of the same node.
-        // however niether is a big problem, because orphan pointers are going to get deallocated anyway and having some duplicates
-        // is not a problem.
-        if (!n) {
-            node(i) = allocatedNode;
-            return;
-        }
-        while (n->next) {
-            n = n->next;
-        };
-        n->next = allocatedNode;
     }
 };
-
@@ -3,6 +3,7 @@
 #define NOMINMAX
 #include <windows.h>
 #include <shellapi.h>
+#include <psapi.h>
 
 #ifndef max
 #define max(a,b) (((a) > (b)) ? (a) : (b))
@@ -17,3 +18,4 @@
 #undef max
 
 #pragma comment(lib,"gdiplus.lib")
+#pragma comment(lib,"psapi.lib")